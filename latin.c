@@ -1,9 +1,12 @@
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
-#include <stdarg.h>
+#include <time.h>
+#ifdef LATIN_THREADS
+#include <pthread.h>
+#endif
 
 #include "puzzles.h"
-#include "tree234.h"
 #include "matching.h"
 
 #ifdef STANDALONE_LATIN_TEST
@@ -22,94 +25,288 @@ static int latin_solver_top(struct latin_solver *solver, int maxdiff,
 			    usersolver_t const *usersolvers, void *ctx,
 			    ctxnew_t ctxnew, ctxfree_t ctxfree);
 
-#ifdef STANDALONE_SOLVER
-int solver_show_working, solver_recurse_depth;
+static const char *const latin_technique_names[LATIN_NTECH] = {
+    "positional elimination",
+    "numeric elimination",
+    "set elimination",
+    "positional set elimination",
+    "forcing chains",
+    "blank cells deduction",
+    "required cells deduction",
+    "puzzle-specific deductions",
+};
+
+const char *latin_technique_name(int tech)
+{
+    assert(tech >= 0 && tech < LATIN_NTECH);
+    return latin_technique_names[tech];
+}
+
+/*
+ * Wall-clock time in seconds from some arbitrary origin, for timing
+ * the solver.
+ */
+static double latin_solver_time(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void latin_solver_report(struct latin_solver *solver, int type,
+                         int tech, int unit, int idx,
+                         int x, int y, int n,
+                         const int *list, int nlist)
+{
+    struct latin_solver_event ev;
+
+    ev.type = type;
+    ev.tech = tech;
+    ev.unit = unit;
+    ev.idx = idx;
+    ev.x = x;
+    ev.y = y;
+    ev.n = n;
+    ev.level = solver->recurse_depth;
+    ev.list = list;
+    ev.nlist = nlist;
+    ev.o = solver->o;
+    ev.grid = (type == LATIN_EV_RESULT ? solver->grid : NULL);
+    ev.solver = solver;
+
+    solver->trace(solver->tracectx, &ev);
+}
+
+/*
+ * Report the start of a positional or numeric elimination in the
+ * section of the cube beginning at 'start'.
+ */
+static void latin_solver_report_unit(struct latin_solver *solver, int tech,
+                                     int unit, int idx, int start)
+{
+    int o = solver->o, x = -1, y = -1, n = 0;
+
+    if (unit == LATIN_UNIT_CELL) {
+        x = idx % o;
+        y = idx / o;
+    } else
+        n = 1 + start % o;
+
+    latin_solver_report(solver, LATIN_EV_DEDUCE, tech, unit, idx,
+                        x, y, n, NULL, 0);
+}
+
+/*
+ * Note a contradiction found in a row, column or cell, for the
+ * LATIN_BRANCH_DOMWDEG heuristic.
+ */
+static void latin_solver_conflict(struct latin_solver *solver,
+                                  int unit, int idx)
+{
+    struct latin_solver_search *search = solver->search;
+    int o = solver->o;
+
+    if (!search || !search->weights)
+        return;
+    if (unit == LATIN_UNIT_ROW)
+        search->weights[idx]++;
+    else if (unit == LATIN_UNIT_COL)
+        search->weights[o + idx]++;
+    else if (unit == LATIN_UNIT_CELL)
+        search->weights[2*o + idx]++;
+}
+
+/*
+ * The simplest deductions do most of the solver's work, so their
+ * kernels are written once as inline functions taking the order as
+ * a parameter, and then instantiated below with a constant order for
+ * each size the games normally use. That lets the compiler fold the
+ * cube strides and unroll the loops; other orders use the generic
+ * instantiation. Inside the kernels the cube must be indexed through
+ * LATIN_CUBEPOS with the local o, not cubepos, or the constant is lost.
+ */
+#if defined(__GNUC__)
+#define LATIN_KERNEL static inline __attribute__((always_inline))
+#else
+#define LATIN_KERNEL static inline
+#endif
+#define LATIN_CUBEPOS(o,x,y,n) ((((x)*(o))+(y))*(o)+(n)-1)
+
+/*
+ * Transposition table (see latin.h). There is a Zobrist key for each
+ * cube position, XORed into the hash when that candidate is ruled out,
+ * followed by one for each cell XORed in when the cell is marked as
+ * needing a number, and one more for each cell for marking it blank.
+ */
+enum { LATIN_TT_EMPTY, LATIN_TT_IMPOSSIBLE, LATIN_TT_UNIQUE };
+
+struct latin_tt_entry {
+    unsigned long long key;
+    long work;                  /* guesses it took to search */
+    int result;                 /* LATIN_TT_* */
+};
+
+struct latin_solver_tt {
+    int o, policy;
+    unsigned long long *keys;   /* o^3 + 2 o^2 */
+    struct latin_tt_entry *entries;
+    digit *solns;               /* o^2 per entry, for LATIN_TT_UNIQUE */
+    size_t mask;                /* number of entries, less one */
+    long guesses;               /* made so far by searches using this */
+};
+
+#ifdef SEMI_LATIN
+#define LATIN_MASK_BITS ((int)(sizeof(latin_mask) * CHAR_BIT))
+#define LATIN_MASK_ALL(o) \
+    ((o) >= LATIN_MASK_BITS ? ~(latin_mask)0 : ((latin_mask)1 << (o)) - 1)
+
+static inline int latin_popcount(latin_mask m)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountl(m);
+#else
+    int count = 0;
+    while (m) {
+        m &= m - 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+LATIN_KERNEL void latin_solver_mark_force_o(struct latin_solver *solver,
+                                            int x, int y, const int o)
+{
+    int pos = y*o+x;
+
+    assert(!solver->forbid[pos]);
+    if (!solver->force[pos]) {
+        solver->force[pos] = true;
+        solver->rowforce[y] |= (latin_mask)1 << x;
+        solver->colforce[x] |= (latin_mask)1 << y;
+        if (solver->tt)
+            solver->zobrist ^= solver->tt->keys[o*o*o + pos];
+    }
+}
+
+LATIN_KERNEL int latin_solver_mark_forbid_o(struct latin_solver *solver,
+                                            int x, int y, const int o)
+{
+    int pos = y*o+x, n, count = 0;
+
+    assert(!solver->force[pos]);
+    if (!solver->forbid[pos]) {
+        solver->forbid[pos] = true;
+        solver->rowforbid[y] |= (latin_mask)1 << x;
+        solver->colforbid[x] |= (latin_mask)1 << y;
+        if (solver->tt)
+            solver->zobrist ^= solver->tt->keys[o*o*o + o*o + pos];
+        for (n = 1; n <= solver->depth; n++)
+            if (solver->cube[LATIN_CUBEPOS(o,x,y,n)]) {
+                solver->cube[LATIN_CUBEPOS(o,x,y,n)] = false;
+                if (solver->tt)
+                    solver->zobrist ^=
+                        solver->tt->keys[LATIN_CUBEPOS(o,x,y,n)];
+                count++;
+            }
+        solver->ncand[pos] = 0;
+    }
+    return count;
+}
+#endif
+
+LATIN_KERNEL void latin_solver_rule_out_o(struct latin_solver *solver,
+                                          int x, int y, int n, const int o)
+{
+    int cp = LATIN_CUBEPOS(o,x,y,n);
+
+    if (solver->cube[cp]) {
+        solver->cube[cp] = false;
+        if (solver->tt)
+            solver->zobrist ^= solver->tt->keys[cp];
+#ifdef SEMI_LATIN
+        /*
+         * A cell with nothing left to hold is blank, unless it has
+         * to hold something, in which case numeric elimination will
+         * find the contradiction. On a full latin square no cell may
+         * be blank.
+         */
+        if (--solver->ncand[y*o+x] == 0 && !solver->force[y*o+x] &&
+            solver->depth < o)
+            latin_solver_mark_forbid_o(solver, x, y, o);
 #endif
+    }
+}
 
 #ifdef SEMI_LATIN
 /* 
  * First it is necessary to deduce in which cells we must or musn't place a value.
  * Otherwise the solver would not be able to make any deductions, except positional elimination.
  * On full latin square these routines are redundant.
+ *
+ * The row and column masks of forced and forbidden cells make the
+ * counting here cheap. Cells which have run out of candidates were
+ * already marked blank as they did so.
  */
- 
+
 /* 
  * Figure out which cells must be forbidden from given forced cells.
  */
-int latin_solver_assign_forbid(struct latin_solver *solver, int start, int step
-#ifdef STANDALONE_SOLVER
-		      , const char *fmt, ...
-#endif
-			  )
+LATIN_KERNEL int latin_solver_assign_forbid_o(struct latin_solver *solver,
+					       int unit, int idx, const int o)
 {
-	int ret = 0, o = solver->o, depth = solver->depth, count, i, n, pos;
-	bool *forbid = solver->forbid;
-	bool *force = solver->force;
+	int ret = 0, depth = solver->depth, count, i, x, y, elim;
+	bool rowwise = (unit == LATIN_UNIT_ROW);
+	latin_mask force = rowwise ? solver->rowforce[idx] : solver->colforce[idx];
+	latin_mask forbid = rowwise ? solver->rowforbid[idx] : solver->colforbid[idx];
+	latin_mask open;
 	
-	count = 0;
+	count = latin_popcount(force);
 	
-	for(i = 0; i < o; i++)
-	if(force[start + i*step])
-		count++;
-	
-	ret = 0;
 	if(count == depth)
 	{
-	for(i = 0; i < o; i++)
-	{
-	pos = start + i*step;
-	if(!force[pos] && !forbid[pos])
+	open = LATIN_MASK_ALL(o) & ~(force | forbid);
+	for(i = 0; open; i++, open >>= 1)
 	{
-	#ifdef STANDALONE_SOLVER
-		if(solver_show_working)
+	if(!(open & 1))
+		continue;
+	x = rowwise ? i : idx;
+	y = rowwise ? idx : i;
+	
+		if(solver->trace)
 		{
 			if(ret == 0)
-			{
-				va_list ap;
-				printf("%*s", solver_recurse_depth*4, "");
-                va_start(ap, fmt);
-                vprintf(fmt, ap);
-                va_end(ap);
-				printf(":\n%*s  forbiding placement at", solver_recurse_depth*4, "");
-				printf(" (%d,%d)", pos%o+1, pos/o+1);
-			}
-			else
-				printf(", (%d,%d)", pos%o+1, pos/o+1);
+				latin_solver_report(solver, LATIN_EV_DEDUCE, LATIN_TECH_FORBID,
+									unit, idx, -1, -1, 0, NULL, 0);
+			latin_solver_report(solver, LATIN_EV_FORBID, LATIN_TECH_FORBID,
+								unit, idx, x, y, 0, NULL, 0);
 		}
-	#endif
 	
-		assert(!force[pos]);
-		
-		for(n = 1; n <= depth; n++)
-			cube(pos%o, pos/o, n) = false;
-	
-		
-		forbid[pos] = true;
+		elim = latin_solver_mark_forbid_o(solver, x, y, o);
+		if(solver->stats) {
+			solver->stats->eliminations[LATIN_TECH_FORBID] += elim;
+			solver->stats->placements[LATIN_TECH_FORBID]++;
+		}
 		
 		ret = 1;
 	}
-	}
-	#ifdef STANDALONE_SOLVER
-		if(solver_show_working)
-			if(ret) printf("\n");
-	#endif
+		if(ret && solver->stats)
+			solver->stats->steps[LATIN_TECH_FORBID]++;
 	}else if (count > depth) {
-	#ifdef STANDALONE_SOLVER
-		if(solver_show_working)
+		if(solver->trace)
 		{
-			va_list ap;
-			printf("%*s", solver_recurse_depth*4, "");
-            va_start(ap, fmt);
-            vprintf(fmt, ap);
-            va_end(ap);
-			printf(":\n%*s  cannot have more forced cells than depth of the puzzle", solver_recurse_depth*4, "");
+			latin_solver_report(solver, LATIN_EV_DEDUCE, LATIN_TECH_FORBID,
+								unit, idx, -1, -1, 0, NULL, 0);
+			latin_solver_report(solver, LATIN_EV_CONTRADICTION, LATIN_TECH_FORBID,
+								unit, idx, -1, -1, 0, NULL, 0);
 		}
-	#endif
+		latin_solver_conflict(solver, unit, idx);
 		return -1;
 	}
-		
-	
-
 	
 	return ret;
 }
@@ -117,82 +314,52 @@ int latin_solver_assign_forbid(struct latin_solver *solver, int start, int step
 /* 
  * Figure out which cells must be forced given forbidden cells.
  */
-int latin_solver_assign_force(struct latin_solver *solver, int start, int step
-#ifdef STANDALONE_SOLVER
-		      , const char *fmt, ...
-#endif
-)
+LATIN_KERNEL int latin_solver_assign_force_o(struct latin_solver *solver,
+					      int unit, int idx, const int o)
 {
-	int ret = 0, o = solver->o, depth = solver->depth, count, i, n, pos;
-	bool *forbid = solver->forbid;
-	bool *force = solver->force;
-	
-	count = 0;
-	for(i = 0; i < o; i++) 
-	{
-	pos = start+i*step;
-	if(forbid[pos])
-		count++;
-	else if(!force[pos])
-	{
-		for(n = 1; n <= depth; n++) /* might not have labeled the cell as forbidden, so check this here */
-		if(cube(pos%o, pos/o, n))
-			break;
+	int ret = 0, depth = solver->depth, count, i, x, y;
+	bool rowwise = (unit == LATIN_UNIT_ROW);
+	latin_mask force = rowwise ? solver->rowforce[idx] : solver->colforce[idx];
+	latin_mask forbid = rowwise ? solver->rowforbid[idx] : solver->colforbid[idx];
+	latin_mask open;
 	
-		if(n == solver->depth+1)
-		{
-			forbid[pos] = true;
-			count++;
-		}
-	}
-	}
+	count = latin_popcount(forbid);
 	
 	if(o-count == depth)
 	{
-	for(i = 0; i < o; i++)
+	open = LATIN_MASK_ALL(o) & ~(force | forbid);
+	for(i = 0; open; i++, open >>= 1)
 	{
-		pos = start+i*step;
-		if(!force[pos] && !forbid[pos])
-		{
-#ifdef STANDALONE_SOLVER
-		if(solver_show_working)
-		{
-			if(ret == 0)
+		if(!(open & 1))
+			continue;
+		x = rowwise ? i : idx;
+		y = rowwise ? idx : i;
+		
+			if(solver->trace)
 			{
-				va_list ap;
-				printf("%*s", solver_recurse_depth*4, "");
-                va_start(ap, fmt);
-                vprintf(fmt, ap);
-                va_end(ap);
-				printf(":\n%*s  imposing some placement at", solver_recurse_depth*4, "");
-				printf(" (%d,%d)", pos%o+1, pos/o+1);
+				if(ret == 0)
+					latin_solver_report(solver, LATIN_EV_DEDUCE, LATIN_TECH_FORCE,
+										unit, idx, -1, -1, 0, NULL, 0);
+				latin_solver_report(solver, LATIN_EV_FORCE, LATIN_TECH_FORCE,
+									unit, idx, x, y, 0, NULL, 0);
 			}
-			else
-				printf(", (%d,%d)", pos%o+1, pos/o+1);
-		}
-#endif
-			assert(!forbid[pos]);
 			
-			force[pos] = true;
+			latin_solver_mark_force_o(solver, x, y, o);
+			if(solver->stats)
+				solver->stats->placements[LATIN_TECH_FORCE]++;
 			ret = 1;
-		}
 	}
-	#ifdef STANDALONE_SOLVER
-		if(solver_show_working)
-			if(ret) printf("\n");
-	#endif
+		if(ret && solver->stats)
+			solver->stats->steps[LATIN_TECH_FORCE]++;
 	} else if(o-count<depth) {
-	#ifdef STANDALONE_SOLVER
-		if(solver_show_working)
+		if(solver->trace)
 		{
-				va_list ap;
-				printf("%*s", solver_recurse_depth*4, "");
-                va_start(ap, fmt);
-                vprintf(fmt, ap);
-                va_end(ap);
-				printf(":\n%*s  cannot have more forbidden cells than o-depth", solver_recurse_depth*4, "");
+			latin_solver_report(solver, LATIN_EV_DEDUCE, LATIN_TECH_FORCE,
+								unit, idx, -1, -1, 0, NULL, 0);
+			latin_solver_report(solver, LATIN_EV_CONTRADICTION, LATIN_TECH_FORCE,
+								unit, idx, -1, -1, 0, NULL, 0);
 		}
-	#endif
+		latin_solver_conflict(solver, unit, idx);
 		return -1;
 	}
 	
@@ -206,33 +373,34 @@ int latin_solver_assign_force(struct latin_solver *solver, int start, int step
  * a particular number in it. The y-coordinate passed in here is
  * transformed.
  */
-void latin_solver_place(struct latin_solver *solver, int x, int y, int n)
+LATIN_KERNEL void latin_solver_place_o(struct latin_solver *solver,
+                                       int x, int y, int n, const int o)
 {
-    int i, o = solver->o;
+    int i;
 
     assert(n <= o);
-    assert(cube(x,y,n));
+    assert(solver->cube[LATIN_CUBEPOS(o,x,y,n)]);
 
     /*
      * Rule out all other numbers in this square.
      */
     for (i = 1; i <= o; i++)
 	if (i != n)
-            cube(x,y,i) = false;
+            latin_solver_rule_out_o(solver, x, y, i, o);
 
     /*
      * Rule out this number in all other positions in the row.
      */
     for (i = 0; i < o; i++)
 	if (i != y)
-            cube(x,i,n) = false;
+            latin_solver_rule_out_o(solver, x, i, n, o);
 
     /*
      * Rule out this number in all other positions in the column.
      */
     for (i = 0; i < o; i++)
 	if (i != x)
-            cube(i,y,n) = false;
+            latin_solver_rule_out_o(solver, i, y, n, o);
 
     /*
      * Enter the number in the result grid.
@@ -250,20 +418,16 @@ void latin_solver_place(struct latin_solver *solver, int x, int y, int n)
 	 * When the value is placed then the cell should be marked as forced.
 	 * This is important in some of the other deduction routines.
 	 */
-	solver->force[y*o+x] = true;
+	latin_solver_mark_force_o(solver, x, y, o);
 	#endif
 }
 
-int latin_solver_elim(struct latin_solver *solver, int start, int step
-#ifdef STANDALONE_SOLVER
-		      , const char *fmt, ...
-#endif
-		      )
+LATIN_KERNEL int latin_solver_elim_o(struct latin_solver *solver,
+                                     int start, int step,
+                                     int unit, int idx, const int o)
 {
-    int o = solver->o;
-#ifdef STANDALONE_SOLVER
-    char **names = solver->names;
-#endif
+    int tech = (unit == LATIN_UNIT_CELL ? LATIN_TECH_NUMERIC :
+                LATIN_TECH_POSITIONAL);
     int fpos, m, i;
 
     /*
@@ -288,33 +452,25 @@ int latin_solver_elim(struct latin_solver *solver, int start, int step
 	y %= o;
 
         if (!solver->grid[y*o+x]) {
-#ifdef STANDALONE_SOLVER
-            if (solver_show_working) {
-                va_list ap;
-		printf("%*s", solver_recurse_depth*4, "");
-                va_start(ap, fmt);
-                vprintf(fmt, ap);
-                va_end(ap);
-                printf(":\n%*s  placing %s at (%d,%d)\n",
-                       solver_recurse_depth*4, "", names[n-1],
-		       x+1, y+1);
+            if (solver->trace) {
+                latin_solver_report_unit(solver, tech, unit, idx, start);
+                latin_solver_report(solver, LATIN_EV_PLACE, tech, unit, idx,
+                                    x, y, n, NULL, 0);
+            }
+            latin_solver_place_o(solver, x, y, n, o);
+            if (solver->stats) {
+                solver->stats->steps[tech]++;
+                solver->stats->placements[tech]++;
             }
-#endif
-            latin_solver_place(solver, x, y, n);
             return +1;
         }
     } else if (m == 0) {
-#ifdef STANDALONE_SOLVER
-	if (solver_show_working) {
-	    va_list ap;
-	    printf("%*s", solver_recurse_depth*4, "");
-	    va_start(ap, fmt);
-	    vprintf(fmt, ap);
-	    va_end(ap);
-	    printf(":\n%*s  no possibilities available\n",
-		   solver_recurse_depth*4, "");
-	}
-#endif
+        if (solver->trace) {
+            latin_solver_report_unit(solver, tech, unit, idx, start);
+            latin_solver_report(solver, LATIN_EV_CONTRADICTION, tech,
+                                unit, idx, -1, -1, 0, NULL, 0);
+        }
+        latin_solver_conflict(solver, unit, idx);
         return -1;
     }
 
@@ -322,29 +478,22 @@ int latin_solver_elim(struct latin_solver *solver, int start, int step
 }
 
 struct latin_solver_scratch {
+    struct latin_solver_arena *arena;  /* which it came from */
     unsigned char *grid, *rowidx, *colidx, *set;
 #ifdef SEMI_LATIN
 	unsigned char *forceidx;
 #endif
-    int *neighbours, *bfsqueue;
-#ifdef STANDALONE_SOLVER
-    int *bfsprev;
-#endif
+    int *neighbours, *bfsqueue, *bfsprev;
 };
 
 int latin_solver_set(struct latin_solver *solver,
                      struct latin_solver_scratch *scratch,
-                     int start, int step1, int step2
-#ifdef STANDALONE_SOLVER
-                     , const char *fmt, ...
-#endif
-                     )
+                     int start, int step1, int step2, int unit, int idx)
 {
     int o = solver->o;
-#ifdef STANDALONE_SOLVER
-    char **names = solver->names;
-#endif
     int i, j, n, count;
+    int tech = (unit == LATIN_UNIT_NUMBER ? LATIN_TECH_POSITIONAL_SET :
+                LATIN_TECH_SET);
     unsigned char *grid = scratch->grid;
     unsigned char *rowidx = scratch->rowidx;
     unsigned char *colidx = scratch->colidx;
@@ -358,8 +507,16 @@ int latin_solver_set(struct latin_solver *solver,
 	/*
 	 * In the deduction routine we only want to count rows 
 	 * which we know _must_ have some value.
+	 *
+	 * When looking at a single number, each row of the matrix is a
+	 * row or column of the grid, and every number up to the depth
+	 * appears exactly once in each of those whether or not we know
+	 * which cells are blank yet. So all the rows count.
 	 */
 	memset(forceidx, false, o);
+	if (unit == LATIN_UNIT_NUMBER)
+		memset(forceidx, true, o);
+	else
 	for (i = 0; i < o; i++)
 	{
 		int fpos = start+i*step1;
@@ -385,12 +542,21 @@ int latin_solver_set(struct latin_solver *solver,
             if (solver->cube[start+i*step1+j*step2])
                 first = j, count++;
 
-	if (count == 0) 
-#if !defined SEMI_LATIN
-		return -1;
-#else
+#ifdef SEMI_LATIN
+	if (count == 0 && !forceidx[i])
 		rowidx[i] = false;
+	else
 #endif
+	if (count == 0) {
+	    /* A row which must hold a value has nowhere left for one. */
+	    if (solver->trace) {
+		latin_solver_report(solver, LATIN_EV_DEDUCE, tech, unit, idx,
+				    -1, -1, 0, NULL, 0);
+		latin_solver_report(solver, LATIN_EV_CONTRADICTION, tech,
+				    unit, idx, -1, -1, 0, NULL, 0);
+	    }
+	    return -1;
+	}
 		
     	if (count == 1
 #ifdef SEMI_LATIN
@@ -478,18 +644,13 @@ int latin_solver_set(struct latin_solver *solver,
              * even a bogus clue.
              */
             if (rows > n - count) {
-#ifdef STANDALONE_SOLVER
-		if (solver_show_working) {
-		    va_list ap;
-		    printf("%*s", solver_recurse_depth*4,
-			   "");
-		    va_start(ap, fmt);
-		    vprintf(fmt, ap);
-		    va_end(ap);
-		    printf(":\n%*s  contradiction reached\n",
-			   solver_recurse_depth*4, "");
+		if (solver->trace) {
+		    latin_solver_report(solver, LATIN_EV_DEDUCE, tech, unit, idx,
+					-1, -1, 0, NULL, 0);
+		    latin_solver_report(solver, LATIN_EV_CONTRADICTION, tech,
+					unit, idx, -1, -1, 0, NULL, 0);
 		}
-#endif
+		latin_solver_conflict(solver, unit, idx);
 		return -1;
 	    }
 
@@ -530,37 +691,36 @@ int latin_solver_set(struct latin_solver *solver,
                             if (!set[j] && grid[i*o+j]) {
                                 int fpos = (start+rowidx[i]*step1+
                                             colidx[j]*step2);
-#ifdef STANDALONE_SOLVER
-                                if (solver_show_working) {
-                                    int px, py, pn;
-
-                                    if (!progress) {
-                                        va_list ap;
-					printf("%*s", solver_recurse_depth*4,
-					       "");
-                                        va_start(ap, fmt);
-                                        vprintf(fmt, ap);
-                                        va_end(ap);
-                                        printf(":\n");
-                                    }
-
-                                    pn = 1 + fpos % o;
-                                    py = fpos / o;
-                                    px = py / o;
-                                    py %= o;
-
-                                    printf("%*s  ruling out %s at (%d,%d)\n",
-					   solver_recurse_depth*4, "",
-                                           names[pn-1], px+1, py+1);
+                                int px, py, pn;
+
+                                pn = 1 + fpos % o;
+                                py = fpos / o;
+                                px = py / o;
+                                py %= o;
+
+                                if (solver->trace) {
+                                    if (!progress)
+                                        latin_solver_report(
+                                            solver, LATIN_EV_DEDUCE, tech,
+                                            unit, idx, -1, -1,
+                                            (unit == LATIN_UNIT_NUMBER ?
+                                             idx : 0), NULL, 0);
+
+                                    latin_solver_report(
+                                        solver, LATIN_EV_RULE_OUT, tech,
+                                        unit, idx, px, py, pn, NULL, 0);
                                 }
-#endif
                                 progress = true;
-                                solver->cube[fpos] = false;
+                                latin_solver_rule_out(solver, px, py, pn);
+                                if (solver->stats)
+                                    solver->stats->eliminations[tech]++;
                             }
                     }
                 }
 
                 if (progress) {
+                    if (solver->stats)
+                        solver->stats->steps[tech]++;
                     return +1;
                 }
             }
@@ -625,14 +785,9 @@ int latin_solver_forcing(struct latin_solver *solver,
 #ifdef SEMI_LATIN
 	int depth = solver->depth;
 	bool *force = solver->force;
-#endif
-#ifdef STANDALONE_SOLVER
-    char **names = solver->names;
 #endif
     int *bfsqueue = scratch->bfsqueue;
-#ifdef STANDALONE_SOLVER
     int *bfsprev = scratch->bfsprev;
-#endif
     unsigned char *number = scratch->grid;
     int *neighbours = scratch->neighbours;
     int x, y;
@@ -686,9 +841,7 @@ int latin_solver_forcing(struct latin_solver *solver,
                     memset(number, o+1, o*o);
                     head = tail = 0;
                     bfsqueue[tail++] = y*o+x;
-#ifdef STANDALONE_SOLVER
                     bfsprev[y*o+x] = -1;
-#endif
                     number[y*o+x] = t - n;
 
                     while (head < tail) {
@@ -749,9 +902,7 @@ int latin_solver_forcing(struct latin_solver *solver,
 #endif
                             ) {
                                 bfsqueue[tail++] = yt*o+xt;
-#ifdef STANDALONE_SOLVER
                                 bfsprev[yt*o+xt] = yy*o+xx;
-#endif
                                 number[yt*o+xt] = tt - currn;
                             }
 
@@ -764,32 +915,31 @@ int latin_solver_forcing(struct latin_solver *solver,
                              */
                             if (currn == orign &&
                                 (xt == x || yt == y)) {
-#ifdef STANDALONE_SOLVER
-                                if (solver_show_working) {
-                                    const char *sep = "";
-                                    int xl, yl;
-                                    printf("%*sforcing chain, %s at ends of ",
-                                           solver_recurse_depth*4, "",
-					   names[orign-1]);
-                                    xl = xx;
-                                    yl = yy;
-                                    while (1) {
-                                        printf("%s(%d,%d)", sep, xl+1,
-                                               yl+1);
-                                        xl = bfsprev[yl*o+xl];
-                                        if (xl < 0)
-                                            break;
-                                        yl = xl / o;
-                                        xl %= o;
-                                        sep = "-";
+                                if (solver->trace) {
+                                    /*
+                                     * We're about to return, so the
+                                     * queue is free to hold the chain.
+                                     */
+                                    int nchain = 0, cl = yy*o+xx;
+
+                                    while (cl >= 0) {
+                                        bfsqueue[nchain++] = cl;
+                                        cl = bfsprev[cl];
                                     }
-                                    printf("\n%*s  ruling out %s at (%d,%d)\n",
-                                           solver_recurse_depth*4, "",
-                                           names[orign-1],
-					   xt+1, yt+1);
+                                    latin_solver_report(
+                                        solver, LATIN_EV_DEDUCE,
+                                        LATIN_TECH_FORCING, LATIN_UNIT_NONE,
+                                        -1, -1, -1, orign, bfsqueue, nchain);
+                                    latin_solver_report(
+                                        solver, LATIN_EV_RULE_OUT,
+                                        LATIN_TECH_FORCING, LATIN_UNIT_NONE,
+                                        -1, xt, yt, orign, NULL, 0);
+                                }
+                                latin_solver_rule_out(solver, xt, yt, orign);
+                                if (solver->stats) {
+                                    solver->stats->steps[LATIN_TECH_FORCING]++;
+                                    solver->stats->eliminations[LATIN_TECH_FORCING]++;
                                 }
-#endif
-                                cube(xt, yt, orign) = false;
                                 return 1;
                             }
                         }
@@ -800,79 +950,235 @@ int latin_solver_forcing(struct latin_solver *solver,
     return 0;
 }
 
+/* --------------------------------------------------------
+ * Arena for the solver's working memory.
+ *
+ * Everything a solve needs - the solver's own arrays, the scratch
+ * space of each latin_solver_top, and the frame and sub-solver of
+ * every guess - comes and goes in strict nesting order, so it can be
+ * taken from a bump allocator instead of the heap. latin_arena_push
+ * marks the current position and latin_arena_pop gives back all that
+ * was allocated since. Memory, once obtained, is kept until the
+ * arena is freed, so after the first few nodes a search does no heap
+ * allocation at all however many guesses it makes.
+ */
+
+/* Enough for any type the solver keeps in its arrays. */
+#define LATIN_ARENA_ALIGN 16
+
+/*
+ * The first chunk holds the top-level solver and a few levels of
+ * search; deeper searches add more chunks as they need them.
+ */
+#define LATIN_ARENA_LEVELS 4
+
+struct latin_arena_chunk {
+    struct latin_arena_chunk *next;     /* kept for reuse once popped */
+    size_t size, used;
+};
+/* Where the memory of a chunk starts, after its header. */
+#define LATIN_ARENA_HEADER \
+    ((sizeof(struct latin_arena_chunk) + LATIN_ARENA_ALIGN - 1) & \
+     ~(size_t)(LATIN_ARENA_ALIGN - 1))
+
+struct latin_arena_mark {
+    struct latin_arena_chunk *chunk;
+    size_t used;
+};
+
+struct latin_solver_arena {
+    struct latin_arena_chunk *first, *cur;
+    size_t chunksize;
+    struct latin_arena_mark *marks;
+    int nmarks, marksize;
+};
+
+/*
+ * A generous figure for what one level of search takes: a solver,
+ * the scratch space of its latin_solver_top, and its guess's frame.
+ */
+static size_t latin_arena_level(int o)
+{
+    size_t n = (size_t)o*o*o                /* cube */
+        + 9 * (size_t)o*o                   /* row, col, force, forbid,
+                                             * ncand, scratch grid,
+                                             * frame grids */
+        + (3*o + 2*o*o) * sizeof(int)       /* scratch BFS */
+        + 5 * o + 1
+        + sizeof(struct latin_solver_scratch);
+
+#ifdef SEMI_LATIN
+    n += 4 * o * sizeof(latin_mask);        /* row and column mark masks */
+#endif
+    return n + 24 * LATIN_ARENA_ALIGN;      /* rounding of each array */
+}
+
+static struct latin_arena_chunk *latin_arena_chunk_new(size_t size)
+{
+    struct latin_arena_chunk *c = (struct latin_arena_chunk *)
+        smalloc(LATIN_ARENA_HEADER + size);
+
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    return c;
+}
+
+static struct latin_solver_arena *latin_arena_new(int o)
+{
+    struct latin_solver_arena *arena = snew(struct latin_solver_arena);
+
+    arena->chunksize = LATIN_ARENA_LEVELS * latin_arena_level(o);
+    arena->first = arena->cur = latin_arena_chunk_new(arena->chunksize);
+    arena->marksize = 4 * LATIN_ARENA_LEVELS;
+    arena->marks = snewn(arena->marksize, struct latin_arena_mark);
+    arena->nmarks = 0;
+    return arena;
+}
+
+static void latin_arena_free(struct latin_solver_arena *arena)
+{
+    struct latin_arena_chunk *c, *next;
+
+    assert(arena->nmarks == 0);
+    for (c = arena->first; c; c = next) {
+        next = c->next;
+        sfree(c);
+    }
+    sfree(arena->marks);
+    sfree(arena);
+}
+
+static void *latin_arena_alloc(struct latin_solver_arena *arena, size_t size)
+{
+    struct latin_arena_chunk *c = arena->cur;
+    void *p;
+
+    size = (size + LATIN_ARENA_ALIGN - 1) & ~(size_t)(LATIN_ARENA_ALIGN - 1);
+    while (c->used + size > c->size) {
+        if (!c->next)
+            c->next = latin_arena_chunk_new(max(arena->chunksize, size));
+        c = c->next;
+        c->used = 0;
+    }
+    arena->cur = c;
+    p = (unsigned char *)c + LATIN_ARENA_HEADER + c->used;
+    c->used += size;
+    return p;
+}
+#define latin_arena_newn(arena, n, type) \
+    ((type *)latin_arena_alloc(arena, (n) * sizeof(type)))
+
+static void latin_arena_push(struct latin_solver_arena *arena)
+{
+    if (arena->nmarks >= arena->marksize) {
+        arena->marksize = arena->marksize * 3 / 2 + 4;
+        arena->marks = sresize(arena->marks, arena->marksize,
+                               struct latin_arena_mark);
+    }
+    arena->marks[arena->nmarks].chunk = arena->cur;
+    arena->marks[arena->nmarks].used = arena->cur->used;
+    arena->nmarks++;
+}
+
+static void latin_arena_pop(struct latin_solver_arena *arena)
+{
+    assert(arena->nmarks > 0);
+    arena->nmarks--;
+    arena->cur = arena->marks[arena->nmarks].chunk;
+    arena->cur->used = arena->marks[arena->nmarks].used;
+}
+
 struct latin_solver_scratch *latin_solver_new_scratch(struct latin_solver *solver)
 {
-    struct latin_solver_scratch *scratch = snew(struct latin_solver_scratch);
+    struct latin_solver_arena *arena = solver->arena;
+    struct latin_solver_scratch *scratch;
     int o = solver->o;
-    scratch->grid = snewn(o*o, unsigned char);
-    scratch->rowidx = snewn(o, unsigned char);
-    scratch->colidx = snewn(o, unsigned char);
-    scratch->set = snewn(o, unsigned char);
+
+    latin_arena_push(arena);
+    scratch = latin_arena_newn(arena, 1, struct latin_solver_scratch);
+    scratch->arena = arena;
+    scratch->grid = latin_arena_newn(arena, o*o, unsigned char);
+    scratch->rowidx = latin_arena_newn(arena, o, unsigned char);
+    scratch->colidx = latin_arena_newn(arena, o, unsigned char);
+    scratch->set = latin_arena_newn(arena, o, unsigned char);
 #ifdef SEMI_LATIN
-	scratch->forceidx = snewn(o, unsigned char);
-#endif
-    scratch->neighbours = snewn(3*o, int);
-    scratch->bfsqueue = snewn(o*o, int);
-#ifdef STANDALONE_SOLVER
-    scratch->bfsprev = snewn(o*o, int);
+	scratch->forceidx = latin_arena_newn(arena, o, unsigned char);
 #endif
+    scratch->neighbours = latin_arena_newn(arena, 3*o, int);
+    scratch->bfsqueue = latin_arena_newn(arena, o*o, int);
+    scratch->bfsprev = latin_arena_newn(arena, o*o, int);
     return scratch;
 }
 
 void latin_solver_free_scratch(struct latin_solver_scratch *scratch)
 {
-#ifdef STANDALONE_SOLVER
-    sfree(scratch->bfsprev);
-#endif
-    sfree(scratch->bfsqueue);
-    sfree(scratch->neighbours);
-    sfree(scratch->set);
-    sfree(scratch->colidx);
-    sfree(scratch->rowidx);
-#ifdef SEMI_LATIN
-	sfree(scratch->forceidx);
-#endif
-    sfree(scratch->grid);
-    sfree(scratch);
+    latin_arena_pop(scratch->arena);
 }
 
-void latin_solver_alloc(struct latin_solver *solver, digit *grid, int o
+/*
+ * Fill in a solver, taking its memory from the given arena (after
+ * marking it, to be given back by latin_solver_free), or from an
+ * arena of its own if that is NULL.
+ */
+static void latin_solver_alloc_in(struct latin_solver *solver, digit *grid,
+                                  int o,
 #ifdef SEMI_LATIN
-						, int depth, bool *force, bool *forbid
+                                  int depth, bool *force, bool *forbid,
 #endif
-)
+                                  struct latin_solver_arena *arena)
 {
     int x, y;
 #ifdef SEMI_LATIN
 	int n;
 #endif
 
+    if (arena) {
+        latin_arena_push(arena);
+        solver->ownarena = false;
+    } else {
+        arena = latin_arena_new(o);
+        solver->ownarena = true;
+    }
+    solver->arena = arena;
+
     solver->o = o;
 #ifdef SEMI_LATIN
 	solver->depth = depth;
 #endif
-    solver->cube = snewn(o*o*o, unsigned char);
+    solver->tt = NULL;			/* until latin_solver_set_tt */
+    solver->zobrist = 0;
+    solver->cube = latin_arena_newn(arena, o*o*o, unsigned char);
     solver->grid = grid;		/* write straight back to the input */
     memset(solver->cube, 1, o*o*o);
 
-    solver->row = snewn(o*o, unsigned char);
-    solver->col = snewn(o*o, unsigned char);
+    solver->row = latin_arena_newn(arena, o*o, unsigned char);
+    solver->col = latin_arena_newn(arena, o*o, unsigned char);
     memset(solver->row, 0, o*o);
     memset(solver->col, 0, o*o);
 	
 #ifdef SEMI_LATIN
-	solver->force = snewn(o*o, bool);
-	solver->forbid = snewn(o*o, bool);
+	assert(o <= LATIN_MAX_SEMI_ORDER);
+	solver->force = latin_arena_newn(arena, o*o, bool);
+	solver->forbid = latin_arena_newn(arena, o*o, bool);
 	memset(solver->force, false, o*o);
 	memset(solver->forbid, false, o*o);
-#endif
+	solver->rowforce = latin_arena_newn(arena, o, latin_mask);
+	solver->rowforbid = latin_arena_newn(arena, o, latin_mask);
+	solver->colforce = latin_arena_newn(arena, o, latin_mask);
+	solver->colforbid = latin_arena_newn(arena, o, latin_mask);
+	memset(solver->rowforce, 0, o * sizeof(latin_mask));
+	memset(solver->rowforbid, 0, o * sizeof(latin_mask));
+	memset(solver->colforce, 0, o * sizeof(latin_mask));
+	memset(solver->colforbid, 0, o * sizeof(latin_mask));
+	solver->ncand = latin_arena_newn(arena, o*o, unsigned char);
+	memset(solver->ncand, depth, o*o);
 
-    for (x = 0; x < o; x++)
-	for (y = 0; y < o; y++)
-	    if (grid[y*o+x])
-		latin_solver_place(solver, x, y, grid[y*o+x]);
-	
-#ifdef SEMI_LATIN
+	/*
+	 * Numbers beyond the depth never appear. Mark the forced
+	 * cells before placing anything, so that none of them is
+	 * taken for blank on running out of candidates.
+	 */
 	for (x = 0; x < o; x++)
 	for (y = 0; y < o; y++)
 	for (n = depth+1; n <= o; n++)
@@ -880,90 +1186,99 @@ void latin_solver_alloc(struct latin_solver *solver, digit *grid, int o
 	
 	for(y = 0; y < o; y++)
 	for(x = 0; x < o; x++)
-	if(forbid[y*o+x]) {
-		solver->forbid[y*o+x] = true;
-		for (n = 1; n <= depth; n++)
-            cube(x,y,n) = false;
-	}
-		
+	if(force[y*o+x])
+		latin_solver_mark_force(solver, x, y);
+
 	for(y = 0; y < o; y++)
 	for(x = 0; x < o; x++)
-	if(force[y*o+x])
-		solver->force[y*o+x] = true;
+	if(forbid[y*o+x])
+		latin_solver_mark_forbid(solver, x, y);
 #endif
 
-#ifdef STANDALONE_SOLVER
-    solver->names = NULL;
-#endif
+    for (x = 0; x < o; x++)
+	for (y = 0; y < o; y++)
+	    if (grid[y*o+x])
+		latin_solver_place(solver, x, y, grid[y*o+x]);
+
+    solver->stats = NULL;
+    solver->trace = NULL;
+    solver->tracectx = NULL;
+    solver->recurse_depth = 0;
+    solver->budget = NULL;
+    solver->search = NULL;
+    solver->progress = NULL;
 }
 
-void latin_solver_free(struct latin_solver *solver)
+void latin_solver_alloc(struct latin_solver *solver, digit *grid, int o
+#ifdef SEMI_LATIN
+						, int depth, bool *force, bool *forbid
+#endif
+)
 {
-    sfree(solver->cube);
-    sfree(solver->row);
-    sfree(solver->col);
-	
+    latin_solver_alloc_in(solver, grid, o,
 #ifdef SEMI_LATIN
-	sfree(solver->force);
-	sfree(solver->forbid);
+                          depth, force, forbid,
 #endif
-	
-	
+                          NULL);
 }
 
-int latin_solver_diff_simple(struct latin_solver *solver)
+void latin_solver_free(struct latin_solver *solver)
 {
-    int x, y, n, ret = 0, o = solver->o, depth = solver->depth;
-#ifdef STANDALONE_SOLVER
-    char **names = solver->names;
-#endif
+    if (solver->ownarena)
+        latin_arena_free(solver->arena);
+    else
+        latin_arena_pop(solver->arena);
+}
+
+void latin_solver_rule_out(struct latin_solver *solver, int x, int y, int n)
+{
+    latin_solver_rule_out_o(solver, x, y, n, solver->o);
+}
 
 #ifdef SEMI_LATIN
-	if(depth < o) {
+void latin_solver_mark_force(struct latin_solver *solver, int x, int y)
+{
+    latin_solver_mark_force_o(solver, x, y, solver->o);
+}
+
+int latin_solver_mark_forbid(struct latin_solver *solver, int x, int y)
+{
+    return latin_solver_mark_forbid_o(solver, x, y, solver->o);
+}
+#endif
+
+LATIN_KERNEL int latin_solver_diff_simple_o(struct latin_solver *solver,
+                                            const int o)
+{
+    int x, y, n, ret = 0;
+#ifdef SEMI_LATIN
+    int depth = solver->depth;
+
+	if(depth < o) {
 	/*
 	 * Deduce which cells must or musn't contain a value.
 	 */
 	for(y = 0; y < o; y++)
 	{
-		ret = latin_solver_assign_forbid(solver, y*o, 1
-#ifdef STANDALONE_SOLVER
-			, "blank cells deduction, "
-			  "row %d", y+1
-#endif
-		);
+		ret = latin_solver_assign_forbid_o(solver, LATIN_UNIT_ROW, y, o);
 		if(ret != 0) return ret;
 	}
 
 	for(x = 0; x < o; x++)
 	{
-		ret = latin_solver_assign_forbid(solver, x, o
-#ifdef STANDALONE_SOLVER
-			, "blank cells deduction, "
-			  "column %d", x+1
-#endif
-		);
+		ret = latin_solver_assign_forbid_o(solver, LATIN_UNIT_COL, x, o);
 		if(ret != 0) return ret;
 	}
 	
 	for(y = 0; y < o; y++)
 	{
-		ret = latin_solver_assign_force(solver, y*o, 1
-#ifdef STANDALONE_SOLVER
-			, "required cells deduction, "
-			  "row %d", y+1
-#endif
-		);
+		ret = latin_solver_assign_force_o(solver, LATIN_UNIT_ROW, y, o);
 		if(ret != 0) return ret;
 	}
 
 	for(x = 0; x < o; x++)
 	{
-		ret = latin_solver_assign_force(solver, x, o
-#ifdef STANDALONE_SOLVER
-			, "required cells deduction, "
-			  "column %d", x+1
-#endif
-		);
+		ret = latin_solver_assign_force_o(solver, LATIN_UNIT_COL, x, o);
 		if(ret != 0) return ret;
 	}
 	}
@@ -979,13 +1294,8 @@ int latin_solver_diff_simple(struct latin_solver *solver)
         for (n = 1; n <= o; n++)
 #endif
             if (!solver->row[y*o+n-1]) {
-                ret = latin_solver_elim(solver, cubepos(0,y,n), o*o
-#ifdef STANDALONE_SOLVER
-					, "positional elimination,"
-					" %s in row %d", names[n-1],
-					y+1
-#endif
-					);
+                ret = latin_solver_elim_o(solver, LATIN_CUBEPOS(o,0,y,n), o*o,
+                                          LATIN_UNIT_ROW, y, o);
                 if (ret != 0) return ret;
             }
     /*
@@ -998,12 +1308,8 @@ int latin_solver_diff_simple(struct latin_solver *solver)
         for (n = 1; n <= o; n++)
 #endif
             if (!solver->col[x*o+n-1]) {
-                ret = latin_solver_elim(solver, cubepos(x,0,n), o
-#ifdef STANDALONE_SOLVER
-					, "positional elimination,"
-					" %s in column %d", names[n-1], x+1
-#endif
-					);
+                ret = latin_solver_elim_o(solver, LATIN_CUBEPOS(o,x,0,n), o,
+                                          LATIN_UNIT_COL, x, o);
                 if (ret != 0) return ret;
             }
 
@@ -1017,117 +1323,381 @@ int latin_solver_diff_simple(struct latin_solver *solver)
 				&& solver->force[y*o+x]
 #endif
 		) {
-                ret = latin_solver_elim(solver, cubepos(x,y,1), 1
-#ifdef STANDALONE_SOLVER
-					, "numeric elimination at (%d,%d)",
-					x+1, y+1
-#endif
-					);
+                ret = latin_solver_elim_o(solver, LATIN_CUBEPOS(o,x,y,1), 1,
+                                          LATIN_UNIT_CELL, y*o+x, o);
                 if (ret != 0) return ret;
             }
 			
     return 0;
 }
 
+/*
+ * Constant-order instantiations of the kernels, and the public entry
+ * points which dispatch to them.
+ */
+#define LATIN_KERNELS(O)                                                \
+static void latin_solver_place_##O(struct latin_solver *solver,        \
+                                   int x, int y, int n)                \
+{ latin_solver_place_o(solver, x, y, n, O); }                          \
+static int latin_solver_elim_##O(struct latin_solver *solver,          \
+                                 int start, int step, int unit, int idx) \
+{ return latin_solver_elim_o(solver, start, step, unit, idx, O); }     \
+static int latin_solver_diff_simple_##O(struct latin_solver *solver)   \
+{ return latin_solver_diff_simple_o(solver, O); }
+
+LATIN_KERNELS(5)
+LATIN_KERNELS(6)
+LATIN_KERNELS(7)
+LATIN_KERNELS(8)
+LATIN_KERNELS(9)
+
+void latin_solver_place(struct latin_solver *solver, int x, int y, int n)
+{
+    switch (solver->o) {
+      case 5: latin_solver_place_5(solver, x, y, n); break;
+      case 6: latin_solver_place_6(solver, x, y, n); break;
+      case 7: latin_solver_place_7(solver, x, y, n); break;
+      case 8: latin_solver_place_8(solver, x, y, n); break;
+      case 9: latin_solver_place_9(solver, x, y, n); break;
+      default: latin_solver_place_o(solver, x, y, n, solver->o); break;
+    }
+}
+
+int latin_solver_elim(struct latin_solver *solver, int start, int step,
+		      int unit, int idx)
+{
+    switch (solver->o) {
+      case 5: return latin_solver_elim_5(solver, start, step, unit, idx);
+      case 6: return latin_solver_elim_6(solver, start, step, unit, idx);
+      case 7: return latin_solver_elim_7(solver, start, step, unit, idx);
+      case 8: return latin_solver_elim_8(solver, start, step, unit, idx);
+      case 9: return latin_solver_elim_9(solver, start, step, unit, idx);
+      default: return latin_solver_elim_o(solver, start, step, unit, idx,
+                                          solver->o);
+    }
+}
+
+int latin_solver_diff_simple(struct latin_solver *solver)
+{
+    switch (solver->o) {
+      case 5: return latin_solver_diff_simple_5(solver);
+      case 6: return latin_solver_diff_simple_6(solver);
+      case 7: return latin_solver_diff_simple_7(solver);
+      case 8: return latin_solver_diff_simple_8(solver);
+      case 9: return latin_solver_diff_simple_9(solver);
+      default: return latin_solver_diff_simple_o(solver, solver->o);
+    }
+}
+
 int latin_solver_diff_set(struct latin_solver *solver,
                           struct latin_solver_scratch *scratch,
                           bool extreme)
 {
-    int x, y, ret, o = solver->o;
-#if !defined SEMI_LATIN
-	int n;
-#endif
-	
-#if !defined SEMI_LATIN
-#ifdef STANDALONE_SOLVER
-    char **names = solver->names;
-#endif
-#endif
+    int x, y, n, ret, o = solver->o;
 
     if (!extreme) {
         /*
          * Row-wise set elimination.
          */
         for (y = 0; y < o; y++) {
-            ret = latin_solver_set(solver, scratch, cubepos(0,y,1), o*o, 1
-#ifdef STANDALONE_SOLVER
-                                   , "set elimination, row %d", y+1
-#endif
-                                  );
+            ret = latin_solver_set(solver, scratch, cubepos(0,y,1), o*o, 1,
+                                   LATIN_UNIT_ROW, y);
             if (ret != 0) return ret;
         }
         /*
          * Column-wise set elimination.
          */
         for (x = 0; x < o; x++) {
-            ret = latin_solver_set(solver, scratch, cubepos(x,0,1), o, 1
-#ifdef STANDALONE_SOLVER
-                                   , "set elimination, column %d", x+1
-#endif
-                                  );
+            ret = latin_solver_set(solver, scratch, cubepos(x,0,1), o, 1,
+                                   LATIN_UNIT_COL, x);
             if (ret != 0) return ret;
         }
     } else {
-	/*
-	 * Haven't figured out how this works for partial latin squares.
-     * Just going to disable this for now.	 
-	 */
-	#if !defined SEMI_LATIN
         /*
          * Row-vs-column set elimination on a single number
          * (much tricker for a human to do!)
+	 *
+	 * For a partial latin square this still works, since each
+	 * number present appears once in every row and column; blank
+	 * cells simply have no candidates. latin_solver_set knows to
+	 * treat every row as needing a value in this case.
          */
+#ifdef SEMI_LATIN
+        for (n = 1; n <= solver->depth; n++) {
+#else
         for (n = 1; n <= o; n++) {
-            ret = latin_solver_set(solver, scratch, cubepos(0,0,n), o*o, o
-#ifdef STANDALONE_SOLVER
-                                   , "positional set elimination on %s",
-				   names[n-1]
 #endif
-                                  );
+            ret = latin_solver_set(solver, scratch, cubepos(0,0,n), o*o, o,
+                                   LATIN_UNIT_NUMBER, n);
             if (ret != 0) return ret;
         }
-	#else
-		return 0;
-	#endif
     }
     return 0;
 }
 
 /*
- * Returns:
- * 0 for 'didn't do anything' implying it was already solved.
- * -1 for 'impossible' (no solution)
- * 1 for 'single solution'
- * >1 for 'multiple solutions' (you don't get to know how many, and
- *     the first such solution found will be set.
- *
- * and this function may well assert if given an impossible board.
+ * Whether the search has to stop short: because the budget has run
+ * out, or because the current run is due for a restart.
  */
-static int latin_solver_recurse
-    (struct latin_solver *solver, int diff_simple, int diff_set_0,
-     int diff_set_1, int diff_forcing, int diff_recursive,
-     usersolver_t const *usersolvers, void *ctx,
-     ctxnew_t ctxnew, ctxfree_t ctxfree)
+static bool latin_solver_stopped(struct latin_solver *solver)
+{
+    return (solver->budget && solver->budget->exhausted) ||
+        (solver->search && solver->search->cut);
+}
+
+/*
+ * Count a guess against the solver's budget, if it has one, and
+ * against the current run of a restarting search; say whether the
+ * search has to stop.
+ */
+static bool latin_solver_spend(struct latin_solver *solver)
+{
+    struct latin_solver_budget *budget = solver->budget;
+    struct latin_solver_search *search = solver->search;
+
+    if (latin_solver_stopped(solver))
+        return true;
+    if (budget) {
+        if (budget->maxnodes > 0 && budget->nodes >= budget->maxnodes)
+            budget->exhausted = true;
+        else if (budget->maxtime > 0 &&
+                 latin_solver_time() >= budget->deadline)
+            budget->exhausted = true;
+        else
+            budget->nodes++;
+    }
+    if (search && !latin_solver_stopped(solver)) {
+        if (search->limit > 0 && search->nodes >= search->limit)
+            search->cut = true;
+        else
+            search->nodes++;
+    }
+    return latin_solver_stopped(solver);
+}
+
+/* The i-th term (from 1) of the Luby sequence 1,1,2,1,1,2,4,1,1,2,... */
+static long latin_luby(long i)
+{
+    int k;
+
+    while (1) {
+        for (k = 1; (1L << k) - 1 < i; k++);
+        if ((1L << k) - 1 == i)
+            return 1L << (k-1);
+        i -= (1L << (k-1)) - 1;
+    }
+}
+
+static const char *const latin_branch_names[LATIN_NBRANCH] = {
+    "first", "degree", "domwdeg",
+};
+
+const char *latin_branch_name(int branch)
+{
+    assert(branch >= 0 && branch < LATIN_NBRANCH);
+    return latin_branch_names[branch];
+}
+
+void latin_solver_search_init(struct latin_solver_search *search, int o,
+                              int branch, random_state *rs,
+                              long restart_unit)
 {
-    int best, bestcount;
-    int o = solver->o, x, y, n;
+    int i;
+
+    assert(branch >= 0 && branch < LATIN_NBRANCH);
+    search->o = o;
+    search->branch = branch;
+    search->rs = rs;
+    search->restart_unit = rs ? restart_unit : 0;
+    search->weights = NULL;
+    if (branch == LATIN_BRANCH_DOMWDEG) {
+        search->weights = snewn(2*o + o*o, unsigned long);
+        for (i = 0; i < 2*o + o*o; i++)
+            search->weights[i] = 1;
+    }
+    search->restarts = 0;
+    search->nodes = search->limit = 0;
+    search->cut = false;
+}
+
+void latin_solver_search_free(struct latin_solver_search *search)
+{
+    sfree(search->weights);
+    search->weights = NULL;
+}
+
+/*
+ * Start the next run of a restarting search, returning false if
+ * there is no call for one: the search doesn't restart, or the last
+ * run finished, or the budget has run out.
+ */
+static bool latin_solver_restart(struct latin_solver *solver, bool first)
+{
+    struct latin_solver_search *search = solver->search;
+
+    if (!search || !search->restart_unit || solver->recurse_depth > 0)
+        return first;
+    if (!first) {
+        if (!search->cut || (solver->budget && solver->budget->exhausted))
+            return false;
+        search->restarts++;
+    }
+    search->cut = false;
+    search->nodes = 0;
+    search->limit = search->restart_unit * latin_luby(search->restarts + 1);
+    return true;
+}
+
+struct latin_solver_tt *latin_solver_tt_new(int o, size_t maxbytes,
+                                            int policy)
+{
+    struct latin_solver_tt *tt = snew(struct latin_solver_tt);
+    size_t per = sizeof(struct latin_tt_entry) + o*o, n, i;
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL * (o + 1);
+
+    tt->o = o;
+    tt->policy = policy;
+    tt->guesses = 0;
+
+    /* The keys are fixed, so that searches are repeatable. */
+    tt->keys = snewn(o*o*o + 2*o*o, unsigned long long);
+    for (i = 0; i < (size_t)(o*o*o + 2*o*o); i++) {
+        unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        tt->keys[i] = z ^ (z >> 31);
+    }
+
+    /* The largest power of two entries that fits, but at least one. */
+    for (n = 1; n * 2 * per <= maxbytes; n *= 2);
+    tt->mask = n - 1;
+    tt->entries = snewn(n, struct latin_tt_entry);
+    for (i = 0; i < n; i++)
+        tt->entries[i].result = LATIN_TT_EMPTY;
+    tt->solns = snewn(n * o*o, digit);
+
+    return tt;
+}
+
+void latin_solver_tt_free(struct latin_solver_tt *tt)
+{
+    if (tt) {
+        sfree(tt->keys);
+        sfree(tt->entries);
+        sfree(tt->solns);
+        sfree(tt);
+    }
+}
+
+void latin_solver_set_tt(struct latin_solver *solver,
+                         struct latin_solver_tt *tt)
+{
+    int o = solver->o, i;
+
+    solver->tt = tt;
+    solver->zobrist = 0;
+    if (!tt)
+        return;
+
+    assert(tt->o == o);
+    for (i = 0; i < o*o*o; i++)
+        if (!solver->cube[i])
+            solver->zobrist ^= tt->keys[i];
 #ifdef SEMI_LATIN
-	int depth = solver->depth;
-#endif
-#ifdef STANDALONE_SOLVER
-    char **names = solver->names;
+    for (i = 0; i < o*o; i++) {
+        if (solver->force[i])
+            solver->zobrist ^= tt->keys[o*o*o + i];
+        if (solver->forbid[i])
+            solver->zobrist ^= tt->keys[o*o*o + o*o + i];
+    }
 #endif
+}
+
+/*
+ * Look up a state by its hash, returning LATIN_TT_EMPTY if it isn't
+ * known, LATIN_TT_IMPOSSIBLE, or LATIN_TT_UNIQUE with the solution in
+ * *soln.
+ */
+static int latin_tt_probe(struct latin_solver *solver,
+                          unsigned long long key, const digit **soln)
+{
+    struct latin_solver_tt *tt = solver->tt;
+    size_t slot = (size_t)(key ^ (key >> 32)) & tt->mask;
+    struct latin_tt_entry *e = &tt->entries[slot];
+
+    if (e->result == LATIN_TT_EMPTY || e->key != key)
+        return LATIN_TT_EMPTY;
+    if (solver->stats)
+        solver->stats->tthits++;
+    *soln = tt->solns + slot * tt->o * tt->o;
+    return e->result;
+}
+
+static void latin_tt_store(struct latin_solver *solver,
+                           unsigned long long key, int result,
+                           const digit *soln, long work)
+{
+    struct latin_solver_tt *tt = solver->tt;
+    size_t slot = (size_t)(key ^ (key >> 32)) & tt->mask;
+    struct latin_tt_entry *e = &tt->entries[slot];
+
+    if (e->result != LATIN_TT_EMPTY && e->key != key &&
+        tt->policy == LATIN_TT_REPLACE_WORK && e->work > work)
+        return;
+
+    e->key = key;
+    e->work = work;
+    e->result = result;
+    if (result == LATIN_TT_UNIQUE)
+        memcpy(tt->solns + slot * tt->o * tt->o, soln, tt->o * tt->o);
+}
+
+/*
+ * Find the undecided cell to guess at - by default the first with the
+ * fewest options, or as solver->search says - write the options into
+ * list (under SEMI_LATIN, 0 stands for leaving a cell blank, which is
+ * an option unless the cell is known to need a number) in the order
+ * to try them, and return y*o+x, or -1 if every cell is decided. Uses
+ * the solver's arena for the degree heuristics.
+ */
+static int latin_solver_pick(struct latin_solver *solver, digit *list,
+                             int *nlist)
+{
+    struct latin_solver_search *search = solver->search;
+    int branch = search ? search->branch : LATIN_BRANCH_FIRST;
+    int best, bestcount, bestdeg = 0;
+    unsigned long bestweight = 1;
+    int *rowfree = NULL, *colfree = NULL;
+    int o = solver->o, x, y, n, j;
 
     best = -1;
-    bestcount = o+1;
+    bestcount = o+2;
+
+    if (branch != LATIN_BRANCH_FIRST) {
+        /* Undecided cells in each row and column. */
+        rowfree = latin_arena_newn(solver->arena, o, int);
+        colfree = latin_arena_newn(solver->arena, o, int);
+        memset(rowfree, 0, o * sizeof(int));
+        memset(colfree, 0, o * sizeof(int));
+        for (y = 0; y < o; y++)
+            for (x = 0; x < o; x++)
+                if (!solver->grid[y*o+x]
+#ifdef SEMI_LATIN
+                    && !solver->forbid[y*o+x]
+#endif
+                    ) {
+                    rowfree[y]++;
+                    colfree[x]++;
+                }
+    }
 
     for (y = 0; y < o; y++)
         for (x = 0; x < o; x++)
             if (!solver->grid[y*o+x]
 #ifdef SEMI_LATIN
-				&& solver->force[y*o+x]
+                && !solver->forbid[y*o+x]
 #endif
-				) {
+                ) {
                 int count;
 
                 /*
@@ -1138,6 +1708,10 @@ static int latin_solver_recurse
                 for (n = 1; n <= o; n++)
                     if (cube(x,y,n))
                         count++;
+#ifdef SEMI_LATIN
+                if (!solver->force[y*o+x])
+                    count++;
+#endif
 
                 /*
                  * We should have found any impossibilities
@@ -1145,193 +1719,441 @@ static int latin_solver_recurse
                  */
                 assert(count > 1);
 
-                if (count < bestcount) {
-                    bestcount = count;
-                    best = y*o+x;
+                if (branch == LATIN_BRANCH_FIRST) {
+                    if (count < bestcount) {
+                        bestcount = count;
+                        best = y*o+x;
+                    }
+                } else {
+                    int deg = rowfree[y] + colfree[x];
+                    unsigned long weight = 1;
+                    unsigned long long lhs, rhs;
+
+                    if (branch == LATIN_BRANCH_DOMWDEG)
+                        weight = search->weights[y] + search->weights[o+x] +
+                            search->weights[2*o + y*o+x];
+                    /* count/weight against bestcount/bestweight */
+                    lhs = (unsigned long long)count * bestweight;
+                    rhs = (unsigned long long)bestcount * weight;
+                    if (lhs < rhs || (lhs == rhs && deg > bestdeg)) {
+                        bestcount = count;
+                        bestweight = weight;
+                        bestdeg = deg;
+                        best = y*o+x;
+                    }
                 }
             }
 
     if (best == -1)
-        /* we were complete already. */
-		return 0;
-			
-    else {
-        int i, j;
-        digit *list, *ingrid, *outgrid;
-        int diff = diff_impossible;    /* no solution found yet */
+        return -1;
 
-        /*
-         * Attempt recursion.
-         */
-        y = best / o;
-        x = best % o;
+    y = best / o;
+    x = best % o;
+    for (j = 0, n = 1; n <= o; n++)
+        if (cube(x,y,n))
+            list[j++] = n;
+#ifdef SEMI_LATIN
+    if (!solver->force[best])
+        list[j++] = 0;
+#endif
+    if (search && search->rs)
+        shuffle(list, j, sizeof(*list), search->rs);
+    *nlist = j;
+    return best;
+}
 
-        list = snewn(o, digit);
-        ingrid = snewn(o*o, digit);
-        outgrid = snewn(o*o, digit);
-        memcpy(ingrid, solver->grid, o*o);
+/*
+ * Set up a solver for one guess below 'solver', on the given grid and
+ * (under SEMI_LATIN) forbidden cells, sharing its statistics, tracing
+ * and budget.
+ */
+static void latin_solver_sub_alloc(struct latin_solver *subsolver,
+                                   struct latin_solver *solver, digit *grid
+#ifdef SEMI_LATIN
+                                   , bool *forbid
+#endif
+                                   )
+{
+    latin_solver_alloc_in(subsolver, grid, solver->o,
+#ifdef SEMI_LATIN
+                          solver->depth, solver->force, forbid,
+#endif
+                          solver->arena);
+    subsolver->stats = solver->stats;
+    subsolver->trace = solver->trace;
+    subsolver->tracectx = solver->tracectx;
+    subsolver->recurse_depth = solver->recurse_depth + 1;
+    subsolver->budget = solver->budget;
+    subsolver->search = solver->search;
+    latin_solver_set_tt(subsolver, solver->tt);
+    if (solver->stats) {
+        solver->stats->nodes++;
+        if (subsolver->recurse_depth > solver->stats->maxdepth)
+            solver->stats->maxdepth = subsolver->recurse_depth;
+    }
+}
 
-        /* Make a list of the possible digits. */
-        for (j = 0, n = 1; n <= o; n++)
-            if (cube(x,y,n))
-                list[j++] = n;
+static void latin_solver_report_recurse(struct latin_solver *solver, int pos,
+                                        const digit *list, int nlist)
+{
+    int *ilist = snewn(nlist, int), i;
 
-#ifdef STANDALONE_SOLVER
-        if (solver_show_working) {
-            const char *sep = "";
-            printf("%*srecursing on (%d,%d) [",
-                   solver_recurse_depth*4, "", x+1, y+1);
-            for (i = 0; i < j; i++) {
-                printf("%s%s", sep, names[list[i]-1]);
-                sep = " or ";
-            }
-            printf("]\n");
-        }
+    for (i = 0; i < nlist; i++)
+        ilist[i] = list[i];
+    latin_solver_report(solver, LATIN_EV_RECURSE, -1, LATIN_UNIT_CELL, pos,
+                        pos % solver->o, pos / solver->o, 0, ilist, nlist);
+    sfree(ilist);
+}
+
+/*
+ * Returns:
+ * 0 for 'didn't do anything' implying it was already solved.
+ * -1 for 'impossible' (no solution)
+ * 1 for 'single solution'
+ * >1 for 'multiple solutions' (you don't get to know how many, and
+ *     the first such solution found will be set.
+ *
+ * and this function may well assert if given an impossible board.
+ * If the solver's budget runs out, it stops early and sets
+ * budget->exhausted; the return value is then meaningless.
+ */
+static int latin_solver_recurse
+    (struct latin_solver *solver, int diff_simple, int diff_set_0,
+     int diff_set_1, int diff_forcing, int diff_recursive,
+     usersolver_t const *usersolvers, void *ctx,
+     ctxnew_t ctxnew, ctxfree_t ctxfree)
+{
+    int best, i, j, x, y;
+    int o = solver->o;
+    long work = 0;
+    digit *list, *ingrid, *outgrid;
+#ifdef SEMI_LATIN
+    bool *outforbid;
 #endif
+    int diff = diff_impossible;    /* no solution found yet */
 
-        /*
-         * And step along the list, recursing back into the
-         * main solver at every stage.
-         */
-        for (i = 0; i < j; i++) {
-            int ret;
-	    void *newctx;
-	    struct latin_solver subsolver;
+    latin_arena_push(solver->arena);
+    list = latin_arena_newn(solver->arena, o+1, digit);
+    best = latin_solver_pick(solver, list, &j);
+    if (best == -1) {
+        /* we were complete already. */
+        latin_arena_pop(solver->arena);
+        return 0;
+    }
 
-            memcpy(outgrid, ingrid, o*o);
-            outgrid[y*o+x] = list[i];
+    if (solver->tt) {
+        const digit *known;
+        switch (latin_tt_probe(solver, solver->zobrist, &known)) {
+          case LATIN_TT_IMPOSSIBLE:
+            latin_arena_pop(solver->arena);
+            return -1;
+          case LATIN_TT_UNIQUE:
+            memcpy(solver->grid, known, o*o);
+            latin_arena_pop(solver->arena);
+            return 1;
+        }
+        work = solver->tt->guesses;
+    }
 
-#ifdef STANDALONE_SOLVER
-            if (solver_show_working)
-                printf("%*sguessing %s at (%d,%d)\n",
-                       solver_recurse_depth*4, "", names[list[i]-1], x+1, y+1);
-            solver_recurse_depth++;
-#endif
+    /*
+     * Attempt recursion.
+     */
+    y = best / o;
+    x = best % o;
 
-	    if (ctxnew) {
-		newctx = ctxnew(ctx);
-	    } else {
-		newctx = ctx;
-	    }
-	    latin_solver_alloc(&subsolver, outgrid, o
+    ingrid = latin_arena_newn(solver->arena, o*o, digit);
+    outgrid = latin_arena_newn(solver->arena, o*o, digit);
+    memcpy(ingrid, solver->grid, o*o);
 #ifdef SEMI_LATIN
-							, depth, solver->force, solver->forbid
-#endif
-							);
-#ifdef STANDALONE_SOLVER
-	    subsolver.names = solver->names;
+    outforbid = latin_arena_newn(solver->arena, o*o, bool);
 #endif
 
+    if (solver->trace)
+        latin_solver_report_recurse(solver, best, list, j);
+
+    /*
+     * And step along the list, recursing back into the
+     * main solver at every stage.
+     */
+    for (i = 0; i < j; i++) {
+        int ret;
+        void *newctx;
+        struct latin_solver subsolver;
+
+        if (latin_solver_spend(solver))
+            break;
+        if (solver->tt)
+            solver->tt->guesses++;
+
+        memcpy(outgrid, ingrid, o*o);
+        outgrid[y*o+x] = list[i];
 #ifdef SEMI_LATIN
-		memcpy(subsolver.force, solver->force, o*o);
-		memcpy(subsolver.forbid, solver->forbid, o*o);
+        memcpy(outforbid, solver->forbid, o*o);
+        if (!list[i])
+            outforbid[y*o+x] = true;
 #endif
-            ret = latin_solver_top(&subsolver, diff_recursive,
-				   diff_simple, diff_set_0, diff_set_1,
-				   diff_forcing, diff_recursive,
-				   usersolvers, newctx, ctxnew, ctxfree);
-			
-	    latin_solver_free(&subsolver);
-	    if (ctxnew)
-		ctxfree(newctx);
 
-#ifdef STANDALONE_SOLVER
-            solver_recurse_depth--;
-            if (solver_show_working) {
-                printf("%*sretracting %s at (%d,%d)\n",
-                       solver_recurse_depth*4, "", names[list[i]-1], x+1, y+1);
-            }
+        if (solver->trace)
+            latin_solver_report(solver, LATIN_EV_GUESS, -1, LATIN_UNIT_CELL,
+                                y*o+x, x, y, list[i], NULL, 0);
+
+        if (ctxnew) {
+            newctx = ctxnew(ctx);
+        } else {
+            newctx = ctx;
+        }
+        latin_solver_sub_alloc(&subsolver, solver, outgrid
+#ifdef SEMI_LATIN
+                               , outforbid
 #endif
-            /* we recurse as deep as we can, so we should never find
-             * find ourselves giving up on a puzzle without declaring it
-             * impossible.  */
-            assert(ret != diff_unfinished);
+                               );
+
+        ret = latin_solver_top(&subsolver, diff_recursive,
+                               diff_simple, diff_set_0, diff_set_1,
+                               diff_forcing, diff_recursive,
+                               usersolvers, newctx, ctxnew, ctxfree);
+
+        latin_solver_free(&subsolver);
+        if (ctxnew)
+            ctxfree(newctx);
+
+        if (solver->trace)
+            latin_solver_report(solver, LATIN_EV_RETRACT, -1,
+                                LATIN_UNIT_CELL, y*o+x, x, y, list[i],
+                                NULL, 0);
+        /* we recurse as deep as we can, so we should never find
+         * find ourselves giving up on a puzzle without declaring it
+         * impossible, unless we ran out of budget.  */
+        assert(ret != diff_unfinished);
+        if (ret == diff_exhausted)
+            break;
 
-            /*
-             * If we have our first solution, copy it into the
-             * grid we will return.
-             */
-            if (diff == diff_impossible && ret != diff_impossible)
-                memcpy(solver->grid, outgrid, o*o);
+        /*
+         * If we have our first solution, copy it into the
+         * grid we will return.
+         */
+        if (diff == diff_impossible && ret != diff_impossible)
+            memcpy(solver->grid, outgrid, o*o);
 
-            if (ret == diff_ambiguous)
+        if (ret == diff_ambiguous)
+            diff = diff_ambiguous;
+        else if (ret == diff_impossible)
+            /* do not change our return value */;
+        else {
+            /* the recursion turned up exactly one solution */
+            if (diff == diff_impossible)
+                diff = diff_recursive;
+            else
                 diff = diff_ambiguous;
-            else if (ret == diff_impossible)
-                /* do not change our return value */;
-            else {
-                /* the recursion turned up exactly one solution */
-                if (diff == diff_impossible)
-                    diff = diff_recursive;
-                else
-                    diff = diff_ambiguous;
-            }
-
-            /*
-             * As soon as we've found more than one solution,
-             * give up immediately.
-             */
-            if (diff == diff_ambiguous)
-                break;
         }
 
-        sfree(outgrid);
-        sfree(ingrid);
-        sfree(list);
+        /*
+         * As soon as we've found more than one solution,
+         * give up immediately.
+         */
+        if (diff == diff_ambiguous)
+            break;
+    }
+
+    latin_arena_pop(solver->arena);
 
+    if (solver->tt && !latin_solver_stopped(solver)) {
         if (diff == diff_impossible)
-            return -1;
-        else if (diff == diff_ambiguous)
-            return 2;
-        else {
-            assert(diff == diff_recursive);
-            return 1;
-        }
+            latin_tt_store(solver, solver->zobrist, LATIN_TT_IMPOSSIBLE,
+                           NULL, solver->tt->guesses - work);
+        else if (diff == diff_recursive)
+            latin_tt_store(solver, solver->zobrist, LATIN_TT_UNIQUE,
+                           solver->grid, solver->tt->guesses - work);
+    }
+
+    if (diff == diff_impossible)
+        return -1;
+    else if (diff == diff_ambiguous)
+        return 2;
+    else {
+        assert(diff == diff_recursive);
+        return 1;
     }
 }
 
-static int latin_solver_top(struct latin_solver *solver, int maxdiff,
-			    int diff_simple, int diff_set_0, int diff_set_1,
-			    int diff_forcing, int diff_recursive,
-			    usersolver_t const *usersolvers, void *ctx,
-			    ctxnew_t ctxnew, ctxfree_t ctxfree)
+/* Cells filled in, or under SEMI_LATIN known to be blank. */
+static int latin_solver_decided(struct latin_solver *solver)
 {
-    struct latin_solver_scratch *scratch = latin_solver_new_scratch(solver);
-    int ret, diff = diff_simple;
+    int i, n = 0;
 
-    assert(maxdiff <= diff_recursive);
-    /*
-     * Now loop over the grid repeatedly trying all permitted modes
-     * of reasoning. The loop terminates if we complete an
-     * iteration without making any progress; we then return
-     * failure or success depending on whether the grid is full or
-     * not.
-     */
-    while (1) {
-	int i;
+    for (i = 0; i < solver->o * solver->o; i++)
+        if (solver->grid[i]
+#ifdef SEMI_LATIN
+            || solver->forbid[i]
+#endif
+            )
+            n++;
+    return n;
+}
 
-	cont:
+/* Candidates left in the cells not yet decided. */
+static long latin_solver_frontier(struct latin_solver *solver)
+{
+    int o = solver->o, i;
+    long w = 0;
+
+    for (i = 0; i < o * o; i++) {
+        if (solver->grid[i])
+            continue;
+#ifdef SEMI_LATIN
+        if (!solver->forbid[i])
+            w += solver->ncand[i];
+#else
+        {
+            int n;
+            for (n = 1; n <= o; n++)
+                if (cube(i % o, i / o, n))
+                    w++;
+        }
+#endif
+    }
+    return w;
+}
+
+/*
+ * The number of deductions the simple tier could make next, for the
+ * score: lines whose required or blank cells are all known while some
+ * of their cells are still open, numbers with one place left in a line,
+ * and required cells with one number left.
+ */
+static int latin_solver_options(struct latin_solver *solver)
+{
+    int o = solver->o, x, y, n, m, count = 0;
 #ifdef SEMI_LATIN
-		latin_solver_debug_force_forbid(solver->o, solver->depth, solver->force, solver->forbid);
+    int depth = solver->depth, i;
+
+    if (depth < o)
+        for (i = 0; i < o; i++) {
+            latin_mask rf = solver->rowforce[i], rb = solver->rowforbid[i];
+            latin_mask cf = solver->colforce[i], cb = solver->colforbid[i];
+            if ((LATIN_MASK_ALL(o) & ~(rf | rb)) &&
+                (latin_popcount(rf) == depth ||
+                 o - latin_popcount(rb) == depth))
+                count++;
+            if ((LATIN_MASK_ALL(o) & ~(cf | cb)) &&
+                (latin_popcount(cf) == depth ||
+                 o - latin_popcount(cb) == depth))
+                count++;
+        }
+#else
+    int depth = o;
 #endif
-        latin_solver_debug(solver->cube, solver->o
+
+    for (y = 0; y < o; y++)
+        for (n = 1; n <= depth; n++)
+            if (!solver->row[y*o+n-1]) {
+                for (x = m = 0; x < o; x++)
+                    m += cube(x,y,n);
+                count += (m == 1);
+            }
+    for (x = 0; x < o; x++)
+        for (n = 1; n <= depth; n++)
+            if (!solver->col[x*o+n-1]) {
+                for (y = m = 0; y < o; y++)
+                    m += cube(x,y,n);
+                count += (m == 1);
+            }
+    for (x = 0; x < o; x++)
+        for (y = 0; y < o; y++)
+            if (!solver->grid[y*o+x]
 #ifdef SEMI_LATIN
-							  , solver->depth
+                && solver->force[y*o+x]
 #endif
-		);
+                ) {
+                for (n = 1, m = 0; n <= depth; n++)
+                    m += cube(x,y,n);
+                count += (m == 1);
+            }
+
+    return count;
+}
+
+/* Note that the solver has had to turn to tier i, for the score. */
+static void latin_solver_stall(struct latin_solver *solver, int i)
+{
+    long w;
+
+    if (!solver->stats)
+        return;
+    w = latin_solver_frontier(solver);
+    if (w > 0) {
+        solver->stats->stalls[i]++;
+        solver->stats->frontier[i] += w;
+    }
+}
+
+static int latin_solver_top(struct latin_solver *solver, int maxdiff,
+			    int diff_simple, int diff_set_0, int diff_set_1,
+			    int diff_forcing, int diff_recursive,
+			    usersolver_t const *usersolvers, void *ctx,
+			    ctxnew_t ctxnew, ctxfree_t ctxfree)
+{
+    struct latin_solver_scratch *scratch = latin_solver_new_scratch(solver);
+    int ret, diff = diff_simple;
+
+    assert(maxdiff <= diff_recursive);
+    /*
+     * Now loop over the grid repeatedly trying all permitted modes
+     * of reasoning. The loop terminates if we complete an
+     * iteration without making any progress; we then return
+     * failure or success depending on whether the grid is full or
+     * not.
+     */
+    while (1) {
+	int i;
+	double t0 = 0.0;
+
+	cont:
+	if (solver->stats)
+	    solver->stats->rescans++;
+	if (solver->trace)
+	    latin_solver_report(solver, LATIN_EV_PASS, -1, LATIN_UNIT_NONE,
+				-1, -1, -1, 0, NULL, 0);
 
 	for (i = 0; i <= maxdiff; i++) {
-	    if (usersolvers[i])
+	    /*
+	     * Before turning to a harder tier than we've needed so far,
+	     * see whether the grid is already complete: a run allowed
+	     * every tier shouldn't pay for each of them to find nothing
+	     * left to do.
+	     */
+	    if (i > diff) {
+		int decided = latin_solver_decided(solver);
+		if (decided == solver->o * solver->o)
+		    break;
+		if (solver->progress && solver->progress[i] < 0)
+		    solver->progress[i] = decided;
+	    }
+	    if (i > diff_simple)
+		latin_solver_stall(solver, i);
+	    if (solver->stats)
+		t0 = latin_solver_time();
+	    if (usersolvers[i]) {
 		ret = usersolvers[i](solver, ctx);
-	    else
+		if (ret > 0 && solver->stats)
+		    solver->stats->steps[LATIN_TECH_USER]++;
+	    } else
 		ret = 0;
-	    if (ret == 0 && i == diff_simple)
+	    if (ret == 0 && i == diff_simple) {
+		int options = solver->stats ? latin_solver_options(solver) : 0;
 		ret = latin_solver_diff_simple(solver);
+		if (ret > 0 && solver->stats)
+		    solver->stats->scarcity +=
+			(double)solver->o / max(options, 1);
+	    }
 	    if (ret == 0 && i == diff_set_0)
 		ret = latin_solver_diff_set(solver, scratch, false);
 	    if (ret == 0 && i == diff_set_1)
 		ret = latin_solver_diff_set(solver, scratch, true);
 	    if (ret == 0 && i == diff_forcing)
 		ret = latin_solver_forcing(solver, scratch);
+	    if (solver->stats)
+		solver->stats->tiertime[i] += latin_solver_time() - t0;
 
 	    if (ret < 0) {
 		diff = diff_impossible;
@@ -1357,11 +2179,45 @@ static int latin_solver_top(struct latin_solver *solver, int maxdiff,
      * possible.
      */
     if (maxdiff == diff_recursive) {
-        int nsol = latin_solver_recurse(solver,
-					diff_simple, diff_set_0, diff_set_1,
-					diff_forcing, diff_recursive,
-					usersolvers, ctx, ctxnew, ctxfree);
-        if (nsol < 0) diff = diff_impossible;
+        bool timed = solver->stats && solver->recurse_depth == 0;
+        bool restarting = solver->search && solver->search->restart_unit &&
+            solver->recurse_depth == 0;
+        double t0 = timed ? latin_solver_time() : 0.0;
+        int o = solver->o, nsol = 0;
+        digit *ingrid = NULL;
+        bool first;
+
+        if (solver->progress && solver->progress[diff_recursive] < 0) {
+            int decided = latin_solver_decided(solver);
+            if (decided < solver->o * solver->o)
+                solver->progress[diff_recursive] = decided;
+        }
+        latin_solver_stall(solver, diff_recursive);
+        /*
+         * A restarting search goes back to this grid for each run,
+         * and any run it lets finish has the answer.
+         */
+        if (restarting) {
+            latin_arena_push(solver->arena);
+            ingrid = latin_arena_newn(solver->arena, o*o, digit);
+            memcpy(ingrid, solver->grid, o*o);
+        }
+        for (first = true; latin_solver_restart(solver, first);
+             first = false) {
+            if (!first)
+                memcpy(solver->grid, ingrid, o*o);
+            nsol = latin_solver_recurse(solver,
+                                        diff_simple, diff_set_0, diff_set_1,
+                                        diff_forcing, diff_recursive,
+                                        usersolvers, ctx, ctxnew, ctxfree);
+        }
+        if (restarting)
+            latin_arena_pop(solver->arena);
+        if (timed)
+            solver->stats->tiertime[diff_recursive] += latin_solver_time() - t0;
+        if (latin_solver_stopped(solver))
+            diff = diff_exhausted;
+        else if (nsol < 0) diff = diff_impossible;
         else if (nsol == 1) diff = diff_recursive;
         else if (nsol > 1) diff = diff_ambiguous;
         /* if nsol == 0 then we were complete anyway
@@ -1394,87 +2250,315 @@ static int latin_solver_top(struct latin_solver *solver, int maxdiff,
 
     got_result:
 
-#ifdef STANDALONE_SOLVER
-    if (solver_show_working) {
-        if (diff != diff_impossible && diff != diff_unfinished &&
-            diff != diff_ambiguous) {
-            int x, y;
-
-            printf("%*sone solution found:\n", solver_recurse_depth*4, "");
-
-            for (y = 0; y < solver->o; y++) {
-                printf("%*s", solver_recurse_depth*4+1, "");
-                for (x = 0; x < solver->o; x++) {
-                    int val = solver->grid[y*solver->o+x];
-#if !defined SEMI_LATIN
-                    assert(val);
-#endif
-#ifdef SEMI_LATIN
-					if(val)
-#endif
-                    printf(" %s", solver->names[val-1]);
-#ifdef SEMI_LATIN
-					else
-					printf(" -");
-#endif
-                }
-                printf("\n");
-            }
-        } else {
-            printf("%*s%s found\n",
-                   solver_recurse_depth*4, "",
-                   diff == diff_impossible ? "no solution (impossible)" :
-                   diff == diff_unfinished ? "no solution (unfinished)" :
-                   "multiple solutions");
-        }
-    }
-#endif
+    if (solver->trace)
+	latin_solver_report(solver, LATIN_EV_RESULT, -1, LATIN_UNIT_NONE,
+			    -1, -1, -1, diff, NULL, 0);
 
     latin_solver_free_scratch(scratch);
 
     return diff;
 }
 
+/* Start the clock on the solver's budget, if it has one. */
+static void latin_solver_start_budget(struct latin_solver *solver)
+{
+    struct latin_solver_budget *budget = solver->budget;
+
+    if (budget) {
+        budget->nodes = 0;
+        budget->exhausted = false;
+        budget->deadline = budget->maxtime > 0 ?
+            latin_solver_time() + budget->maxtime : 0.0;
+    }
+}
+
 int latin_solver_main(struct latin_solver *solver, int maxdiff,
 		      int diff_simple, int diff_set_0, int diff_set_1,
 		      int diff_forcing, int diff_recursive,
 		      usersolver_t const *usersolvers, void *ctx,
 		      ctxnew_t ctxnew, ctxfree_t ctxfree)
 {
-    int diff;
-#ifdef STANDALONE_SOLVER
-    int o = solver->o;
-    char *text = NULL, **names = NULL;
+    latin_solver_start_budget(solver);
+
+    return latin_solver_top(solver, maxdiff,
+			    diff_simple, diff_set_0, diff_set_1,
+			    diff_forcing, diff_recursive,
+			    usersolvers, ctx, ctxnew, ctxfree);
+}
+
+/*
+ * Weights for the difficulty score: what a step of each technique is
+ * worth, and a guess. The simple tier's steps are all of a kind, and
+ * every puzzle of a size takes about as many of them, so they count
+ * by their scarcity instead (see latin_solver_options): o over the
+ * number of simple deductions that were there to be found, so that a
+ * step is worth 1 when each line offers one and more when the solver
+ * had to hunt for it. A stall counts the tiers escalated past (tier
+ * numbers being in order of difficulty), plus one for every o
+ * candidates still open, so that being stuck early counts for more.
+ */
+static const double latin_score_weights[LATIN_NTECH] = {
+    0.0,        /* positional elimination (by scarcity) */
+    0.0,        /* numeric elimination (by scarcity) */
+    4.0,        /* set elimination */
+    4.0,        /* positional set elimination */
+    10.0,       /* forcing chains */
+    0.0,        /* blank cells deduction (by scarcity) */
+    0.0,        /* required cells deduction (by scarcity) */
+    10.0,       /* puzzle-specific deductions */
+};
+#define LATIN_SCORE_GUESS 20.0
+
+static double latin_solver_score(const struct latin_solver_stats *stats,
+                                 int o, int diff_simple, int diff_recursive)
+{
+    double score = 0.0;
+    int i;
+
+    for (i = 0; i < LATIN_NTECH; i++)
+        score += latin_score_weights[i] * stats->steps[i];
+    score += stats->scarcity;
+    for (i = diff_simple + 1; i <= diff_recursive; i++)
+        score += (i - diff_simple) *
+            (stats->stalls[i] + (double)stats->frontier[i] / o);
+    score += LATIN_SCORE_GUESS * stats->nodes;
+    return score;
+}
+
+static void latin_solver_stats_add(struct latin_solver_stats *to,
+                                   const struct latin_solver_stats *from)
+{
+    int i;
+
+    for (i = 0; i < LATIN_NTECH; i++) {
+        to->steps[i] += from->steps[i];
+        to->placements[i] += from->placements[i];
+        to->eliminations[i] += from->eliminations[i];
+    }
+    to->nodes += from->nodes;
+    to->tthits += from->tthits;
+    to->maxdepth = max(to->maxdepth, from->maxdepth);
+    to->rescans += from->rescans;
+    to->scarcity += from->scarcity;
+    for (i = 0; i < diff_impossible; i++) {
+        to->tiertime[i] += from->tiertime[i];
+        to->stalls[i] += from->stalls[i];
+        to->frontier[i] += from->frontier[i];
+    }
+}
+
+int latin_solver_grade(struct latin_solver *solver, int maxdiff,
+                       int *progress, double *score,
+                       int diff_simple, int diff_set_0, int diff_set_1,
+                       int diff_forcing, int diff_recursive,
+                       usersolver_t const *usersolvers, void *ctx,
+                       ctxnew_t ctxnew, ctxfree_t ctxfree)
+{
+    struct latin_solver_stats *callerstats = solver->stats, stats;
+    int i, ret;
+
+    if (progress) {
+        for (i = 0; i <= diff_recursive; i++)
+            progress[i] = -1;
+        progress[diff_simple] = latin_solver_decided(solver);
+    }
+
+    /* The score needs statistics for this run alone. */
+    if (score) {
+        memset(&stats, 0, sizeof(stats));
+        solver->stats = &stats;
+    }
+
+    solver->progress = progress;
+    ret = latin_solver_main(solver, maxdiff,
+                            diff_simple, diff_set_0, diff_set_1,
+                            diff_forcing, diff_recursive,
+                            usersolvers, ctx, ctxnew, ctxfree);
+    solver->progress = NULL;
+
+    if (score) {
+        *score = latin_solver_score(&stats, solver->o,
+                                    diff_simple, diff_recursive);
+        solver->stats = callerstats;
+        if (callerstats)
+            latin_solver_stats_add(callerstats, &stats);
+    }
+
+    return ret;
+}
+
+/*
+ * Look for a solution other than soln, returning true (with it in the
+ * grid) if there is one. 'differs' says whether the grid already
+ * disagrees with soln, in which case any solution will do.
+ *
+ * Each node runs every deduction short of recursion, then guesses at
+ * the most constrained cell. Until the grid disagrees with soln, the
+ * options other than soln's are tried first: each of them leaves only
+ * the question of whether the grid can be finished at all, and if the
+ * puzzle is ambiguous one of them usually can.
+ */
+static bool latin_solver_differ
+    (struct latin_solver *solver, const digit *soln, bool differs,
+     int diff_simple, int diff_set_0, int diff_set_1, int diff_forcing,
+     int diff_recursive, usersolver_t const *usersolvers, void *ctx,
+     ctxnew_t ctxnew, ctxfree_t ctxfree)
+{
+    int o = solver->o, best, i, j, ret;
+    long work = 0;
+    digit *list, *outgrid;
+#ifdef SEMI_LATIN
+    bool *outforbid;
 #endif
+    bool found = false;
+    unsigned long long key = solver->zobrist;
 
-#ifdef STANDALONE_SOLVER
-    if (!solver->names) {
-	char *p;
-	int i;
+    /*
+     * The table is keyed on the state before deduction, so that a hit
+     * saves the deduction as well as the search.
+     */
+    if (solver->tt) {
+        const digit *known;
+        switch (latin_tt_probe(solver, key, &known)) {
+          case LATIN_TT_IMPOSSIBLE:
+            return false;
+          case LATIN_TT_UNIQUE:
+            if (!memcmp(known, soln, o*o))
+                return false;
+            memcpy(solver->grid, known, o*o);
+            return true;
+        }
+        work = solver->tt->guesses;
+    }
 
-	text = snewn(40 * o, char);
-	p = text;
+    ret = latin_solver_top(solver, diff_recursive - 1,
+                           diff_simple, diff_set_0, diff_set_1,
+                           diff_forcing, diff_recursive,
+                           usersolvers, ctx, ctxnew, ctxfree);
+    if (ret == diff_impossible) {
+        if (solver->tt)
+            latin_tt_store(solver, key, LATIN_TT_IMPOSSIBLE, NULL, 0);
+        return false;
+    }
 
-	solver->names = snewn(o, char *);
+    for (i = 0; i < o*o && !differs; i++)
+        if ((solver->grid[i] && solver->grid[i] != soln[i])
+#ifdef SEMI_LATIN
+            || (solver->forbid[i] && soln[i])
+            || (solver->force[i] && !soln[i])
+#endif
+            )
+            differs = true;
+
+    if (ret != diff_unfinished) {
+        /* Solved, one way or the other, and by deduction alone. */
+        if (solver->tt)
+            latin_tt_store(solver, key, LATIN_TT_UNIQUE, solver->grid, 0);
+        return differs;
+    }
 
-	for (i = 0; i < o; i++) {
-	    solver->names[i] = p;
-	    p += 1 + sprintf(p, "%d", i+1);
-	}
+    latin_arena_push(solver->arena);
+    list = latin_arena_newn(solver->arena, o+1, digit);
+    best = latin_solver_pick(solver, list, &j);
+    assert(best >= 0);
+
+    if (!differs) {
+        /* Move soln's option to the end of the list. */
+        for (i = 0; i < j && list[i] != soln[best]; i++);
+        for (; i+1 < j; i++) {
+            digit t = list[i];
+            list[i] = list[i+1];
+            list[i+1] = t;
+        }
     }
+
+    outgrid = latin_arena_newn(solver->arena, o*o, digit);
+#ifdef SEMI_LATIN
+    outforbid = latin_arena_newn(solver->arena, o*o, bool);
 #endif
 
-    diff = latin_solver_top(solver, maxdiff,
-			    diff_simple, diff_set_0, diff_set_1,
-			    diff_forcing, diff_recursive,
-			    usersolvers, ctx, ctxnew, ctxfree);
+    if (solver->trace)
+        latin_solver_report_recurse(solver, best, list, j);
 
-#ifdef STANDALONE_SOLVER
-    sfree(names);
-    sfree(text);
+    for (i = 0; i < j && !found; i++) {
+        struct latin_solver subsolver;
+        void *newctx;
+
+        if (latin_solver_spend(solver))
+            break;
+        if (solver->tt)
+            solver->tt->guesses++;
+
+        memcpy(outgrid, solver->grid, o*o);
+        outgrid[best] = list[i];
+#ifdef SEMI_LATIN
+        memcpy(outforbid, solver->forbid, o*o);
+        if (!list[i])
+            outforbid[best] = true;
 #endif
 
-    return diff;
+        if (solver->trace)
+            latin_solver_report(solver, LATIN_EV_GUESS, -1, LATIN_UNIT_CELL,
+                                best, best % o, best / o, list[i], NULL, 0);
+
+        newctx = ctxnew ? ctxnew(ctx) : ctx;
+        latin_solver_sub_alloc(&subsolver, solver, outgrid
+#ifdef SEMI_LATIN
+                               , outforbid
+#endif
+                               );
+        found = latin_solver_differ(&subsolver, soln,
+                                    differs || list[i] != soln[best],
+                                    diff_simple, diff_set_0, diff_set_1,
+                                    diff_forcing, diff_recursive,
+                                    usersolvers, newctx, ctxnew, ctxfree);
+        latin_solver_free(&subsolver);
+        if (ctxnew)
+            ctxfree(newctx);
+
+        if (solver->trace)
+            latin_solver_report(solver, LATIN_EV_RETRACT, -1, LATIN_UNIT_CELL,
+                                best, best % o, best / o, list[i], NULL, 0);
+
+        if (found)
+            memcpy(solver->grid, outgrid, o*o);
+        else if (latin_solver_stopped(solver))
+            break;
+    }
+
+    latin_arena_pop(solver->arena);
+
+    /*
+     * Having found nothing, we know that this state has no solution, or
+     * if it agrees with soln, that soln is its only one.
+     */
+    if (solver->tt && !found && !latin_solver_stopped(solver))
+        latin_tt_store(solver, key,
+                       differs ? LATIN_TT_IMPOSSIBLE : LATIN_TT_UNIQUE,
+                       soln, solver->tt->guesses - work);
+    return found;
+}
+
+int latin_solver_unique(struct latin_solver *solver, const digit *soln,
+                        int diff_simple, int diff_set_0, int diff_set_1,
+                        int diff_forcing, int diff_recursive,
+                        usersolver_t const *usersolvers, void *ctx,
+                        ctxnew_t ctxnew, ctxfree_t ctxfree)
+{
+    bool found = false, first;
+
+    latin_solver_start_budget(solver);
+    for (first = true; !found && latin_solver_restart(solver, first);
+         first = false)
+        found = latin_solver_differ(solver, soln, false,
+                                    diff_simple, diff_set_0, diff_set_1,
+                                    diff_forcing, diff_recursive,
+                                    usersolvers, ctx, ctxnew, ctxfree);
+    if (found)
+        return 0;
+    if (solver->budget && solver->budget->exhausted)
+        return -1;
+    return 1;
 }
 
 int latin_solver(digit *grid, int o
@@ -1502,111 +2586,825 @@ int latin_solver(digit *grid, int o
     return diff;
 }
 
+/* --------------------------------------------------------
+ * Batch solving.
+ *
+ * The simple tier's deductions are all of the form 'this candidate
+ * is the only one left in its row, column or cell' or, under
+ * SEMI_LATIN, 'this row already has as many filled cells as it can
+ * take', and the state they work on is a set of true/false facts. So
+ * they can be run on many puzzles at once by bit-slicing: each fact
+ * becomes a word with one bit per puzzle (a lane), and counting the
+ * candidates of a unit becomes a few AND and OR operations on words,
+ * which serve every lane together. The deductions are applied in the
+ * same order in every lane, so the lanes run in lock-step, and a lane
+ * which finds a contradiction is simply dropped from the live mask.
+ *
+ * The simple tier always reaches the same state whatever order its
+ * deductions are made in, and the solver only ever turns to a harder
+ * tier from that state. So a lane which is stuck there can be handed
+ * to the ordinary solver, as its grid and its filled and blank cells
+ * (from which the candidates follow), and the result is just as if
+ * the ordinary solver had done it all.
+ */
+
+typedef unsigned long long latin_lanes;
+#define LATIN_BATCH_LANES ((int)(sizeof(latin_lanes) * CHAR_BIT))
+
+struct latin_batch {
+    int o, depth, nlanes;
+    latin_lanes live;           /* lanes neither solved nor impossible */
+    latin_lanes dead;           /* lanes found impossible */
+    latin_lanes *cube;          /* o^3, indexed as the solver's cube */
+    latin_lanes *row, *col;     /* o^2, as the solver's row and col */
+    latin_lanes *filled;        /* o^2: cell has a number */
 #ifdef SEMI_LATIN
-void latin_solver_debug_force_forbid(int o, int depth, bool *force, bool *forbid)
-{
-#ifdef STANDALONE_SOLVER
-	if (solver_show_working > 1) {
-		int x, y;
-		for(y = 0; y < o; y++)
-		{
-		for(x = 0; x < o; x++)
-			printf("%*c ", depth, forbid[y*o+x] ? 'X' : force[y*o+x] ? 'O' : '-'); 
-		printf("\n");
-		}
-	}
+    latin_lanes *force, *forbid; /* o^2 */
 #endif
+    digit *grids;               /* a grid per lane */
+    bool progress;              /* something was deduced this pass */
+};
+
+/* Lanes (among 'need') in which none, or exactly one, of n words has
+ * its bit set. */
+static void latin_batch_tally(const latin_lanes *v, int n, int step,
+                              latin_lanes need,
+                              latin_lanes *none, latin_lanes *one)
+{
+    latin_lanes seen = 0, twice = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        twice |= seen & v[i*step];
+        seen |= v[i*step];
+    }
+    *none = need & ~seen;
+    *one = need & seen & ~twice;
 }
-#endif
 
-void latin_solver_debug(unsigned char *cube, int o
+static void latin_batch_place(struct latin_batch *b, int x, int y, int n,
+                              latin_lanes m)
+{
+    int o = b->o, i;
+
+    for (i = 1; i <= o; i++)
+        if (i != n)
+            b->cube[LATIN_CUBEPOS(o,x,y,i)] &= ~m;
+    for (i = 0; i < o; i++)
+        if (i != y)
+            b->cube[LATIN_CUBEPOS(o,x,i,n)] &= ~m;
+    for (i = 0; i < o; i++)
+        if (i != x)
+            b->cube[LATIN_CUBEPOS(o,i,y,n)] &= ~m;
+    b->filled[y*o+x] |= m;
+    b->row[y*o+n-1] |= m;
+    b->col[x*o+n-1] |= m;
 #ifdef SEMI_LATIN
-					  , int depth
+    b->force[y*o+x] |= m;
 #endif
-)
+    for (i = 0; m; i++, m >>= 1)
+        if (m & 1)
+            b->grids[i*o*o + y*o+x] = n;
+    b->progress = true;
+}
+
+static void latin_batch_kill(struct latin_batch *b, latin_lanes m)
 {
-#ifdef STANDALONE_SOLVER
-    if (solver_show_working > 1) {
-        struct latin_solver ls, *solver = &ls;
-        char *dbg;
-        int x, y, i, c = 0;
+    b->dead |= m;
+    b->live &= ~m;
+}
 
-        ls.cube = cube; ls.o = o; /* for cube() to work */
+/*
+ * Positional or numeric elimination in the o cube entries from
+ * 'start' apart by 'step', for the lanes in 'need'.
+ */
+static void latin_batch_elim(struct latin_batch *b, int start, int step,
+                             latin_lanes need)
+{
+    latin_lanes none, one;
+    int o = b->o, i;
+
+    latin_batch_tally(b->cube + start, o, step, need, &none, &one);
+    latin_batch_kill(b, none);
+    one &= b->live;
+    if (!one)
+        return;
+    for (i = 0; i < o; i++) {
+        int pos = start + i*step;
+        latin_lanes m = one & b->cube[pos];
+        if (m)
+            latin_batch_place(b, pos / (o*o), pos / o % o, pos % o + 1, m);
+    }
+}
 
-        dbg = snewn(3*o*o*o, char);
-        for (y = 0; y < o; y++) {
-            for (x = 0; x < o; x++) {
 #ifdef SEMI_LATIN
-				for(i = 1; i <= depth; i++) {
-#else
-                for (i = 1; i <= o; i++) {
-#endif
-                    if (cube(x,y,i))
-                        dbg[c++] = i + '0';
-                    else
-                        dbg[c++] = '.';
-                }
-                dbg[c++] = ' ';
-            }
-            dbg[c++] = '\n';
+#define LATIN_BATCH_PLANES 6    /* enough to count to LATIN_MAX_SEMI_ORDER */
+
+/*
+ * Count, per lane, how many of the o words from v apart by step have
+ * their bit set, as binary numbers held one bit-plane per word; then
+ * give the lanes where the count is k and where it is more than k.
+ */
+static void latin_batch_compare(const latin_lanes *v, int o, int step,
+                                int k, latin_lanes *eq, latin_lanes *gt)
+{
+    latin_lanes planes[LATIN_BATCH_PLANES], carry, t, same = ~(latin_lanes)0;
+    int i, p;
+
+    for (p = 0; p < LATIN_BATCH_PLANES; p++)
+        planes[p] = 0;
+    for (i = 0; i < o; i++) {
+        carry = v[i*step];
+        for (p = 0; p < LATIN_BATCH_PLANES && carry; p++) {
+            t = planes[p] & carry;
+            planes[p] ^= carry;
+            carry = t;
         }
-        dbg[c++] = '\n';
-        dbg[c++] = '\0';
+    }
 
-        printf("%s", dbg);
-        sfree(dbg);
+    *gt = 0;
+    for (p = LATIN_BATCH_PLANES - 1; p >= 0; p--) {
+        if (k & (1 << p))
+            same &= planes[p];
+        else {
+            *gt |= same & planes[p];
+            same &= ~planes[p];
+        }
     }
-#endif
+    *eq = same;
 }
 
-void latin_debug(digit *sq, int o)
+static void latin_batch_forbid(struct latin_batch *b, int pos, latin_lanes m)
 {
-#ifdef STANDALONE_SOLVER
-    if (solver_show_working) {
-        int x, y;
+    int o = b->o, x = pos % o, y = pos / o, n;
 
-        for (y = 0; y < o; y++) {
-            for (x = 0; x < o; x++) {
-                printf("%2d ", sq[y*o+x]);
-            }
-            printf("\n");
-        }
-        printf("\n");
-    }
-#endif
+    b->forbid[pos] |= m;
+    for (n = 1; n <= b->depth; n++)
+        b->cube[LATIN_CUBEPOS(o,x,y,n)] &= ~m;
+    b->progress = true;
 }
 
-/* --------------------------------------------------------
- * Generation.
+/*
+ * The blank and required cells deductions on one row or column: the
+ * o cells from 'first' apart by 'step' in the o*o arrays.
  */
-
-digit *latin_generate(int o, random_state *rs)
+static void latin_batch_assign(struct latin_batch *b, int first, int step)
 {
-    digit *sq;
-    int *adjdata, *adjsizes, *matching;
-    int **adjlists;
-    void *scratch;
-    int i, j, k;
-    digit *row;
+    int o = b->o, depth = b->depth, i;
+    latin_lanes eq, gt;
+
+    /* Enough cells need numbers: the rest are blank. */
+    latin_batch_compare(b->force + first, o, step, depth, &eq, &gt);
+    latin_batch_kill(b, b->live & gt);
+    eq &= b->live;
+    if (eq)
+        for (i = 0; i < o; i++) {
+            int pos = first + i*step;
+            latin_lanes m = eq & ~b->force[pos] & ~b->forbid[pos];
+            if (m)
+                latin_batch_forbid(b, pos, m);
+        }
 
-    /*
-     * To efficiently generate a latin square in such a way that
-     * all possible squares are possible outputs from the function,
-     * we make use of a theorem which states that any r x n latin
-     * rectangle, with r < n, can be extended into an (r+1) x n
-     * latin rectangle. In other words, we can reliably generate a
-     * latin square row by row, by at every stage writing down any
-     * row at all which doesn't conflict with previous rows, and
-     * the theorem guarantees that we will never have to backtrack.
-     *
-     * To find a viable row at each stage, we can make use of the
-     * support functions in matching.c.
-     */
+    /* Enough cells are blank: the rest need numbers. */
+    latin_batch_compare(b->forbid + first, o, step, o - depth, &eq, &gt);
+    latin_batch_kill(b, b->live & gt);
+    eq &= b->live;
+    if (eq)
+        for (i = 0; i < o; i++) {
+            int pos = first + i*step;
+            latin_lanes m = eq & ~b->force[pos] & ~b->forbid[pos];
+            if (m) {
+                b->force[pos] |= m;
+                b->progress = true;
+            }
+        }
+}
+#endif
 
-    sq = snewn(o*o, digit);
+/* One pass of the simple tier over every live lane. */
+static void latin_batch_pass(struct latin_batch *b)
+{
+    int o = b->o, x, y, n;
+#ifdef SEMI_LATIN
+    int depth = b->depth;
 
-    /*
-     * matching.c will take care of randomising the generation of each
+    if (depth < o) {
+        for (y = 0; y < o; y++)
+            latin_batch_assign(b, y*o, 1);
+        for (x = 0; x < o; x++)
+            latin_batch_assign(b, x, o);
+    }
+#else
+    int depth = o;
+#endif
+
+    for (y = 0; y < o; y++)
+        for (n = 1; n <= depth; n++)
+            latin_batch_elim(b, LATIN_CUBEPOS(o,0,y,n), o*o,
+                             b->live & ~b->row[y*o+n-1]);
+    for (x = 0; x < o; x++)
+        for (n = 1; n <= depth; n++)
+            latin_batch_elim(b, LATIN_CUBEPOS(o,x,0,n), o,
+                             b->live & ~b->col[x*o+n-1]);
+    for (x = 0; x < o; x++)
+        for (y = 0; y < o; y++)
+            latin_batch_elim(b, LATIN_CUBEPOS(o,x,y,1), 1,
+                             b->live & ~b->filled[y*o+x]
+#ifdef SEMI_LATIN
+                             & b->force[y*o+x]
+#endif
+                             );
+
+#ifdef SEMI_LATIN
+    /* A cell with nothing left to hold, which needn't hold anything,
+     * is blank (the ordinary solver does this as it rules out). */
+    if (depth < o)
+        for (y = 0; y < o; y++)
+            for (x = 0; x < o; x++) {
+                latin_lanes any = 0, m;
+                for (n = 1; n <= o; n++)
+                    any |= b->cube[LATIN_CUBEPOS(o,x,y,n)];
+                m = b->live & ~any & ~b->filled[y*o+x] &
+                    ~b->force[y*o+x] & ~b->forbid[y*o+x];
+                if (m)
+                    latin_batch_forbid(b, y*o+x, m);
+            }
+#endif
+}
+
+/* Lanes in which every cell is decided and the square is complete. */
+static latin_lanes latin_batch_done(struct latin_batch *b)
+{
+    int o = b->o, i, n;
+    latin_lanes done = b->live;
+#ifdef SEMI_LATIN
+    int depth = b->depth;
+#else
+    int depth = o;
+#endif
+
+    for (i = 0; i < o*o; i++) {
+#ifdef SEMI_LATIN
+        done &= b->filled[i] | b->forbid[i];
+        done &= ~b->force[i] | b->filled[i];
+#else
+        done &= b->filled[i];
+#endif
+    }
+    for (i = 0; i < o; i++)
+        for (n = 1; n <= depth; n++)
+            done &= b->row[i*o+n-1] & b->col[i*o+n-1];
+    return done;
+}
+
+void latin_solver_batch(int count, digit *grids, int o
+#ifdef SEMI_LATIN
+                        , int depth, const bool *force, const bool *forbid
+#endif
+                        , int *results, struct latin_solver_budget *budget,
+                        int maxdiff, int diff_simple, int diff_set_0,
+                        int diff_set_1, int diff_forcing, int diff_recursive,
+                        usersolver_t const *usersolvers, void *ctx,
+                        ctxnew_t ctxnew, ctxfree_t ctxfree)
+{
+    struct latin_batch b;
+    int a = o*o, base, k, i;
+#ifdef SEMI_LATIN
+    bool *lforce = snewn(a, bool), *lforbid = snewn(a, bool);
+#endif
+
+    b.o = o;
+#ifdef SEMI_LATIN
+    b.depth = depth;
+    b.force = snewn(a, latin_lanes);
+    b.forbid = snewn(a, latin_lanes);
+#else
+    b.depth = o;
+#endif
+    b.cube = snewn(a*o, latin_lanes);
+    b.row = snewn(a, latin_lanes);
+    b.col = snewn(a, latin_lanes);
+    b.filled = snewn(a, latin_lanes);
+
+    for (base = 0; base < count; base += LATIN_BATCH_LANES) {
+        latin_lanes done;
+
+        b.nlanes = min(count - base, LATIN_BATCH_LANES);
+        b.grids = grids + base * a;
+        b.live = b.dead = 0;
+        memset(b.cube, 0, a*o * sizeof(latin_lanes));
+        memset(b.row, 0, a * sizeof(latin_lanes));
+        memset(b.col, 0, a * sizeof(latin_lanes));
+        memset(b.filled, 0, a * sizeof(latin_lanes));
+#ifdef SEMI_LATIN
+        memset(b.force, 0, a * sizeof(latin_lanes));
+        memset(b.forbid, 0, a * sizeof(latin_lanes));
+#endif
+
+        /*
+         * Set each lane up with the ordinary solver, so that the
+         * clues mean exactly what they would to it, and transpose its
+         * state into the lanes.
+         */
+        for (k = 0; k < b.nlanes; k++) {
+            struct latin_solver ls;
+            latin_lanes bit = (latin_lanes)1 << k;
+
+            latin_solver_alloc(&ls, b.grids + k*a, o
+#ifdef SEMI_LATIN
+                               , depth, (bool *)force + (base+k)*a,
+                               (bool *)forbid + (base+k)*a
+#endif
+                               );
+            for (i = 0; i < a*o; i++)
+                if (ls.cube[i])
+                    b.cube[i] |= bit;
+            for (i = 0; i < a; i++) {
+                if (ls.row[i])
+                    b.row[i] |= bit;
+                if (ls.col[i])
+                    b.col[i] |= bit;
+                if (ls.grid[i])
+                    b.filled[i] |= bit;
+#ifdef SEMI_LATIN
+                if (ls.force[i])
+                    b.force[i] |= bit;
+                if (ls.forbid[i])
+                    b.forbid[i] |= bit;
+#endif
+            }
+            latin_solver_free(&ls);
+            b.live |= bit;
+        }
+
+        /* The simple tier, in every lane at once. The ordinary
+         * solver's own usersolver would have to run lane by lane. */
+        if (!usersolvers[diff_simple])
+            do {
+                b.progress = false;
+                latin_batch_pass(&b);
+            } while (b.progress && b.live);
+
+        done = latin_batch_done(&b);
+        for (k = 0; k < b.nlanes; k++) {
+            latin_lanes bit = (latin_lanes)1 << k;
+            struct latin_solver ls;
+
+            if (b.dead & bit) {
+                results[base+k] = diff_impossible;
+                continue;
+            } else if (done & bit) {
+                results[base+k] = diff_simple;
+                continue;
+            }
+
+            /* Stuck: over to the ordinary solver. */
+#ifdef SEMI_LATIN
+            for (i = 0; i < a; i++) {
+                lforce[i] = (b.force[i] & bit) != 0;
+                lforbid[i] = (b.forbid[i] & bit) != 0;
+            }
+#endif
+            latin_solver_alloc(&ls, b.grids + k*a, o
+#ifdef SEMI_LATIN
+                               , depth, lforce, lforbid
+#endif
+                               );
+            ls.budget = budget;
+            results[base+k] = latin_solver_main(&ls, maxdiff,
+                                                diff_simple, diff_set_0,
+                                                diff_set_1, diff_forcing,
+                                                diff_recursive, usersolvers,
+                                                ctx, ctxnew, ctxfree);
+            latin_solver_free(&ls);
+        }
+    }
+
+    sfree(b.cube);
+    sfree(b.row);
+    sfree(b.col);
+    sfree(b.filled);
+#ifdef SEMI_LATIN
+    sfree(b.force);
+    sfree(b.forbid);
+    sfree(lforce);
+    sfree(lforbid);
+#endif
+}
+
+#ifdef SEMI_LATIN
+void latin_solver_debug_force_forbid(FILE *fp, int o, int depth,
+                                     bool *force, bool *forbid)
+{
+	int x, y;
+	for(y = 0; y < o; y++)
+	{
+	for(x = 0; x < o; x++)
+		fprintf(fp, "%*c ", depth, forbid[y*o+x] ? 'X' : force[y*o+x] ? 'O' : '-'); 
+	fprintf(fp, "\n");
+	}
+}
+#endif
+
+void latin_solver_debug(FILE *fp, unsigned char *cube, int o
+#ifdef SEMI_LATIN
+					  , int depth
+#endif
+)
+{
+    struct latin_solver ls, *solver = &ls;
+    char *dbg;
+    int x, y, i, c = 0;
+
+    ls.cube = cube; ls.o = o; /* for cube() to work */
+
+    dbg = snewn(3*o*o*o, char);
+    for (y = 0; y < o; y++) {
+        for (x = 0; x < o; x++) {
+#ifdef SEMI_LATIN
+				for(i = 1; i <= depth; i++) {
+#else
+            for (i = 1; i <= o; i++) {
+#endif
+                if (cube(x,y,i))
+                    dbg[c++] = i + '0';
+                else
+                    dbg[c++] = '.';
+            }
+            dbg[c++] = ' ';
+        }
+        dbg[c++] = '\n';
+    }
+    dbg[c++] = '\n';
+    dbg[c++] = '\0';
+
+    fprintf(fp, "%s", dbg);
+    sfree(dbg);
+}
+
+void latin_debug(digit *sq, int o)
+{
+#ifdef STANDALONE_SOLVER
+    int x, y;
+
+    for (y = 0; y < o; y++) {
+        for (x = 0; x < o; x++) {
+            printf("%2d ", sq[y*o+x]);
+        }
+        printf("\n");
+    }
+    printf("\n");
+#endif
+}
+
+/* --------------------------------------------------------
+ * Trace sinks.
+ */
+
+void latin_trace_buffer_init(struct latin_trace_buffer *buf)
+{
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+    buf->list = NULL;
+    buf->listsize = 0;
+    buf->grid = NULL;
+    buf->gridsize = 0;
+}
+
+void latin_trace_buffer_free(struct latin_trace_buffer *buf)
+{
+    sfree(buf->data);
+    sfree(buf->list);
+    sfree(buf->grid);
+    latin_trace_buffer_init(buf);
+}
+
+/*
+ * Events are written as a type byte followed by their fields as
+ * unsigned LEB128 varints, with 1 added to those which may be -1.
+ * Almost every field fits in a single byte.
+ */
+static void latin_trace_put(struct latin_trace_buffer *buf, unsigned v)
+{
+    do {
+        if (buf->len >= buf->size) {
+            buf->size = buf->size * 3 / 2 + 256;
+            buf->data = sresize(buf->data, buf->size, unsigned char);
+        }
+        buf->data[buf->len++] = (v & 0x7F) | (v > 0x7F ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+}
+
+static bool latin_trace_get(struct latin_trace_buffer *buf, int *pos,
+                            int *ret)
+{
+    unsigned v = 0;
+    int shift = 0;
+
+    while (1) {
+        unsigned char c;
+        if (*pos >= buf->len || shift > 28)
+            return false;
+        c = buf->data[(*pos)++];
+        v |= (unsigned)(c & 0x7F) << shift;
+        shift += 7;
+        if (!(c & 0x80))
+            break;
+    }
+    *ret = (int)v;
+    return true;
+}
+
+void latin_trace_write(void *vbuf, const struct latin_solver_event *ev)
+{
+    struct latin_trace_buffer *buf = (struct latin_trace_buffer *)vbuf;
+    int i;
+
+    latin_trace_put(buf, ev->type);
+    latin_trace_put(buf, ev->o);
+    latin_trace_put(buf, ev->level);
+    latin_trace_put(buf, ev->tech + 1);
+    latin_trace_put(buf, ev->unit);
+    latin_trace_put(buf, ev->idx + 1);
+    latin_trace_put(buf, ev->x + 1);
+    latin_trace_put(buf, ev->y + 1);
+    latin_trace_put(buf, ev->n);
+    latin_trace_put(buf, ev->nlist);
+    for (i = 0; i < ev->nlist; i++)
+        latin_trace_put(buf, ev->list[i]);
+    if (ev->type == LATIN_EV_RESULT) {
+        for (i = 0; i < ev->o * ev->o; i++)
+            latin_trace_put(buf, ev->grid[i]);
+    }
+}
+
+/* The largest order a trace may claim; digits have to fit a byte. */
+#ifdef SEMI_LATIN
+#define LATIN_TRACE_MAX_ORDER LATIN_MAX_SEMI_ORDER
+#else
+#define LATIN_TRACE_MAX_ORDER 255
+#endif
+
+bool latin_trace_read(struct latin_trace_buffer *buf, int *pos,
+                      struct latin_solver_event *ev)
+{
+    int i, v;
+
+#define GET(field, adj) do {                            \
+        if (!latin_trace_get(buf, pos, &v)) return false; \
+        (field) = v - (adj);                            \
+    } while (0)
+
+    /*
+     * Every field is checked against what the solver can report
+     * before anything is done with it: a list entry is a number or a
+     * cell, and n a number or (for a result) one of the diff codes.
+     */
+#define CHECK(cond) do { if (!(cond)) return false; } while (0)
+
+    GET(ev->type, 0);
+    CHECK(ev->type >= 0 && ev->type < LATIN_NEV);
+    GET(ev->o, 0);
+    CHECK(ev->o >= 1 && ev->o <= LATIN_TRACE_MAX_ORDER);
+    GET(ev->level, 0);
+    CHECK(ev->level >= 0 && ev->level <= ev->o * ev->o);
+    GET(ev->tech, 1);
+    CHECK(ev->tech >= -1 && ev->tech < LATIN_NTECH);
+    CHECK(ev->tech >= 0 || ev->type != LATIN_EV_DEDUCE);
+    GET(ev->unit, 0);
+    CHECK(ev->unit >= LATIN_UNIT_NONE && ev->unit <= LATIN_UNIT_NUMBER);
+    GET(ev->idx, 1);
+    CHECK(ev->idx >= -1 && ev->idx < ev->o * ev->o);
+    GET(ev->x, 1);
+    CHECK(ev->x >= -1 && ev->x < ev->o);
+    GET(ev->y, 1);
+    CHECK(ev->y >= -1 && ev->y < ev->o);
+    GET(ev->n, 0);
+    CHECK(ev->n >= 0 && ev->n <= max(ev->o, (int)diff_exhausted));
+    GET(ev->nlist, 0);
+    CHECK(ev->nlist >= 0 && ev->nlist <= ev->o * ev->o);
+    if (ev->nlist > buf->listsize) {
+        buf->listsize = ev->nlist;
+        buf->list = sresize(buf->list, buf->listsize, int);
+    }
+    for (i = 0; i < ev->nlist; i++) {
+        GET(buf->list[i], 0);
+        CHECK(buf->list[i] >= 0 &&
+              buf->list[i] <= max(ev->o * ev->o - 1, ev->o));
+    }
+    ev->list = buf->list;
+    ev->grid = NULL;
+    if (ev->type == LATIN_EV_RESULT) {
+        if (ev->o * ev->o > buf->gridsize) {
+            buf->gridsize = ev->o * ev->o;
+            buf->grid = sresize(buf->grid, buf->gridsize, digit);
+        }
+        for (i = 0; i < ev->o * ev->o; i++) {
+            GET(v, 0);
+            CHECK(v >= 0 && v <= ev->o);
+            buf->grid[i] = v;
+        }
+        ev->grid = buf->grid;
+    }
+    ev->solver = NULL;
+
+#undef CHECK
+#undef GET
+    return true;
+}
+
+enum { PEND_NONE, PEND_COLON, PEND_FORBID, PEND_FORCE };
+
+/*
+ * Finish off whatever partial line the last event left behind.
+ */
+static void latin_trace_print_flush(struct latin_trace_printer *pr)
+{
+    if (pr->pending == PEND_COLON)
+        fprintf(pr->fp, ":\n");
+    else if (pr->pending != PEND_NONE)
+        fprintf(pr->fp, "\n");
+    pr->pending = PEND_NONE;
+}
+
+void latin_trace_print(void *vpr, const struct latin_solver_event *ev)
+{
+    struct latin_trace_printer *pr = (struct latin_trace_printer *)vpr;
+    FILE *fp = pr->fp;
+    int indent = ev->level * 4, i;
+
+    switch (ev->type) {
+      case LATIN_EV_PASS:
+        latin_trace_print_flush(pr);
+        if (pr->verbose > 1 && ev->solver) {
+#ifdef SEMI_LATIN
+            latin_solver_debug_force_forbid(fp, ev->o, ev->solver->depth,
+                                            ev->solver->force,
+                                            ev->solver->forbid);
+#endif
+            latin_solver_debug(fp, ev->solver->cube, ev->o
+#ifdef SEMI_LATIN
+                               , ev->solver->depth
+#endif
+                               );
+        }
+        break;
+
+      case LATIN_EV_DEDUCE:
+        latin_trace_print_flush(pr);
+        fprintf(fp, "%*s", indent, "");
+        switch (ev->tech) {
+          case LATIN_TECH_FORCING:
+            fprintf(fp, "forcing chain, %d at ends of ", ev->n);
+            for (i = 0; i < ev->nlist; i++)
+                fprintf(fp, "%s(%d,%d)", i ? "-" : "",
+                        ev->list[i] % ev->o + 1, ev->list[i] / ev->o + 1);
+            fprintf(fp, "\n");
+            return;
+          case LATIN_TECH_POSITIONAL:
+            fprintf(fp, "positional elimination, %d in %s %d", ev->n,
+                    ev->unit == LATIN_UNIT_ROW ? "row" : "column", ev->idx+1);
+            break;
+          case LATIN_TECH_NUMERIC:
+            fprintf(fp, "numeric elimination at (%d,%d)", ev->x+1, ev->y+1);
+            break;
+          case LATIN_TECH_POSITIONAL_SET:
+            fprintf(fp, "positional set elimination on %d", ev->idx);
+            break;
+          default:
+            fprintf(fp, "%s", latin_technique_name(ev->tech));
+            if (ev->unit == LATIN_UNIT_ROW || ev->unit == LATIN_UNIT_COL)
+                fprintf(fp, ", %s %d",
+                        ev->unit == LATIN_UNIT_ROW ? "row" : "column",
+                        ev->idx+1);
+            break;
+        }
+        pr->pending = PEND_COLON;
+        break;
+
+      case LATIN_EV_PLACE:
+      case LATIN_EV_RULE_OUT:
+        latin_trace_print_flush(pr);
+        fprintf(fp, "%*s  %s %d at (%d,%d)\n", indent, "",
+                ev->type == LATIN_EV_PLACE ? "placing" : "ruling out",
+                ev->n, ev->x+1, ev->y+1);
+        break;
+
+      case LATIN_EV_FORBID:
+      case LATIN_EV_FORCE:
+        {
+            int want = (ev->type == LATIN_EV_FORBID ? PEND_FORBID : PEND_FORCE);
+            if (pr->pending == want) {
+                fprintf(fp, ", (%d,%d)", ev->x+1, ev->y+1);
+            } else {
+                latin_trace_print_flush(pr);
+                fprintf(fp, "%*s  %s placement at (%d,%d)", indent, "",
+                        want == PEND_FORBID ? "forbiding" : "imposing some",
+                        ev->x+1, ev->y+1);
+                pr->pending = want;
+            }
+        }
+        break;
+
+      case LATIN_EV_CONTRADICTION:
+        latin_trace_print_flush(pr);
+        fprintf(fp, "%*s  %s\n", indent, "",
+                ev->tech == LATIN_TECH_POSITIONAL ||
+                ev->tech == LATIN_TECH_NUMERIC ?
+                "no possibilities available" :
+                ev->tech == LATIN_TECH_FORBID ?
+                "cannot have more forced cells than depth of the puzzle" :
+                ev->tech == LATIN_TECH_FORCE ?
+                "cannot have more forbidden cells than o-depth" :
+                "contradiction reached");
+        break;
+
+      case LATIN_EV_RECURSE:
+        latin_trace_print_flush(pr);
+        fprintf(fp, "%*srecursing on (%d,%d) [", indent, "", ev->x+1, ev->y+1);
+        for (i = 0; i < ev->nlist; i++) {
+            if (ev->list[i])
+                fprintf(fp, "%s%d", i ? " or " : "", ev->list[i]);
+            else
+                fprintf(fp, "%sblank", i ? " or " : "");
+        }
+        fprintf(fp, "]\n");
+        break;
+
+      case LATIN_EV_GUESS:
+      case LATIN_EV_RETRACT:
+        latin_trace_print_flush(pr);
+        fprintf(fp, "%*s%s ", indent, "",
+                ev->type == LATIN_EV_GUESS ? "guessing" : "retracting");
+        if (ev->n)
+            fprintf(fp, "%d", ev->n);
+        else
+            fprintf(fp, "blank");
+        fprintf(fp, " at (%d,%d)\n", ev->x+1, ev->y+1);
+        break;
+
+      case LATIN_EV_RESULT:
+        latin_trace_print_flush(pr);
+        if (ev->n == diff_exhausted) {
+            fprintf(fp, "%*sgave up (budget exhausted)\n", indent, "");
+        } else if (ev->n != diff_impossible && ev->n != diff_unfinished &&
+                   ev->n != diff_ambiguous) {
+            int x, y;
+
+            fprintf(fp, "%*sone solution found:\n", indent, "");
+            for (y = 0; y < ev->o; y++) {
+                fprintf(fp, "%*s", indent+1, "");
+                for (x = 0; x < ev->o; x++) {
+                    int val = ev->grid[y*ev->o+x];
+                    if (val)
+                        fprintf(fp, " %d", val);
+                    else
+                        fprintf(fp, " -");
+                }
+                fprintf(fp, "\n");
+            }
+        } else {
+            fprintf(fp, "%*s%s found\n", indent, "",
+                    ev->n == diff_impossible ? "no solution (impossible)" :
+                    ev->n == diff_unfinished ? "no solution (unfinished)" :
+                    "multiple solutions");
+        }
+        break;
+    }
+}
+
+/* --------------------------------------------------------
+ * Generation.
+ */
+
+digit *latin_generate(int o, random_state *rs)
+{
+    digit *sq;
+    int *adjdata, *adjsizes, *matching;
+    int **adjlists;
+    void *scratch;
+    int i, j, k;
+    digit *row;
+
+    /*
+     * To efficiently generate a latin square in such a way that
+     * all possible squares are possible outputs from the function,
+     * we make use of a theorem which states that any r x n latin
+     * rectangle, with r < n, can be extended into an (r+1) x n
+     * latin rectangle. In other words, we can reliably generate a
+     * latin square row by row, by at every stage writing down any
+     * row at all which doesn't conflict with previous rows, and
+     * the theorem guarantees that we will never have to backtrack.
+     *
+     * To find a viable row at each stage, we can make use of the
+     * support functions in matching.c.
+     */
+
+    sq = snewn(o*o, digit);
+
+    /*
+     * matching.c will take care of randomising the generation of each
      * row of the square, but in case this entire method of generation
      * introduces a really subtle top-to-bottom directional bias,
      * we'll also generate the rows themselves in random order.
@@ -1646,115 +3444,658 @@ digit *latin_generate(int o, random_state *rs)
             adjsizes[j] = p - adjlists[j];
         }
 
-	/*
-	 * Run the matching algorithm.
-	 */
-	j = matching_with_scratch(scratch, o, o, adjlists, adjsizes,
-                                  rs, matching, NULL);
-	assert(j == o);   /* by the above theorem, this must have succeeded */
+	/*
+	 * Run the matching algorithm.
+	 */
+	j = matching_with_scratch(scratch, o, o, adjlists, adjsizes,
+                                  rs, matching, NULL);
+	assert(j == o);   /* by the above theorem, this must have succeeded */
+
+	/*
+	 * And use the output to set up the new row of the latin
+	 * square.
+	 */
+	for (j = 0; j < o; j++)
+	    sq[row[i]*o + j] = matching[j] + 1;
+    }
+
+    /*
+     * Done. Free our internal workspaces...
+     */
+    sfree(matching);
+    sfree(adjlists);
+    sfree(adjsizes);
+    sfree(adjdata);
+    sfree(scratch);
+    sfree(row);
+
+    /*
+     * ... and return our completed latin square.
+     */
+    return sq;
+}
+
+/*
+ * Generate h rows of width w, each holding 1..depth once and leaving
+ * the other w-depth cells blank (0), with no number repeated in a
+ * column and no column given more than w-depth blanks. With depth == w
+ * this is a latin rectangle, and with h == w as well a latin square.
+ *
+ * This works row by row exactly like latin_generate, the blanks being
+ * w-depth interchangeable extra symbols on the right of the matching,
+ * open to any column with blanks to spare. It still never needs to
+ * backtrack: the blank cells so far form a bipartite graph of maximum
+ * degree w-depth, so by Konig's theorem they can be given distinct
+ * labels from w-depth blank symbols, and the result is a latin
+ * rectangle, which the theorem in latin_generate extends by a row.
+ */
+static digit *latin_generate_rows(int w, int h, int depth, random_state *rs)
+{
+    digit *sq;
+    unsigned char *seen;
+    int *adjdata, *adjsizes, *matching, *blanks, *row;
+    int **adjlists;
+    void *scratch;
+    int i, j, k;
+
+    assert(h <= w && depth <= w);
+
+    sq = snewn(w*h, digit);
+    seen = snewn(w*depth, unsigned char); /* [x*depth+n-1]: n in col x */
+    memset(seen, 0, w*depth);
+    blanks = snewn(w, int);
+    for (j = 0; j < w; j++)
+        blanks[j] = 0;
+
+    /* As in latin_generate, fill the rows in a random order. */
+    row = snewn(h, int);
+    for (i = 0; i < h; i++)
+        row[i] = i;
+    shuffle(row, h, sizeof(*row), rs);
+
+    scratch = smalloc(matching_scratch_size(w, w));
+    adjdata = snewn(w*w, int);
+    adjlists = snewn(w, int *);
+    adjsizes = snewn(w, int);
+    matching = snewn(w, int);
+
+    for (i = 0; i < h; i++) {
+        /*
+         * Join each column to the numbers it doesn't have yet, and
+         * to the blank symbols depth..w-1 if it can take another.
+         */
+        for (j = 0; j < w; j++) {
+            int *p = adjlists[j] = adjdata + j*w;
+            for (k = 0; k < depth; k++)
+                if (!seen[j*depth+k])
+                    *p++ = k;
+            if (blanks[j] < w - depth)
+                for (k = depth; k < w; k++)
+                    *p++ = k;
+            adjsizes[j] = p - adjlists[j];
+        }
+
+        j = matching_with_scratch(scratch, w, w, adjlists, adjsizes,
+                                  rs, matching, NULL);
+        assert(j == w);   /* guaranteed, as explained above */
+
+        for (j = 0; j < w; j++) {
+            k = matching[j];
+            if (k < depth) {
+                sq[row[i]*w + j] = k + 1;
+                seen[j*depth+k] = 1;
+            } else {
+                sq[row[i]*w + j] = 0;
+                blanks[j]++;
+            }
+        }
+    }
+
+    sfree(matching);
+    sfree(adjsizes);
+    sfree(adjlists);
+    sfree(adjdata);
+    sfree(scratch);
+    sfree(row);
+    sfree(blanks);
+    sfree(seen);
+
+    return sq;
+}
+
+digit *latin_generate_rect(int w, int h, random_state *rs)
+{
+    int o = max(w, h), x, y;
+    digit *rows, *latin_rect;
+
+    /*
+     * Only the h rows we want, or if the rectangle is tall, its
+     * columns as rows of length h.
+     */
+    if (h <= w)
+        return latin_generate_rows(w, h, o, rs);
+
+    rows = latin_generate_rows(h, w, o, rs);
+    latin_rect = snewn(w*h, digit);
+    for (x = 0; x < w; x++)
+        for (y = 0; y < h; y++)
+            latin_rect[y*w + x] = rows[x*h + y];
+    sfree(rows);
+    return latin_rect;
+}
+
+digit *latin_generate_partial(int o, int depth, random_state *rs)
+{
+    return latin_generate_rows(o, o, depth, rs);
+}
+
+/* --------------------------------------------------------
+ * Checking.
+ */
+
+#define ELT(sq,x,y) (sq[((y)*order)+(x)])
+
+/*
+ * The checks below OR together one bit per cell into a mask for each
+ * row and column. A line of 'order' cells is a permutation of 1..order
+ * exactly when its mask has precisely bits 1..order set, so there is no
+ * need to look for repeats separately, and no branches in the inner
+ * loops. Squares small enough for one word per line (the usual case)
+ * keep their column masks in an array on the stack, updated a row at a
+ * time, which compilers turn into vector code; larger ones go a line
+ * at a time through a few words.
+ */
+typedef unsigned long lc_word;
+#define LC_BITS ((int)(sizeof(lc_word) * CHAR_BIT))
+#define LC_WORDS ((UCHAR_MAX + LC_BITS) / LC_BITS)  /* any digit's bit */
+
+static bool latin_check_small(const digit *sq, int order)
+{
+    lc_word cols[LC_BITS], full = ((lc_word)2 << order) - 2, rows = 0;
+    int x, y, big = 0;
+
+    for (x = 0; x < order; x++)
+        cols[x] = 0;
+    for (y = 0; y < order; y++) {
+        lc_word row = 0;
+        for (x = 0; x < order; x++) {
+            digit d = ELT(sq, x, y);
+            lc_word bit = (lc_word)1 << (d & (LC_BITS-1));
+            big |= d >= LC_BITS;
+            row |= bit;
+            cols[x] |= bit;
+        }
+        rows |= row ^ full;
+    }
+    for (x = 0; x < order; x++)
+        rows |= cols[x] ^ full;
+    return rows != 0 || big;
+}
+
+static bool latin_check_line(const digit *sq, int order, int start, int step)
+{
+    lc_word seen[LC_WORDS];
+    int i;
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < order; i++) {
+        digit d = sq[start + i*step];
+        seen[d / LC_BITS] |= (lc_word)1 << (d % LC_BITS);
+    }
+    for (i = 0; i < LC_WORDS; i++) {
+        int lo = i * LC_BITS;
+        lc_word want = 0;
+        int b;
+        for (b = 0; b < LC_BITS; b++)
+            if (lo + b >= 1 && lo + b <= order)
+                want |= (lc_word)1 << b;
+        if (seen[i] != want)
+            return true;
+    }
+    return false;
+}
+
+/* returns true if sq is not a latin square. */
+bool latin_check(const digit *sq, int order)
+{
+    int i;
+
+    if (order < LC_BITS - 1)
+        return latin_check_small(sq, order);
+
+    for (i = 0; i < order; i++)
+        if (latin_check_line(sq, order, i*order, 1) ||
+            latin_check_line(sq, order, i, order))
+            return true;
+    return false;
+}
+
+int latin_check_batch(const digit *sqs, int order, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (latin_check(sqs + (size_t)i * order * order, order))
+            return i;
+    return -1;
+}
 
-	/*
-	 * And use the output to set up the new row of the latin
-	 * square.
-	 */
-	for (j = 0; j < o; j++)
-	    sq[row[i]*o + j] = matching[j] + 1;
-    }
 
-    /*
-     * Done. Free our internal workspaces...
-     */
-    sfree(matching);
-    sfree(adjlists);
-    sfree(adjsizes);
-    sfree(adjdata);
-    sfree(scratch);
-    sfree(row);
+/* --------------------------------------------------------
+ * Counting.
+ */
+
+/*
+ * latin_count fills the square a row at a time. Which completions of
+ * the rows below are possible depends only on which numbers each
+ * column has used so far, so each layer of the count is a map from
+ * that state to the number of ways of reaching it. The state has a
+ * bit for each number and column: bit (n-1)*o + c says that column c
+ * holds n. Rather than run all the way down, the rows are counted
+ * from the top and from the bottom to meet in the middle, where the
+ * two halves must use complementary numbers in every column; that
+ * keeps the layers to the size of the middle one rather than the
+ * largest.
+ *
+ * The numbers no clue mentions are interchangeable: every row allows
+ * each of them the same columns, so permuting them maps the ways of
+ * reaching a state onto the ways of reaching the permuted one. So a
+ * layer holds one state of each such orbit, with the free numbers'
+ * columns in decreasing order, and the total for the whole orbit.
+ * Where the halves meet, each orbit's total is the same multiple of
+ * the ways per state on both sides, so dividing one of them by the
+ * orbit's size gives the product exactly. With no clues this cuts the
+ * layers by up to depth! times.
+ */
+#define LATIN_COUNT_MAXSTATES (1L << 22)
+#define LATIN_COUNT_EMPTY (~0ULL)     /* never a state: no layer is full */
+
+struct latin_count_map {
+    unsigned long long *keys, *vals;
+    size_t size, n;                   /* size is a power of two */
+    bool full;                        /* a state was dropped for space */
+};
 
+struct latin_count_row {
+    int o, depth;
+    unsigned long long allowed[64];   /* columns each number may take */
+    unsigned long long force;         /* columns which must be filled */
+    unsigned long long open;          /* columns which may be filled */
     /*
-     * ... and return our completed latin square.
+     * What the rows still to come after this one can do, to weed out
+     * states with no future: the (number, column) pairs they allow,
+     * and the fewest and most numbers they can add to each column.
      */
-    return sq;
+    unsigned long long supply, full;
+    int lo[64], hi[64];
+    int nfree, free[64];              /* numbers no clue mentions */
+};
+
+static unsigned long long latin_count_sat_add(unsigned long long a,
+                                              unsigned long long b)
+{
+    return a + b < a ? ULLONG_MAX : a + b;
 }
 
-digit *latin_generate_rect(int w, int h, random_state *rs)
+static unsigned long long latin_count_sat_mul(unsigned long long a,
+                                              unsigned long long b)
 {
-    int o = max(w, h), x, y;
-    digit *latin, *latin_rect;
+    return b && a > ULLONG_MAX / b ? ULLONG_MAX : a * b;
+}
 
-    latin = latin_generate(o, rs);
-    latin_rect = snewn(w*h, digit);
+static void latin_count_map_init(struct latin_count_map *map)
+{
+    size_t i;
+
+    map->size = 64;
+    map->n = 0;
+    map->full = false;
+    map->keys = snewn(map->size, unsigned long long);
+    map->vals = snewn(map->size, unsigned long long);
+    for (i = 0; i < map->size; i++)
+        map->keys[i] = LATIN_COUNT_EMPTY;
+}
+
+static void latin_count_map_free(struct latin_count_map *map)
+{
+    sfree(map->keys);
+    sfree(map->vals);
+}
+
+static size_t latin_count_slot(const struct latin_count_map *map,
+                               unsigned long long key)
+{
+    size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+
+    for (i &= map->size - 1;
+         map->keys[i] != LATIN_COUNT_EMPTY && map->keys[i] != key;
+         i = (i + 1) & (map->size - 1));
+    return i;
+}
+
+static void latin_count_map_add(struct latin_count_map *map,
+                                unsigned long long key,
+                                unsigned long long val)
+{
+    size_t i;
 
-    for (x = 0; x < w; x++) {
-        for (y = 0; y < h; y++) {
-            latin_rect[y*w + x] = latin[y*o + x];
+    assert(key != LATIN_COUNT_EMPTY);
+    if (2 * (map->n + 1) > map->size) {
+        if (map->n >= (size_t)LATIN_COUNT_MAXSTATES) {
+            map->full = true;
+            return;
         }
+        struct latin_count_map old = *map;
+
+        map->size *= 2;
+        map->n = 0;
+        map->keys = snewn(map->size, unsigned long long);
+        map->vals = snewn(map->size, unsigned long long);
+        for (i = 0; i < map->size; i++)
+            map->keys[i] = LATIN_COUNT_EMPTY;
+        for (i = 0; i < old.size; i++)
+            if (old.keys[i] != LATIN_COUNT_EMPTY)
+                latin_count_map_add(map, old.keys[i], old.vals[i]);
+        latin_count_map_free(&old);
     }
 
-    sfree(latin);
-    return latin_rect;
+    i = latin_count_slot(map, key);
+    if (map->keys[i] == LATIN_COUNT_EMPTY) {
+        map->keys[i] = key;
+        map->vals[i] = val;
+        map->n++;
+    } else {
+        map->vals[i] = latin_count_sat_add(map->vals[i], val);
+    }
 }
 
-/* --------------------------------------------------------
- * Checking.
+static unsigned long long latin_count_map_get(const struct latin_count_map *map,
+                                              unsigned long long key)
+{
+    size_t i = latin_count_slot(map, key);
+    return map->keys[i] == LATIN_COUNT_EMPTY ? 0 : map->vals[i];
+}
+
+/*
+ * The least of a state's orbit: its free numbers' columns in
+ * decreasing order. Also, if orbit isn't NULL, the orbit's size.
  */
+static unsigned long long latin_count_canon(const struct latin_count_row *row,
+                                            unsigned long long state,
+                                            unsigned long long *orbit)
+{
+    int o = row->o, i, j, run;
+    unsigned long long omask = (o == 64 ? ~0ULL : (1ULL << o) - 1);
+    unsigned long long cols[64], c;
+
+    if (orbit)
+        *orbit = 1;
+    if (row->nfree < 2)
+        return state;
+
+    for (i = 0; i < row->nfree; i++) {
+        c = (state >> ((row->free[i]-1) * o)) & omask;
+        for (j = i; j > 0 && cols[j-1] < c; j--)
+            cols[j] = cols[j-1];
+        cols[j] = c;
+    }
+    for (i = 0; i < row->nfree; i++) {
+        int shift = (row->free[i]-1) * o;
+        state = (state & ~(omask << shift)) | (cols[i] << shift);
+    }
 
-typedef struct lcparams {
-    digit elt;
-    int count;
-} lcparams;
+    /* nfree! over the factorials of the runs of equal columns. */
+    if (orbit)
+        for (i = run = 1; i < row->nfree; i++) {
+            run = (cols[i] == cols[i-1] ? run + 1 : 1);
+            *orbit = *orbit * (i+1) / run;
+        }
+    return state;
+}
 
-static int latin_check_cmp(void *v1, void *v2)
+/* Place numbers n.. of a row in every possible way, given the state
+ * so far and the columns the row has already filled. */
+static void latin_count_fill(const struct latin_count_row *row, int n,
+                             unsigned long long state,
+                             unsigned long long used, unsigned long long val,
+                             struct latin_count_map *out)
 {
-    lcparams *lc1 = (lcparams *)v1;
-    lcparams *lc2 = (lcparams *)v2;
+    int o = row->o, shift, c;
+    unsigned long long cand, omask = (o == 64 ? ~0ULL : (1ULL << o) - 1);
+
+    if (n > row->depth) {
+        unsigned long long missing = row->full ^ state;
+        int k;
+
+        if ((used & row->force) != row->force || (missing & ~row->supply))
+            return;
+        for (c = 0; c < o; c++) {
+            for (k = 0, shift = c; shift < o * row->depth; shift += o)
+                k += (missing >> shift) & 1;
+            if (k < row->lo[c] || k > row->hi[c])
+                return;
+        }
+        latin_count_map_add(out, latin_count_canon(row, state, NULL), val);
+        return;
+    }
 
-    if (lc1->elt < lc2->elt) return -1;
-    if (lc1->elt > lc2->elt) return 1;
-    return 0;
+    shift = (n-1) * o;
+    cand = row->allowed[n-1] & ~used & ~((state >> shift) & omask);
+    while (cand) {
+        c = 0;
+        while (!(cand & (1ULL << c)))
+            c++;
+        cand &= cand - 1;
+        latin_count_fill(row, n+1, state | (1ULL << (shift + c)),
+                         used | (1ULL << c), val, out);
+    }
 }
 
-#define ELT(sq,x,y) (sq[((y)*order)+(x)])
+struct latin_count_job {
+    const struct latin_count_row *row;
+    const struct latin_count_map *in;
+    size_t from, to;                  /* slots of in to expand */
+    struct latin_count_map out;
+};
 
-/* returns true if sq is not a latin square. */
-bool latin_check(digit *sq, int order)
-{
-    tree234 *dict = newtree234(latin_check_cmp);
-    int c, r;
-    bool ret = false;
-    lcparams *lcp, lc, *aret;
-
-    /* Use a tree234 as a simple hash table, go through the square
-     * adding elements as we go or incrementing their counts. */
-    for (c = 0; c < order; c++) {
-	for (r = 0; r < order; r++) {
-	    lc.elt = ELT(sq, c, r); lc.count = 0;
-	    lcp = find234(dict, &lc, NULL);
-	    if (!lcp) {
-		lcp = snew(lcparams);
-		lcp->elt = ELT(sq, c, r);
-		lcp->count = 1;
-                aret = add234(dict, lcp);
-		assert(aret == lcp);
-	    } else {
-		lcp->count++;
-	    }
-	}
+static void *latin_count_expand(void *vjob)
+{
+    struct latin_count_job *job = (struct latin_count_job *)vjob;
+    size_t i;
+
+    latin_count_map_init(&job->out);
+    for (i = job->from; i < job->to && !job->out.full; i++)
+        if (job->in->keys[i] != LATIN_COUNT_EMPTY)
+            latin_count_fill(job->row, 1, job->in->keys[i], 0,
+                             job->in->vals[i], &job->out);
+    return NULL;
+}
+
+/*
+ * Replace *layer with the states after one more row. With threads,
+ * each expands a share of the states into a map of its own, and the
+ * maps are summed afterwards.
+ */
+static bool latin_count_layer(struct latin_count_map *layer,
+                              const struct latin_count_row *row,
+                              int nthreads)
+{
+    struct latin_count_job *jobs;
+    size_t i, t, share;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    jobs = snewn(nthreads, struct latin_count_job);
+    share = (layer->size + nthreads - 1) / nthreads;
+    for (t = 0; t < (size_t)nthreads; t++) {
+        jobs[t].row = row;
+        jobs[t].in = layer;
+        jobs[t].from = t * share < layer->size ? t * share : layer->size;
+        jobs[t].to = jobs[t].from + share < layer->size ?
+            jobs[t].from + share : layer->size;
     }
 
-    /* There should be precisely 'order' letters in the alphabet,
-     * each occurring 'order' times (making the OxO tree) */
-    if (count234(dict) != order) ret = true;
-    else {
-	for (c = 0; (lcp = index234(dict, c)) != NULL; c++) {
-	    if (lcp->count != order) ret = true;
-	}
+#ifdef LATIN_THREADS
+    if (nthreads > 1) {
+        pthread_t *threads = snewn(nthreads, pthread_t);
+        bool *started = snewn(nthreads, bool);
+
+        for (t = 1; t < (size_t)nthreads; t++)
+            started[t] = !pthread_create(&threads[t], NULL,
+                                         latin_count_expand, &jobs[t]);
+        latin_count_expand(&jobs[0]);
+        for (t = 1; t < (size_t)nthreads; t++) {
+            if (started[t])
+                pthread_join(threads[t], NULL);
+            else
+                latin_count_expand(&jobs[t]);   /* do it ourselves */
+        }
+        sfree(threads);
+        sfree(started);
+    } else
+#endif
+    for (t = 0; t < (size_t)nthreads; t++)
+        latin_count_expand(&jobs[t]);
+
+    latin_count_map_free(layer);
+    *layer = jobs[0].out;
+    for (t = 1; t < (size_t)nthreads; t++) {
+        layer->full |= jobs[t].out.full;
+        for (i = 0; i < jobs[t].out.size && !layer->full; i++)
+            if (jobs[t].out.keys[i] != LATIN_COUNT_EMPTY)
+                latin_count_map_add(layer, jobs[t].out.keys[i],
+                                    jobs[t].out.vals[i]);
+        latin_count_map_free(&jobs[t].out);
     }
-    for (c = 0; (lcp = index234(dict, c)) != NULL; c++)
-	sfree(lcp);
-    freetree234(dict);
 
-    return ret;
+    sfree(jobs);
+    return !layer->full;
+}
+
+bool latin_count(const digit *grid, int o
+#ifdef SEMI_LATIN
+                 , int depth, const bool *force, const bool *forbid
+#endif
+                 , int nthreads, unsigned long long *count)
+{
+#ifndef SEMI_LATIN
+    int depth = o;
+#endif
+    struct latin_count_map half[2];
+    struct latin_count_row *rows, *row;
+    unsigned long long full, total;
+    int mid = o / 2, x, y, n, h, k, nfree;
+    int free[64];
+    bool clued[64];
+    size_t i;
+    bool ok = true;
+
+    if (o * depth > 64)
+        return false;
+    full = o * depth == 64 ? ~0ULL : (1ULL << (o * depth)) - 1;
+
+    for (n = 1; n <= depth; n++)
+        clued[n-1] = false;
+    for (i = 0; i < (size_t)(o*o); i++)
+        if (grid[i] && grid[i] <= depth)
+            clued[grid[i]-1] = true;
+    for (n = 1, nfree = 0; n <= depth; n++)
+        if (!clued[n-1])
+            free[nfree++] = n;
+
+    rows = snewn(o, struct latin_count_row);
+    for (y = 0; y < o; y++) {
+        row = &rows[y];
+        row->o = o;
+        row->depth = depth;
+        row->full = full;
+        row->nfree = nfree;
+        memcpy(row->free, free, nfree * sizeof(int));
+        row->force = row->open = 0;
+        for (n = 1; n <= depth; n++)
+            row->allowed[n-1] = 0;
+        for (x = 0; x < o; x++) {
+            digit d = grid[y*o+x];
+#ifdef SEMI_LATIN
+            if (force[y*o+x] || d)
+                row->force |= 1ULL << x;
+            if (forbid[y*o+x])
+                continue;
+#else
+            row->force |= 1ULL << x;
+#endif
+            row->open |= 1ULL << x;
+            for (n = 1; n <= depth; n++)
+                if (!d || d == n)
+                    row->allowed[n-1] |= 1ULL << x;
+        }
+        /* A number clued in this row may go nowhere else. */
+        for (x = 0; x < o; x++)
+            if (grid[y*o+x] && grid[y*o+x] <= depth)
+                row->allowed[grid[y*o+x]-1] &= 1ULL << x;
+    }
+
+    for (h = 0; h < 2; h++) {
+        latin_count_map_init(&half[h]);
+        latin_count_map_add(&half[h], 0, 1);
+    }
+
+    /* half[0] takes rows 0..mid-1 downwards, half[1] the rest upwards. */
+    for (h = 0; h < 2 && ok; h++) {
+        int nrows = h ? o - mid : mid;
+
+        for (k = 0; k < nrows && ok; k++) {
+            int r, from, to;
+
+            y = h ? o-1 - k : k;
+            row = &rows[y];
+
+            /* The rows this half has yet to place, and all the other's. */
+            from = h ? 0 : y+1;
+            to = h ? y : o;
+            row->supply = 0;
+            for (x = 0; x < o; x++)
+                row->lo[x] = row->hi[x] = 0;
+            for (r = from; r < to; r++) {
+                for (n = 1; n <= depth; n++)
+                    row->supply |= rows[r].allowed[n-1] << ((n-1) * o);
+                for (x = 0; x < o; x++) {
+                    row->lo[x] += (rows[r].force >> x) & 1;
+                    row->hi[x] += (rows[r].open >> x) & 1;
+                }
+            }
+
+            ok = latin_count_layer(&half[h], row, nthreads);
+        }
+    }
+
+    if (ok) {
+        total = 0;
+        for (i = 0; i < half[0].size; i++) {
+            unsigned long long top = half[0].vals[i], bottom, orbit, key;
+
+            if (half[0].keys[i] == LATIN_COUNT_EMPTY)
+                continue;
+            key = latin_count_canon(&rows[0], full ^ half[0].keys[i], &orbit);
+            bottom = latin_count_map_get(&half[1], key);
+            /*
+             * A saturated total is still at least 2^64 once multiplied
+             * by the other side's ways per state, which are at least 1.
+             */
+            if (bottom && top != ULLONG_MAX && bottom != ULLONG_MAX) {
+                assert(top % orbit == 0);
+                top /= orbit;
+            }
+            total = latin_count_sat_add(total,
+                                        latin_count_sat_mul(top, bottom));
+        }
+        *count = total;
+    }
+
+    latin_count_map_free(&half[0]);
+    latin_count_map_free(&half[1]);
+    sfree(rows);
+    return ok;
 }
 
 
@@ -1782,12 +4123,10 @@ static void latin_print(digit *sq, int order)
     printf("\n");
 }
 
-static void gen(int order, random_state *rs, int debug)
+static void gen(int order, random_state *rs)
 {
     digit *sq;
 
-    solver_show_working = debug;
-
     sq = latin_generate(order, rs);
     latin_print(sq, order);
     if (latin_check(sq, order)) {
@@ -1798,19 +4137,29 @@ static void gen(int order, random_state *rs, int debug)
     sfree(sq);
 }
 
+#define SOAK_BATCH 64
+
 void test_soak(int order, random_state *rs)
 {
-    digit *sq;
-    int n = 0;
+    digit *sq, *batch = snewn(SOAK_BATCH * order * order, digit);
+    int n = 0, i, bad;
     time_t tt_start, tt_now, tt_last;
 
-    solver_show_working = 0;
     tt_now = tt_start = time(NULL);
 
     while(1) {
-        sq = latin_generate(order, rs);
-        sfree(sq);
-        n++;
+        for (i = 0; i < SOAK_BATCH; i++) {
+            sq = latin_generate(order, rs);
+            memcpy(batch + i * order * order, sq, order * order);
+            sfree(sq);
+        }
+        bad = latin_check_batch(batch, order, SOAK_BATCH);
+        if (bad >= 0) {
+            fprintf(stderr, "Square %d is not a latin square!\n", n + bad);
+            latin_print(batch + bad * order * order, order);
+            exit(1);
+        }
+        n += SOAK_BATCH;
 
         tt_last = time(NULL);
         if (tt_last > tt_now) {
@@ -1821,17 +4170,521 @@ void test_soak(int order, random_state *rs)
     }
 }
 
+/*
+ * Self-checks, run by --selftest. Everything the solver says about a
+ * small puzzle can be checked against plain backtracking over every
+ * way of filling it in, so these build random puzzles of orders up to
+ * 5 and compare: the counts, whether a solution is unique, the
+ * solution itself, and the answers with a transposition table and in
+ * a batch against those without. Each test returns its number of
+ * failures, having reported them.
+ */
+
+enum { TEST_SIMPLE, TEST_SET_0, TEST_SET_1, TEST_FORCING, TEST_RECURSIVE };
+static usersolver_t const test_usersolvers[TEST_RECURSIVE+1] = { NULL };
+
+#define TEST_MAX_ORDER 5
+#define TEST_BRUTE_LIMIT 100000ULL
+
+/* A puzzle: clues (0 for none) and, under SEMI_LATIN, marks. */
+struct test_puzzle {
+    int o, depth;
+    digit *grid;
+    bool *force, *forbid;
+};
+
+struct test_brute {
+    const struct test_puzzle *pz;
+    digit *grid, *first;    /* working grid, and the first completion */
+    unsigned rowmask[TEST_MAX_ORDER], colmask[TEST_MAX_ORDER];
+    int rowfill[TEST_MAX_ORDER], colfill[TEST_MAX_ORDER];
+    unsigned long long count;
+};
+
+static void test_brute_fill(struct test_brute *tb, int pos)
+{
+    const struct test_puzzle *pz = tb->pz;
+    int o = pz->o, x = pos % o, y = pos / o, n, lo, hi;
+
+    if (pos == o*o) {
+        if (tb->count++ == 0)
+            memcpy(tb->first, tb->grid, o*o);
+        return;
+    }
+    if (pz->grid[pos])
+        lo = hi = pz->grid[pos];
+    else {
+        lo = pz->force[pos] ? 1 : 0;
+        hi = pz->forbid[pos] ? 0 : pz->depth;
+    }
+    for (n = lo; n <= hi && tb->count < TEST_BRUTE_LIMIT; n++) {
+        unsigned bit = n ? 1U << n : 0;
+        int filled = n ? 1 : 0;
+        if ((tb->rowmask[y] | tb->colmask[x]) & bit)
+            continue;
+        /* Each line must end up holding all of 1..depth. */
+        if (tb->rowfill[y] + filled + (o-1-x) < pz->depth ||
+            tb->colfill[x] + filled + (o-1-y) < pz->depth)
+            continue;
+        tb->grid[pos] = n;
+        tb->rowmask[y] |= bit;
+        tb->colmask[x] |= bit;
+        tb->rowfill[y] += filled;
+        tb->colfill[x] += filled;
+        test_brute_fill(tb, pos+1);
+        tb->rowmask[y] &= ~bit;
+        tb->colmask[x] &= ~bit;
+        tb->rowfill[y] -= filled;
+        tb->colfill[x] -= filled;
+    }
+    tb->grid[pos] = 0;
+}
+
+/*
+ * Count a puzzle's completions by backtracking, up to
+ * TEST_BRUTE_LIMIT, leaving the first in first if there is one.
+ */
+static unsigned long long test_brute(const struct test_puzzle *pz,
+                                     digit *first)
+{
+    struct test_brute tb;
+
+    tb.pz = pz;
+    tb.grid = snewn(pz->o * pz->o, digit);
+    tb.first = first;
+    memset(tb.rowmask, 0, sizeof(tb.rowmask));
+    memset(tb.colmask, 0, sizeof(tb.colmask));
+    memset(tb.rowfill, 0, sizeof(tb.rowfill));
+    memset(tb.colfill, 0, sizeof(tb.colfill));
+    tb.count = 0;
+    test_brute_fill(&tb, 0);
+    sfree(tb.grid);
+    return tb.count;
+}
+
+/* True if grid is a completion of the puzzle. */
+static bool test_completes(const struct test_puzzle *pz, const digit *grid)
+{
+    int o = pz->o, i, j;
+
+    for (i = 0; i < o*o; i++)
+        if (grid[i] > pz->depth ||
+            (pz->grid[i] && grid[i] != pz->grid[i]) ||
+            (pz->force[i] && !grid[i]) || (pz->forbid[i] && grid[i]))
+            return false;
+    for (i = 0; i < o; i++) {
+        unsigned row = 0, col = 0;
+        for (j = 0; j < o; j++) {
+            if (grid[i*o+j])
+                row |= 1U << grid[i*o+j];
+            if (grid[j*o+i])
+                col |= 1U << grid[j*o+i];
+        }
+        if (row != (2U << pz->depth) - 2 || col != (2U << pz->depth) - 2)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Make a random puzzle from a solution: each cell gets its number
+ * with probability pclue percent, or else (under SEMI_LATIN) a mark
+ * saying whether it is filled with probability pmark percent.
+ */
+static void test_make(struct test_puzzle *pz, int o, int depth,
+                      const digit *soln, int pclue, int pmark,
+                      random_state *rs)
+{
+    int i;
+
+    pz->o = o;
+    pz->depth = depth;
+    pz->grid = snewn(o*o, digit);
+    pz->force = snewn(o*o, bool);
+    pz->forbid = snewn(o*o, bool);
+    for (i = 0; i < o*o; i++) {
+        int r = random_upto(rs, 100);
+        pz->grid[i] = (r < pclue ? soln[i] : 0);
+        pz->force[i] = pz->forbid[i] = false;
+#ifdef SEMI_LATIN
+        if (!pz->grid[i] && r < pclue + pmark) {
+            pz->force[i] = (soln[i] != 0);
+            pz->forbid[i] = (soln[i] == 0);
+        }
+#endif
+    }
+}
+
+static void test_free(struct test_puzzle *pz)
+{
+    sfree(pz->grid);
+    sfree(pz->force);
+    sfree(pz->forbid);
+}
+
+/* A random order 2..TEST_MAX_ORDER, and depth to go with it. */
+static void test_kind(random_state *rs, int *o, int *depth)
+{
+    *o = 2 + random_upto(rs, TEST_MAX_ORDER-1);
+#ifdef SEMI_LATIN
+    *depth = 1 + random_upto(rs, *o);
+#else
+    *depth = *o;
+#endif
+}
+
+/*
+ * A random puzzle. About one in five has a clue changed, and is
+ * likely to be impossible. Returns its solution, or NULL for such a
+ * puzzle.
+ */
+static digit *test_random(struct test_puzzle *pz, int o, int depth,
+                          random_state *rs)
+{
+    digit *soln = latin_generate_partial(o, depth, rs);
+    int i, j, n;
+
+    test_make(pz, o, depth, soln, random_upto(rs, 70), random_upto(rs, 50),
+              rs);
+    if (random_upto(rs, 5) == 0) {
+        i = random_upto(rs, o*o);
+        n = 1 + random_upto(rs, depth);
+        if (n == soln[i])
+            return soln;
+        /* The solver expects clues not to repeat in a row or column. */
+        for (j = 0; j < o; j++)
+            if (pz->grid[(i/o)*o + j] == n || pz->grid[j*o + i%o] == n)
+                return soln;
+        pz->grid[i] = n;
+        pz->force[i] = pz->forbid[i] = false;
+        sfree(soln);
+        return NULL;
+    }
+    return soln;
+}
+
+/*
+ * Allocate a solver for a puzzle, on a copy of its grid which
+ * test_solver_free frees. The marks are only read.
+ */
+static void test_solver_alloc(struct latin_solver *solver,
+                              const struct test_puzzle *pz)
+{
+    digit *grid = snewn(pz->o * pz->o, digit);
+
+    memcpy(grid, pz->grid, pz->o * pz->o);
+    latin_solver_alloc(solver, grid, pz->o
+#ifdef SEMI_LATIN
+                       , pz->depth, pz->force, pz->forbid
+#endif
+                       );
+}
+
+static void test_solver_free(struct latin_solver *solver)
+{
+    digit *grid = solver->grid;
+
+    latin_solver_free(solver);
+    sfree(grid);
+}
+
+/* Solve a puzzle (with tt, which may be NULL), leaving the grid in out. */
+static int test_solve(const struct test_puzzle *pz, int maxdiff,
+                      struct latin_solver_tt *tt, digit *out)
+{
+    struct latin_solver solver;
+    int ret;
+
+    test_solver_alloc(&solver, pz);
+    latin_solver_set_tt(&solver, tt);
+    ret = latin_solver_main(&solver, maxdiff, TEST_SIMPLE, TEST_SET_0,
+                            TEST_SET_1, TEST_FORCING, TEST_RECURSIVE,
+                            test_usersolvers, NULL, NULL, NULL);
+    memcpy(out, solver.grid, pz->o * pz->o);
+    test_solver_free(&solver);
+    return ret;
+}
+
+static int test_fail(const char *test, const struct test_puzzle *pz,
+                     const char *what)
+{
+    printf("%s: order %d depth %d: %s\n", test, pz->o, pz->depth, what);
+#ifdef SEMI_LATIN
+    latin_solver_debug_force_forbid(stdout, pz->o, pz->depth,
+                                    pz->force, pz->forbid);
+#endif
+    latin_debug(pz->grid, pz->o);
+    return 1;
+}
+
+static int test_generate(random_state *rs)
+{
+    int fails = 0, o, depth;
+
+    for (o = 1; o <= 12; o++)
+        for (depth = 1; depth <= o; depth++) {
+            struct test_puzzle pz;
+            digit *sq = latin_generate_partial(o, depth, rs);
+
+            /* The square, as its own only clues, must complete itself. */
+            test_make(&pz, o, depth, sq, 100, 0, rs);
+            if (!test_completes(&pz, sq))
+                fails += test_fail("generate_partial", &pz,
+                                   "not a partial latin square");
+            test_free(&pz);
+            sfree(sq);
+        }
+    return fails;
+}
+
+static int test_check(random_state *rs)
+{
+    static const int orders[] = { 1, 2, 5, 9, 62, 63, 70 };
+    int fails = 0, t, i, k;
+
+    for (t = 0; t < lenof(orders); t++) {
+        int order = orders[t], a = order * order, n = 10;
+        digit *sqs = snewn(n * a, digit);
+
+        for (i = 0; i < n; i++) {
+            digit *sq = latin_generate(order, rs);
+            memcpy(sqs + i*a, sq, a);
+            sfree(sq);
+        }
+        if (latin_check_batch(sqs, order, n) != -1) {
+            printf("check_batch: order %d: rejected latin squares\n", order);
+            fails++;
+        }
+        if (order < 2)
+            goto next;
+
+        /*
+         * Swapping two cells of a row leaves the row a permutation,
+         * but not the columns. Spoil square k and then square 2, and
+         * the first spoilt one should be found.
+         */
+        k = 3 + random_upto(rs, n-3);
+        for (i = 0; i < 2; i++) {
+            digit *sq = sqs + (i ? 2 : k) * a, tmp;
+            int y = random_upto(rs, order), x1 = random_upto(rs, order);
+            int x2 = (x1 + 1 + random_upto(rs, order-1)) % order;
+            tmp = sq[y*order+x1];
+            sq[y*order+x1] = sq[y*order+x2];
+            sq[y*order+x2] = tmp;
+            if (!latin_check(sq, order)) {
+                printf("check: order %d: accepted a spoilt square\n", order);
+                fails++;
+            }
+            if (latin_check_batch(sqs, order, n) != (i ? 2 : k)) {
+                printf("check_batch: order %d: missed square %d\n", order,
+                       i ? 2 : k);
+                fails++;
+            }
+        }
+      next:
+        sfree(sqs);
+    }
+    return fails;
+}
+
+static int test_count(random_state *rs)
+{
+    int fails = 0, t;
+
+    for (t = 0; t < 300; t++) {
+        struct test_puzzle pz;
+        digit *soln, *first;
+        unsigned long long want, got;
+        int o, depth;
+
+        test_kind(rs, &o, &depth);
+        soln = test_random(&pz, o, depth, rs);
+        first = snewn(o*o, digit);
+        want = test_brute(&pz, first);
+
+        if (want < TEST_BRUTE_LIMIT &&
+            latin_count(pz.grid, pz.o
+#ifdef SEMI_LATIN
+                        , pz.depth, pz.force, pz.forbid
+#endif
+                        , 1, &got) && got != want) {
+            char buf[80];
+            sprintf(buf, "counted %llu, not %llu", got, want);
+            fails += test_fail("count", &pz, buf);
+        }
+        sfree(first);
+        sfree(soln);
+        test_free(&pz);
+    }
+    return fails;
+}
+
+/*
+ * The full solver, latin_solver_unique, and the solver with a
+ * transposition table, against brute force. The tables are shared by
+ * all the puzzles of a kind, and small, so that states are found from
+ * earlier puzzles and also replaced.
+ */
+static int test_solver(random_state *rs)
+{
+    struct latin_solver_tt *tts[TEST_MAX_ORDER+1][TEST_MAX_ORDER+1];
+    int fails = 0, t, o, d;
+
+    for (o = 0; o <= TEST_MAX_ORDER; o++)
+        for (d = 0; d <= TEST_MAX_ORDER; d++)
+            tts[o][d] = NULL;
+
+    for (t = 0; t < 1000; t++) {
+        struct test_puzzle pz;
+        digit *soln, *first, *out;
+        unsigned long long count;
+        struct latin_solver_tt **tt;
+        int a, ret, i;
+
+        test_kind(rs, &o, &d);
+        soln = test_random(&pz, o, d, rs);
+        a = o*o;
+        first = snewn(a, digit);
+        out = snewn(a, digit);
+        count = test_brute(&pz, first);
+        tt = &tts[o][d];
+
+        ret = test_solve(&pz, TEST_RECURSIVE, NULL, out);
+        if (count == 0 ? ret != diff_impossible :
+            count > 1 ? ret != diff_ambiguous :
+            ret >= diff_impossible || memcmp(out, first, a))
+            fails += test_fail("solver", &pz, count == 0 ? "impossible" :
+                               count > 1 ? "ambiguous" : "unique");
+
+        if (!*tt)
+            *tt = latin_solver_tt_new(pz.o, 4096, LATIN_TT_REPLACE_WORK);
+        for (i = 0; i < 2; i++) {
+            digit *out2 = snewn(a, digit);
+            if (test_solve(&pz, TEST_RECURSIVE, *tt, out2) != ret ||
+                (ret < diff_impossible && memcmp(out, out2, a)))
+                fails += test_fail("solver with table", &pz,
+                                   i ? "differs when repeated" :
+                                   "differs from without");
+            sfree(out2);
+        }
+
+        if (soln) {
+            struct latin_solver solver;
+            test_solver_alloc(&solver, &pz);
+            if (t % 2)
+                latin_solver_set_tt(&solver, *tt);
+            ret = latin_solver_unique(&solver, soln, TEST_SIMPLE, TEST_SET_0,
+                                      TEST_SET_1, TEST_FORCING,
+                                      TEST_RECURSIVE, test_usersolvers,
+                                      NULL, NULL, NULL);
+            if (ret != (count == 1) ||
+                (ret == 0 && (!test_completes(&pz, solver.grid) ||
+                              !memcmp(solver.grid, soln, a))))
+                fails += test_fail("solver_unique", &pz,
+                                   count == 1 ? "unique" : "ambiguous");
+            test_solver_free(&solver);
+        }
+
+        sfree(first);
+        sfree(out);
+        sfree(soln);
+        test_free(&pz);
+    }
+
+    for (o = 0; o <= TEST_MAX_ORDER; o++)
+        for (d = 0; d <= TEST_MAX_ORDER; d++)
+            latin_solver_tt_free(tts[o][d]);
+    return fails;
+}
+
+/*
+ * latin_solver_batch against latin_solver_main, on batches of more
+ * than one word of lanes, stopping at each tier. Where a puzzle is
+ * impossible, how much of it was filled in before that was found
+ * depends on the order of the deductions, so only the result counts.
+ */
+static int test_batch(random_state *rs)
+{
+    int fails = 0, t, i, n = 150;
+
+    for (t = 0; t < 10; t++) {
+        int o, depth, a, maxdiff = t % (TEST_RECURSIVE+1);
+        struct test_puzzle *pzs = snewn(n, struct test_puzzle);
+        digit *grids, *out;
+        bool *force, *forbid;
+        int *results = snewn(n, int);
+
+        test_kind(rs, &o, &depth);
+        a = o*o;
+        grids = snewn(n * a, digit);
+        out = snewn(a, digit);
+        force = snewn(n * a, bool);
+        forbid = snewn(n * a, bool);
+        for (i = 0; i < n; i++) {
+            digit *soln = test_random(&pzs[i], o, depth, rs);
+            memcpy(grids + i*a, pzs[i].grid, a);
+            memcpy(force + i*a, pzs[i].force, a * sizeof(bool));
+            memcpy(forbid + i*a, pzs[i].forbid, a * sizeof(bool));
+            sfree(soln);
+        }
+        latin_solver_batch(n, grids, o
+#ifdef SEMI_LATIN
+                           , depth, force, forbid
+#endif
+                           , results, NULL, maxdiff, TEST_SIMPLE, TEST_SET_0,
+                           TEST_SET_1, TEST_FORCING, TEST_RECURSIVE,
+                           test_usersolvers, NULL, NULL, NULL);
+        for (i = 0; i < n; i++)
+            if (test_solve(&pzs[i], maxdiff, NULL, out) != results[i] ||
+                (results[i] != diff_impossible && memcmp(out, grids + i*a, a)))
+                fails += test_fail("solver_batch", &pzs[i],
+                                   "differs from one at a time");
+
+        for (i = 0; i < n; i++)
+            test_free(&pzs[i]);
+        sfree(pzs);
+        sfree(grids);
+        sfree(out);
+        sfree(force);
+        sfree(forbid);
+        sfree(results);
+    }
+    return fails;
+}
+
+static int selftest(random_state *rs)
+{
+    static const struct {
+        const char *name;
+        int (*fn)(random_state *rs);
+    } tests[] = {
+        { "generate_partial", test_generate },
+        { "check_batch", test_check },
+        { "count", test_count },
+        { "solver", test_solver },
+        { "solver_batch", test_batch },
+    };
+    int i, fails, total = 0;
+
+    for (i = 0; i < lenof(tests); i++) {
+        fails = tests[i].fn(rs);
+        printf("%-20s %s\n", tests[i].name, fails ? "FAILED" : "ok");
+        total += fails;
+    }
+    return total;
+}
+
 void usage_exit(const char *msg)
 {
     if (msg)
         fprintf(stderr, "%s: %s\n", quis, msg);
-    fprintf(stderr, "Usage: %s [--seed SEED] --soak <params> | [game_id [game_id ...]]\n", quis);
+    fprintf(stderr, "Usage: %s [--seed SEED] --soak <params> | --selftest | [game_id [game_id ...]]\n", quis);
     exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-    int i, soak = 0;
+    int i, soak = 0, self = 0;
     random_state *rs;
     time_t seed = time(NULL);
 
@@ -1840,6 +4693,8 @@ int main(int argc, char *argv[])
 	const char *p = *++argv;
 	if (!strcmp(p, "--soak"))
 	    soak = 1;
+	else if (!strcmp(p, "--selftest"))
+	    self = 1;
 	else if (!strcmp(p, "--seed")) {
 	    if (argc == 0)
 		usage_exit("--seed needs an argument");
@@ -1853,18 +4708,23 @@ int main(int argc, char *argv[])
 
     rs = random_new((void*)&seed, sizeof(time_t));
 
-    if (soak == 1) {
+    if (self) {
+	printf("seed %ld\n", (long)seed);
+	i = selftest(rs);
+	random_free(rs);
+	return i ? 1 : 0;
+    } else if (soak == 1) {
 	if (argc != 1) usage_exit("only one argument for --soak");
 	test_soak(atoi(*argv), rs);
     } else {
 	if (argc > 0) {
 	    for (i = 0; i < argc; i++) {
-		gen(atoi(*argv++), rs, 1);
+		gen(atoi(*argv++), rs);
 	    }
 	} else {
 	    while (1) {
 		i = random_upto(rs, 20) + 1;
-		gen(i, rs, 0);
+		gen(i, rs);
 	    }
 	}
     }
@@ -7,10 +7,244 @@ typedef unsigned char digit;
 
 /* --- Solver structures, definitions --- */
 
-#ifdef STANDALONE_SOLVER
-extern int solver_show_working, solver_recurse_depth;
+/* Individual puzzles should use their enumerations for their
+ * own difficulty levels, ensuring they don't clash with these. */
+enum { diff_impossible = 10, diff_ambiguous, diff_unfinished,
+       diff_exhausted };  /* gave up on reaching a latin_solver_budget */
+
+/* Deduction techniques, as far as statistics are concerned. */
+enum {
+    LATIN_TECH_POSITIONAL,      /* positional elimination in a row/column */
+    LATIN_TECH_NUMERIC,         /* numeric elimination in a single cell */
+    LATIN_TECH_SET,             /* set elimination in a row/column */
+    LATIN_TECH_POSITIONAL_SET,  /* row-vs-column set elimination on a number */
+    LATIN_TECH_FORCING,         /* forcing chains */
+    LATIN_TECH_FORBID,          /* blank cells deduction (SEMI_LATIN) */
+    LATIN_TECH_FORCE,           /* required cells deduction (SEMI_LATIN) */
+    LATIN_TECH_USER,            /* the puzzle's own usersolvers */
+    LATIN_NTECH
+};
+
+const char *latin_technique_name(int tech);
+
+/*
+ * Optional statistics about a solver run. Zero one of these and point
+ * latin_solver.stats at it before calling latin_solver_main; it keeps
+ * accumulating across calls until you zero it again.
+ *
+ * For the blank and required cells deductions, 'placements' counts the
+ * cells marked blank or required rather than digits placed.
+ */
+struct latin_solver_stats {
+    long steps[LATIN_NTECH];        /* deductions that made progress */
+    long placements[LATIN_NTECH];   /* digits placed */
+    long eliminations[LATIN_NTECH]; /* candidates ruled out */
+    long nodes;                     /* guesses made by the recursive tier */
+    long tthits;                    /* subtrees the transposition table
+                                     * answered without searching */
+    int maxdepth;                   /* deepest level of recursion reached */
+    long rescans;                   /* passes over the grid in latin_solver_top */
+    /* Seconds spent in each tier, indexed by difficulty. The recursive
+     * tier's time is only counted at the outermost level, and
+     * includes the deduction tiers run inside it. */
+    double tiertime[diff_impossible];
+    /* Times latin_solver_top turned to each tier (beyond the simplest)
+     * because every easier one was stuck, and the total number of
+     * candidates left in undecided cells at those times. */
+    long stalls[diff_impossible];
+    long frontier[diff_impossible];
+    /* The simple tier's steps, each weighted by o over the number of
+     * simple deductions there were to choose from when it was made:
+     * scarce deductions are harder to spot. */
+    double scarcity;
+};
+
+/*
+ * Optional limits on how much work the recursive tier may do. Point
+ * latin_solver.budget at one of these before calling
+ * latin_solver_main, which starts the clock and clears the counters;
+ * a limit of zero means no limit. Once either limit is reached the
+ * solver abandons its search and returns diff_exhausted, since it
+ * cannot say how many solutions there are.
+ */
+struct latin_solver_budget {
+    long maxnodes;          /* guesses the recursive tier may make */
+    double maxtime;         /* seconds of wall-clock time */
+
+    /* Filled in by the solver. */
+    long nodes;             /* guesses made so far */
+    double deadline;        /* absolute time at which maxtime runs out */
+    bool exhausted;         /* a limit has been reached */
+};
+
+/*
+ * Optional control over how the recursive tier guesses. By default it
+ * guesses at the first cell with the fewest options, in scan order,
+ * and tries its digits in ascending order. Set up one of these with
+ * latin_solver_search_init and point latin_solver.search at it to
+ * choose instead:
+ *
+ *  - LATIN_BRANCH_DEGREE: among the cells with the fewest options,
+ *    the one whose row and column have the most undecided cells.
+ *  - LATIN_BRANCH_DOMWDEG: the cell with the fewest options relative
+ *    to the weight of its row, column and cell, each weight being one
+ *    more than the number of contradictions found there so far (ties
+ *    broken as for LATIN_BRANCH_DEGREE). The weights are kept from
+ *    one solver run to the next until latin_solver_search_free.
+ *
+ * Given a random_state, the digits of each guess are tried in random
+ * order; and if restart_unit is non-zero, the search starts again
+ * from the top (with what it has learned) after restart_unit times
+ * successive terms of the Luby sequence 1,1,2,1,1,2,4,... guesses,
+ * which cuts off the long runs that an unlucky early guess can cause.
+ * Any run that finishes gives the full answer, so the results are
+ * the same whatever the strategy; only the work differs.
+ */
+enum {
+    LATIN_BRANCH_FIRST,
+    LATIN_BRANCH_DEGREE,
+    LATIN_BRANCH_DOMWDEG,
+    LATIN_NBRANCH
+};
+struct latin_solver_search {
+    int o;
+    int branch;             /* LATIN_BRANCH_* */
+    random_state *rs;       /* NULL, or shuffles the digits of each guess */
+    long restart_unit;      /* guesses in the shortest run, or 0 */
+
+    /* Filled in by the solver. */
+    unsigned long *weights; /* o rows, o columns, o*o cells; DOMWDEG only */
+    long restarts;          /* runs abandoned so far */
+    long nodes, limit;      /* guesses in this run, and where it is cut off */
+    bool cut;               /* the run has reached its limit */
+};
+void latin_solver_search_init(struct latin_solver_search *search, int o,
+                              int branch, random_state *rs,
+                              long restart_unit);
+void latin_solver_search_free(struct latin_solver_search *search);
+const char *latin_branch_name(int branch);
+
+/*
+ * Optional transposition table for the recursive tier. Different
+ * orders of guessing often lead to the same candidate cube, and the
+ * number of ways to finish a grid depends only on its cube (and, under
+ * SEMI_LATIN, on which cells are known to be filled or blank). With a
+ * table attached by latin_solver_set_tt, the solver keeps a Zobrist
+ * hash of that state as it goes, and remembers which states it has
+ * found to have no solution or exactly one, so that reaching one again
+ * costs nothing. A table belongs to one kind of square (order, and
+ * depth under SEMI_LATIN), but may be shared by any number of solver
+ * runs on different puzzles of that kind.
+ *
+ * maxbytes caps the table's memory, solutions included. When two
+ * states want the same slot, the policy decides which is kept.
+ */
+enum {
+    LATIN_TT_REPLACE_ALWAYS,    /* the newer state */
+    LATIN_TT_REPLACE_WORK       /* the one whose search took more guesses */
+};
+struct latin_solver_tt; /* private to latin.c */
+struct latin_solver_tt *latin_solver_tt_new(int o, size_t maxbytes,
+                                            int policy);
+void latin_solver_tt_free(struct latin_solver_tt *tt);
+
+/* --- Solver tracing --- */
+
+/*
+ * A solver can report every deduction it makes to a trace sink, as a
+ * stream of typed records. With no sink attached nothing is built or
+ * formatted, and the only cost is a NULL check.
+ */
+enum {
+    LATIN_EV_PASS,          /* latin_solver_top is starting a pass */
+    LATIN_EV_DEDUCE,        /* a deduction by 'tech' in 'unit' follows */
+    LATIN_EV_PLACE,         /* n placed at (x,y) */
+    LATIN_EV_RULE_OUT,      /* n ruled out at (x,y) */
+    LATIN_EV_FORBID,        /* (x,y) must be blank */
+    LATIN_EV_FORCE,         /* (x,y) must hold a number */
+    LATIN_EV_CONTRADICTION, /* 'tech' has found the grid impossible */
+    LATIN_EV_RECURSE,       /* about to guess at (x,y) between 'list' */
+    LATIN_EV_GUESS,         /* trying n at (x,y); 0 is blank (SEMI_LATIN) */
+    LATIN_EV_RETRACT,       /* finished trying n at (x,y) */
+    LATIN_EV_RESULT,        /* latin_solver_top returning n */
+    LATIN_NEV
+};
+
+/* The part of the grid a deduction looked at. */
+enum {
+    LATIN_UNIT_NONE,
+    LATIN_UNIT_ROW,         /* idx is y */
+    LATIN_UNIT_COL,         /* idx is x */
+    LATIN_UNIT_CELL,        /* idx is y*o+x; x and y are also filled in */
+    LATIN_UNIT_NUMBER       /* idx is the number itself */
+};
+
+struct latin_solver_event {
+    int type;               /* LATIN_EV_* */
+    int tech;               /* LATIN_TECH_*, or -1 outside deductions */
+    int unit, idx;          /* LATIN_UNIT_* and which one */
+    int x, y, n;            /* cell and number, where they apply */
+    int level;              /* recursion depth of the reporting solver */
+    const int *list;        /* forcing chain (cells y*o+x, from the far
+                             * end) or the numbers for LATIN_EV_RECURSE */
+    int nlist;
+    int o;                  /* order of the square */
+    const digit *grid;      /* LATIN_EV_RESULT only: the o*o grid */
+    const struct latin_solver *solver; /* NULL in decoded events */
+};
+
+typedef void (*latin_trace_fn)(void *ctx, const struct latin_solver_event *ev);
+
+/*
+ * Pass an event to the solver's trace sink, for usersolvers to report
+ * their own deductions (as LATIN_TECH_USER). Callers check
+ * solver->trace first, so that nothing at all is done without a sink.
+ */
+void latin_solver_report(struct latin_solver *solver, int type,
+                         int tech, int unit, int idx,
+                         int x, int y, int n,
+                         const int *list, int nlist);
+
+/*
+ * Sink which appends a compact binary encoding of each event to a
+ * growable buffer, and the matching decoder. latin_trace_read returns
+ * false at the end of the data or if it is corrupt; pointers in the
+ * decoded event stay valid until the next call.
+ */
+struct latin_trace_buffer {
+    unsigned char *data;
+    int len, size;
+    int *list, listsize;    /* decoding scratch space */
+    digit *grid;
+    int gridsize;
+};
+void latin_trace_buffer_init(struct latin_trace_buffer *buf);
+void latin_trace_buffer_free(struct latin_trace_buffer *buf);
+void latin_trace_write(void *buf, const struct latin_solver_event *ev);
+bool latin_trace_read(struct latin_trace_buffer *buf, int *pos,
+                      struct latin_solver_event *ev);
+
+/*
+ * Sink which pretty-prints events as the standalone solvers' working.
+ * verbose > 1 also dumps the candidate cube at every pass, for live
+ * events only.
+ */
+struct latin_trace_printer {
+    FILE *fp;
+    int verbose;
+    int pending;            /* private to latin.c */
+};
+void latin_trace_print(void *printer, const struct latin_solver_event *ev);
+
+#ifdef SEMI_LATIN
+/* Set of cells in one row or column, bit i for the i-th cell along it.
+ * This limits partial latin squares to orders of at most 32. */
+typedef unsigned long latin_mask;
+#define LATIN_MAX_SEMI_ORDER 32
 #endif
 
+struct latin_solver_arena; /* private to latin.c */
+
 struct latin_solver {
   int o;                /* order of latin square */
 #ifdef SEMI_LATIN
@@ -26,11 +260,25 @@ struct latin_solver {
 #ifdef SEMI_LATIN
   bool *force;			/* o^2: force[y*cr+x] true if cell must contain a value */
   bool *forbid;			/* o^2: forbid[y*cr+x] true if cell must be blank */
-#endif
 
-#ifdef STANDALONE_SOLVER
-  char **names;         /* o: names[n-1] gives name of 'digit' n */
+  /* Kept in step with force and forbid by the mark functions below. */
+  latin_mask *rowforce, *rowforbid;	/* o: bit x set in [y] if (x,y) is */
+  latin_mask *colforce, *colforbid;	/* o: bit y set in [x] if (x,y) is */
+  unsigned char *ncand;	/* o^2: ncand[y*cr+x] candidates left in cell */
 #endif
+
+  struct latin_solver_stats *stats; /* NULL unless the caller wants them */
+  latin_trace_fn trace; /* NULL, or sink for deduction events */
+  void *tracectx;       /* passed to trace */
+  int recurse_depth;    /* number of guesses this solver is nested in */
+  struct latin_solver_budget *budget; /* NULL, or limits on recursion */
+  struct latin_solver_search *search; /* NULL, or how to guess */
+  int *progress;        /* NULL, or see latin_solver_grade */
+  struct latin_solver_tt *tt; /* NULL, or set by latin_solver_set_tt */
+  unsigned long long zobrist; /* hash of the state, if tt is set */
+  struct latin_solver_arena *arena; /* where the arrays above come from */
+  bool ownarena;        /* false for a guess's sub-solver, which borrows
+                         * its parent's */
 };
 #define cubepos(x,y,n) (((x)*solver->o+(y))*solver->o+(n)-1)
 #define cube(x,y,n) (solver->cube[cubepos(x,y,n)])
@@ -49,22 +297,30 @@ int latin_solver_distribute_force_forbid(struct latin_solver *solver);
 /* Place a value at a specific location. */
 void latin_solver_place(struct latin_solver *solver, int x, int y, int n);
 
-/* Positional elimination. */
-int latin_solver_elim(struct latin_solver *solver, int start, int step
-#ifdef STANDALONE_SOLVER
-                      , const char *fmt, ...
+/* Rule out n at (x,y). All eliminations should go through this, rather
+ * than writing to the cube, so that the per-cell counts stay right; under
+ * SEMI_LATIN, a cell left with no candidates which need not hold a value
+ * is marked blank there and then. Does nothing if n was already out. */
+void latin_solver_rule_out(struct latin_solver *solver, int x, int y, int n);
+
+#ifdef SEMI_LATIN
+/* Record that (x,y) must hold a value, or must be blank. Marking a cell
+ * blank also rules out its remaining candidates, and returns how many
+ * there were. Marking a cell both ways is an error. */
+void latin_solver_mark_force(struct latin_solver *solver, int x, int y);
+int latin_solver_mark_forbid(struct latin_solver *solver, int x, int y);
 #endif
-                      );
+
+/* Positional elimination. unit and idx (LATIN_UNIT_*) say which row,
+ * column or cell is being examined, for tracing. */
+int latin_solver_elim(struct latin_solver *solver, int start, int step,
+                      int unit, int idx);
 
 struct latin_solver_scratch; /* private to latin.c */
 /* Set elimination */
 int latin_solver_set(struct latin_solver *solver,
                      struct latin_solver_scratch *scratch,
-                     int start, int step1, int step2
-#ifdef STANDALONE_SOLVER
-                     , const char *fmt, ...
-#endif
-                     );
+                     int start, int step1, int step2, int unit, int idx);
 
 /* Forcing chains */
 int latin_solver_forcing(struct latin_solver *solver,
@@ -76,7 +332,9 @@ int latin_solver_forcing(struct latin_solver *solver,
 /* Fills in (and allocates members for) a latin_solver struct.
  * Will allocate members of snew, but not snew itself
  * (allowing 'struct latin_solver' to be the first element in a larger
- * struct, for example). */
+ * struct, for example). The members, and all the memory the solver
+ * goes on to use in solving, come from an arena private to it, freed
+ * by latin_solver_free; searching allocates nothing per guess. */
 void latin_solver_alloc(struct latin_solver *solver, digit *grid, int o
 #ifdef SEMI_LATIN
 						, int depth, bool *force, bool *forbid
@@ -84,7 +342,14 @@ void latin_solver_alloc(struct latin_solver *solver, digit *grid, int o
 						);
 void latin_solver_free(struct latin_solver *solver);
 
-/* Allocates scratch space (for _set and _forcing) */
+/* Attach a transposition table (or NULL) to a solver after
+ * latin_solver_alloc; the table's order must match. Guesses below this
+ * solver use it too. */
+void latin_solver_set_tt(struct latin_solver *solver,
+                         struct latin_solver_tt *tt);
+
+/* Allocates scratch space (for _set and _forcing) from the solver's
+ * arena; free it before anything allocated from the solver after it. */
 struct latin_solver_scratch *
   latin_solver_new_scratch(struct latin_solver *solver);
 void latin_solver_free_scratch(struct latin_solver_scratch *scratch);
@@ -105,10 +370,6 @@ typedef int (*usersolver_t)(struct latin_solver *solver, void *ctx);
 typedef void *(*ctxnew_t)(void *ctx);
 typedef void (*ctxfree_t)(void *ctx);
 
-/* Individual puzzles should use their enumerations for their
- * own difficulty levels, ensuring they don't clash with these. */
-enum { diff_impossible = 10, diff_ambiguous, diff_unfinished };
-
 /* Externally callable function that allocates and frees a latin_solver */
 int latin_solver(digit *grid, int o
 #ifdef SEMI_LATIN
@@ -119,6 +380,28 @@ int latin_solver(digit *grid, int o
 		 usersolver_t const *usersolvers, void *ctx,
 		 ctxnew_t ctxnew, ctxfree_t ctxfree);
 
+/*
+ * Solve count puzzles at once: grids holds count grids of o*o, one
+ * after another (and, under SEMI_LATIN, force and forbid their marks
+ * likewise), and each is solved in place as latin_solver would, with
+ * the result in results[i] (though an impossible puzzle's grid may be
+ * left filled in to a different point). The simple tier runs on many
+ * puzzles together, one bit of a machine word per puzzle, and only
+ * those it leaves stuck go on one at a time, with budget (which may be
+ * NULL) restarted for each; so this pays off on a batch which is
+ * mostly easy, as when screening candidate puzzles. A usersolver at
+ * diff_simple has every puzzle solved one at a time.
+ */
+void latin_solver_batch(int count, digit *grids, int o
+#ifdef SEMI_LATIN
+                        , int depth, const bool *force, const bool *forbid
+#endif
+                        , int *results, struct latin_solver_budget *budget,
+                        int maxdiff, int diff_simple, int diff_set_0,
+                        int diff_set_1, int diff_forcing, int diff_recursive,
+                        usersolver_t const *usersolvers, void *ctx,
+                        ctxnew_t ctxnew, ctxfree_t ctxfree);
+
 /* Version you can call if you want to alloc and free latin_solver yourself */
 int latin_solver_main(struct latin_solver *solver, int maxdiff,
 		      int diff_simple, int diff_set_0, int diff_set_1,
@@ -126,10 +409,55 @@ int latin_solver_main(struct latin_solver *solver, int maxdiff,
 		      usersolver_t const *usersolvers, void *ctx,
 		      ctxnew_t ctxnew, ctxfree_t ctxfree);
 
+/*
+ * Grade a puzzle in a single run. The solver always falls back on the
+ * easiest tier that still makes progress, so a run allowed up to
+ * maxdiff only ever goes beyond a tier when that tier is stuck, and
+ * the hardest tier it uses is the easiest at which the puzzle can be
+ * solved; there is no need to try each difficulty in turn. Returns as
+ * latin_solver_main does. progress, if not NULL, has room for
+ * diff_recursive+1 entries, and gets for each tier the number of cells
+ * decided (filled, or known to be blank) when the solver first turned
+ * to it, or -1 if it never did.
+ *
+ * score, if not NULL, gets a finer measure of difficulty than the
+ * tier, for ordering puzzles of the same grade: the effort of the run,
+ * from the deductions made by each technique (weighted by how hard
+ * the technique is, or for the simple tier by how few other simple
+ * deductions there were to find), each time the easier tiers were
+ * stuck (weighted
+ * by how far the solver had to escalate, and by how many candidates
+ * were still open), and each guess. It is zero only for a grid with
+ * nothing left to deduce, and larger means harder. Its run's
+ * statistics are still added to solver->stats, if that is set.
+ */
+int latin_solver_grade(struct latin_solver *solver, int maxdiff,
+                       int *progress, double *score,
+                       int diff_simple, int diff_set_0, int diff_set_1,
+                       int diff_forcing, int diff_recursive,
+                       usersolver_t const *usersolvers, void *ctx,
+                       ctxnew_t ctxnew, ctxfree_t ctxfree);
+
+/*
+ * Uniqueness check for a puzzle whose solution is already known (with
+ * 0 for blank cells under SEMI_LATIN): searches for a different
+ * solution, using every deduction short of recursion at each guess,
+ * and stops at the first one found. Returns 1 if soln is the only
+ * solution, 0 if there is another (left in the grid), or -1 if the
+ * solver's budget ran out first. Cheaper than asking latin_solver_main
+ * to count solutions at diff_recursive.
+ */
+int latin_solver_unique(struct latin_solver *solver, const digit *soln,
+                        int diff_simple, int diff_set_0, int diff_set_1,
+                        int diff_forcing, int diff_recursive,
+                        usersolver_t const *usersolvers, void *ctx,
+                        ctxnew_t ctxnew, ctxfree_t ctxfree);
+
 #ifdef SEMI_LATIN
-void latin_solver_debug_force_forbid(int o, int depth, bool *force, bool *forbid);
+void latin_solver_debug_force_forbid(FILE *fp, int o, int depth,
+                                     bool *force, bool *forbid);
 #endif
-void latin_solver_debug(unsigned char *cube, int o
+void latin_solver_debug(FILE *fp, unsigned char *cube, int o
 #ifdef SEMI_LATIN
 						  , int depth
 #endif
@@ -142,8 +470,36 @@ digit *latin_generate(int o, random_state *rs);
 /* The order of the latin rectangle is max(w,h). */
 digit *latin_generate_rect(int w, int h, random_state *rs);
 
-bool latin_check(digit *sq, int order); /* true => not a latin square */
+/* An o x o grid in which every row and column holds each of 1..depth
+ * exactly once, the other cells being 0. */
+digit *latin_generate_partial(int o, int depth, random_state *rs);
+
+/* true => not a latin square: some row or column isn't a permutation
+ * of 1..order. Allocates nothing. */
+bool latin_check(const digit *sq, int order);
+
+/* Checks n squares stored one after another, returning the index of the
+ * first which is not a latin square, or -1 if they all are. */
+int latin_check_batch(const digit *sqs, int order, int n);
 
 void latin_debug(digit *sq, int order);
 
+/* --- Counting --- */
+
+/*
+ * Count the ways to complete a partial square (0 for an empty cell;
+ * under SEMI_LATIN, force and forbid say which empty cells must be
+ * filled or left blank), by dynamic programming over rows. This is
+ * exact however few clues there are, unlike counting by recursion.
+ * Counts too big for 64 bits come out as ULLONG_MAX. Returns false,
+ * with *count untouched, if the square is beyond it: more than 64
+ * (number, column) pairs, or too many column states. Built with
+ * LATIN_THREADS, the work of each row is shared among nthreads.
+ */
+bool latin_count(const digit *grid, int o
+#ifdef SEMI_LATIN
+                 , int depth, const bool *force, const bool *forbid
+#endif
+                 , int nthreads, unsigned long long *count);
+
 #endif
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 
@@ -27,14 +28,15 @@
  * Difficulty levels (same as towers.c).
  */
 #define DIFFLIST(A) \
-    A(EASY,Easy,solver_easy,e) \
-    A(HARD,Hard,solver_hard,h) \
-    A(EXTREME,Extreme,NULL,x) \
+    A(EASY,Easy,NULL,e) \
+    A(HARD,Hard,NULL,h) \
+    A(EXTREME,Extreme,solver_cardinality,x) \
     A(UNREASONABLE,Unreasonable,NULL,u)
 #define ENUM(upper,title,func,lower) DIFF_ ## upper,
 #define TITLE(upper,title,func,lower) #title,
 #define ENCODE(upper,title,func,lower) #lower
 #define CONFIG(upper,title,func,lower) ":" #title
+#define SOLVER(upper,title,func,lower) func,
 enum { DIFFLIST(ENUM) DIFFCOUNT };
 static char const *const numberball_diffnames[] = { DIFFLIST(TITLE) };
 static char const numberball_diffchars[] = DIFFLIST(ENCODE);
@@ -53,6 +55,7 @@ enum {
 
 struct game_params {
     int w, dep, diff;
+    int reuse;			       /* puzzles made from each base puzzle */
 };
 
 struct clues
@@ -66,6 +69,19 @@ struct clues
 	digit *immutable;
 	bool *impose;
 	bool *forbid;
+	/*
+	 * The solution, worked out at most once per set of clues by
+	 * clues_solution() and shared by every state pointing here. It
+	 * is the one part of the clues which changes after new_game, and
+	 * is kept in a block of its own so that filling it in on behalf
+	 * of a const game_state doesn't write to the clues themselves.
+	 */
+	struct clues_soln *soln;
+};
+
+struct clues_soln {
+	digit *grid;		       /* NULL until first needed */
+	int ret;		       /* solver's verdict, or -1 if unknown */
 };
 	
 struct game_state 
@@ -75,6 +91,7 @@ struct game_state
     digit *grid;
     int *pencil;		       /* bitmaps using bits 1<<1..1<<n */
     bool *impose, *forbid;	   /* these are special pencil marks */
+    bool autocand;		       /* pencil marks kept to the candidates */
     bool completed, cheated;
 };
 
@@ -85,18 +102,19 @@ static game_params *default_params(void)
     ret->w = 5;
 	ret->dep = 3;
     ret->diff = DIFF_EASY;
+    ret->reuse = 0;
 
     return ret;
 }
 
 static const struct game_params numberball_presets[] = {
-    {  5, 3, DIFF_EASY         },
-    {  6, 3, DIFF_EASY         },
-    {  6, 4, DIFF_HARD         },
-    {  7, 3, DIFF_EASY         },
-    {  7, 4, DIFF_HARD         },
-    {  8, 4, DIFF_EXTREME      },
-    {  8, 5, DIFF_UNREASONABLE },
+    {  5, 3, DIFF_EASY,         0 },
+    {  6, 3, DIFF_EASY,         0 },
+    {  6, 4, DIFF_HARD,         0 },
+    {  7, 3, DIFF_EASY,         0 },
+    {  7, 4, DIFF_HARD,         0 },
+    {  8, 4, DIFF_EXTREME,      0 },
+    {  8, 5, DIFF_UNREASONABLE, 0 },
 };
 
 static bool game_fetch_preset(int i, char **name, game_params **params)
@@ -129,14 +147,24 @@ static game_params *dup_params(const game_params *params)
     return ret;
 }
 
-static void decode_params(game_params *params, char const *string)
+/*
+ * Decode a params string as decode_params does, and say whether it was
+ * well formed: the size, a separator, the depth, then optionally 'd'
+ * and a difficulty letter and 'r' and a count, and nothing else.
+ */
+static bool decode_params_strict(game_params *params, char const *string)
 {
 	char const *p = string;
+    bool ok = isdigit((unsigned char)*p);
 
     params->w = atoi(p);
     while (*p && isdigit((unsigned char)*p)) p++;
 	
-	p++;
+	if (*p)
+	    p++;
+	else
+	    ok = false;
+	ok = ok && isdigit((unsigned char)*p);
 	params->dep = atoi(p);
 	while (*p && isdigit((unsigned char)*p)) p++;
 	
@@ -151,7 +179,22 @@ static void decode_params(game_params *params, char const *string)
             }
             p++;
         }
+        ok = ok && params->diff < DIFFCOUNT;
     }
+
+    if (*p == 'r') {
+        p++;
+        ok = ok && isdigit((unsigned char)*p);
+        params->reuse = atoi(p);
+        while (*p && isdigit((unsigned char)*p)) p++;
+    }
+
+    return ok && !*p;
+}
+
+static void decode_params(game_params *params, char const *string)
+{
+    decode_params_strict(params, string);
 }
 
 static char *encode_params(const game_params *params, bool full)
@@ -159,8 +202,11 @@ static char *encode_params(const game_params *params, bool full)
 	char ret[80];
 
     sprintf(ret, "%dx%d", params->w, params->dep);
-    if (full)
+    if (full) {
         sprintf(ret + strlen(ret), "d%c", numberball_diffchars[params->diff]);
+        if (params->reuse > 0)
+            sprintf(ret + strlen(ret), "r%d", params->reuse);
+    }
 
     return dupstr(ret);
 }
@@ -170,7 +216,7 @@ static config_item *game_configure(const game_params *params)
 	config_item *ret;
     char buf[80];
 
-    ret = snewn(4, config_item);
+    ret = snewn(5, config_item);
 
     ret[0].name = "Grid size";
     ret[0].type = C_STRING;
@@ -187,8 +233,13 @@ static config_item *game_configure(const game_params *params)
     ret[2].u.choices.choicenames = DIFFCONFIG;
     ret[2].u.choices.selected = params->diff;
 
-    ret[3].name = NULL;
-    ret[3].type = C_END;
+    ret[3].name = "Puzzles per generated grid";
+    ret[3].type = C_STRING;
+    sprintf(buf, "%d", params->reuse);
+    ret[3].u.string.sval = dupstr(buf);
+
+    ret[4].name = NULL;
+    ret[4].type = C_END;
 
     return ret;
 }
@@ -200,6 +251,7 @@ static game_params *custom_params(const config_item *cfg)
     ret->w = atoi(cfg[0].u.string.sval);
     ret->dep = atoi(cfg[1].u.string.sval);
     ret->diff = cfg[2].u.choices.selected;
+    ret->reuse = atoi(cfg[3].u.string.sval);
 
     return ret;
 }
@@ -208,35 +260,459 @@ static const char *validate_params(const game_params *params, bool full)
 {
 	if (params->w < 3)
         return "Grid size must be above 3";
+	if (params->w > LATIN_MAX_SEMI_ORDER)
+        return "Grid size must be at most 32";
+	if (params->dep < 1)
+		return "Grid depth must be at least 1";
 	if (params->dep > params->w/2+1)
 		return "Grid depth must be below ceiling(1/2 grid size)";
     if (params->diff >= DIFFCOUNT)
         return "Unknown difficulty rating";
+    if (params->reuse < 0)
+        return "Puzzles per generated grid must not be negative";
     return NULL;
 }
 
-static usersolver_t const numberball_solvers[DIFFCOUNT]; /* don't need any */
+/*
+ * Cardinality deductions.
+ *
+ * Each row and column holds exactly dep numbers, one of each, so the
+ * cells which aren't blank are exactly those that some matching of
+ * the numbers 1..dep to distinct cells (each cell able to hold its
+ * number) uses, and every cell which must hold a number has to be one
+ * of them. By the Mendelsohn-Dulmage theorem, such a matching exists
+ * exactly when the numbers can all be matched and, separately, the
+ * required cells can all be matched. So an open cell must be blank if
+ * adding it to the required cells makes those unmatchable, and must
+ * hold a number if the numbers can't all be matched without it.
+ *
+ * This subsumes counting required or blank cells against dep, which
+ * the simple tier does, and catches lines where the numbers left are
+ * confined to too few cells long before guessing would.
+ */
+
+/* Try to find an augmenting path from number n, using only cells. */
+static bool card_augment(int n, const latin_mask *cand, latin_mask cells,
+			 int *owner, latin_mask *visited)
+{
+    latin_mask avail = cand[n] & cells & ~*visited;
+    int c;
+
+    for (c = 0; avail; c++, avail >>= 1) {
+	if (!(avail & 1))
+	    continue;
+	*visited |= (latin_mask)1 << c;
+	if (owner[c] < 0 ||
+	    card_augment(owner[c], cand, cells, owner, visited)) {
+	    owner[c] = n;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/* Size of a maximum matching between the numbers and the given cells. */
+static int card_matching(const latin_mask *cand, int dep, latin_mask cells)
+{
+    int owner[LATIN_MAX_SEMI_ORDER], n, size = 0;
+    latin_mask visited;
+
+    for (n = 0; n < LATIN_MAX_SEMI_ORDER; n++)
+	owner[n] = -1;
+    for (n = 0; n < dep; n++) {
+	visited = 0;
+	if (card_augment(n, cand, cells, owner, &visited))
+	    size++;
+    }
+    return size;
+}
+
+static int popcount_mask(latin_mask m)
+{
+    int count = 0;
+
+    for (; m; m &= m - 1)
+	count++;
+    return count;
+}
+
+static int solver_cardinality_line(struct latin_solver *solver,
+				   int unit, int idx)
+{
+    int o = solver->o, dep = solver->depth, i, n, nforce, ret = 0;
+    bool rowwise = (unit == LATIN_UNIT_ROW);
+    latin_mask cand[LATIN_MAX_SEMI_ORDER], elim[LATIN_MAX_SEMI_ORDER];
+    latin_mask all = 0, force, blank = 0, need = 0, open;
+
+    force = rowwise ? solver->rowforce[idx] : solver->colforce[idx];
+    for (n = 0; n < dep; n++) {
+	cand[n] = elim[n] = 0;
+	for (i = 0; i < o; i++) {
+	    int x = rowwise ? i : idx, y = rowwise ? idx : i;
+	    if (cube(x, y, n+1))
+		cand[n] |= (latin_mask)1 << i;
+	}
+	all |= cand[n];
+    }
+    for (i = 0; i < o; i++) {
+	int x = rowwise ? i : idx, y = rowwise ? idx : i;
+	if (grid(x, y))
+	    force |= (latin_mask)1 << i;
+    }
+    nforce = popcount_mask(force);
+
+    if (card_matching(cand, dep, all) < dep ||
+	card_matching(cand, dep, force) < nforce) {
+	if (solver->trace) {
+	    latin_solver_report(solver, LATIN_EV_DEDUCE, LATIN_TECH_USER,
+				unit, idx, -1, -1, 0, NULL, 0);
+	    latin_solver_report(solver, LATIN_EV_CONTRADICTION,
+				LATIN_TECH_USER, unit, idx, -1, -1, 0, NULL, 0);
+	}
+	return -1;
+    }
+
+    open = all & ~force;
+    for (i = 0; i < o; i++) {
+	latin_mask bit = (latin_mask)1 << i;
+	if (!(open & bit))
+	    continue;
+	if (card_matching(cand, dep, force | bit) < nforce + 1)
+	    blank |= bit;
+	else if (card_matching(cand, dep, all & ~bit) < dep)
+	    need |= bit;
+    }
+
+    /*
+     * Now the same for each number n in each cell c, of those still
+     * possible: with n put in c, the other numbers must still match
+     * into the other cells, and so must the other required cells.
+     */
+    for (n = 0; n < dep; n++) {
+	latin_mask cells = cand[n] & ~(blank | elim[n]), saved = cand[n];
+	for (i = 0; cells; i++, cells >>= 1) {
+	    latin_mask bit = (latin_mask)1 << i;
+	    int x = rowwise ? i : idx, y = rowwise ? idx : i;
+	    if (!(cells & 1) || grid(x, y))
+		continue;
+	    cand[n] = 0;
+	    if (card_matching(cand, dep, all & ~bit) < dep - 1 ||
+		card_matching(cand, dep, force & ~bit) <
+		nforce - ((force & bit) ? 1 : 0))
+		elim[n] |= bit;
+	    cand[n] = saved;
+	}
+    }
+
+    for (i = 0; i < o; i++) {
+	latin_mask bit = (latin_mask)1 << i;
+	int x = rowwise ? i : idx, y = rowwise ? idx : i;
+
+	for (n = 0; n < dep; n++)
+	    if (elim[n] & bit) {
+		if (solver->trace) {
+		    if (ret == 0)
+			latin_solver_report(solver, LATIN_EV_DEDUCE,
+					    LATIN_TECH_USER, unit, idx,
+					    -1, -1, 0, NULL, 0);
+		    latin_solver_report(solver, LATIN_EV_RULE_OUT,
+					LATIN_TECH_USER, unit, idx,
+					x, y, n+1, NULL, 0);
+		}
+		latin_solver_rule_out(solver, x, y, n+1);
+		if (solver->stats)
+		    solver->stats->eliminations[LATIN_TECH_USER]++;
+		ret = 1;
+	    }
+
+	if (!((blank | need) & bit) || (blank & bit && solver->forbid[y*o+x]))
+	    continue;
+	if (solver->trace) {
+	    if (ret == 0)
+		latin_solver_report(solver, LATIN_EV_DEDUCE, LATIN_TECH_USER,
+				    unit, idx, -1, -1, 0, NULL, 0);
+	    latin_solver_report(solver, (blank & bit) ? LATIN_EV_FORBID :
+				LATIN_EV_FORCE, LATIN_TECH_USER,
+				unit, idx, x, y, 0, NULL, 0);
+	}
+	if (blank & bit) {
+	    int elim = latin_solver_mark_forbid(solver, x, y);
+	    if (solver->stats)
+		solver->stats->eliminations[LATIN_TECH_USER] += elim;
+	} else
+	    latin_solver_mark_force(solver, x, y);
+	if (solver->stats)
+	    solver->stats->placements[LATIN_TECH_USER]++;
+	ret = 1;
+    }
+
+    return ret;
+}
+
+static int solver_cardinality(struct latin_solver *solver, void *vctx)
+{
+    int o = solver->o, i, ret;
+
+    if (solver->depth == o)
+	return 0;		       /* no blanks to find */
+
+    for (i = 0; i < o; i++) {
+	ret = solver_cardinality_line(solver, LATIN_UNIT_ROW, i);
+	if (ret != 0) return ret;
+	ret = solver_cardinality_line(solver, LATIN_UNIT_COL, i);
+	if (ret != 0) return ret;
+    }
+    return 0;
+}
+
+static usersolver_t const numberball_solvers[] = { DIFFLIST(SOLVER) };
+
+/*
+ * Limits on the recursive solver. The generator's limit is a node
+ * count rather than a time so that a given seed still produces the
+ * same puzzle on every machine; a candidate grid which needs more
+ * guessing than this is rejected. Real puzzles need a handful.
+ */
+#define GEN_MAX_NODES 1000
+#define SOLVE_MAX_TIME 5.0
+
+/*
+ * Memory for the transposition table the generator shares between the
+ * uniqueness checks of one Unreasonable puzzle. Successive candidate
+ * clue sets differ by one clue, so their searches meet the same
+ * sub-states over and over.
+ */
+#define GEN_TT_BYTES (1 << 20)
+
+/*
+ * Optional extras for a solver run; any of these may be NULL.
+ */
+struct solver_options {
+    struct latin_solver_stats *stats;  /* accumulates deduction counts */
+    latin_trace_fn trace;	       /* receives each deduction made */
+    void *tracectx;
+    struct latin_solver_budget *budget; /* limits on recursion */
+    struct latin_solver_tt *tt;	       /* remembers searched sub-states */
+    struct latin_solver_search *search; /* how the recursive tier guesses */
+    int *progress;		       /* DIFFCOUNT cells-decided figures */
+    double *score;		       /* effort, for ordering within grades */
+};
+
+static int solver_ex(digit *grid, bool *impose, bool *forbid, int o,
+		     int depth, int maxdiff, const struct solver_options *opts)
+{
+    struct latin_solver ls;
+    int diff;
+
+    latin_solver_alloc(&ls, grid, o, depth, impose, forbid);
+    if (opts) {
+	ls.stats = opts->stats;
+	ls.trace = opts->trace;
+	ls.tracectx = opts->tracectx;
+	ls.budget = opts->budget;
+	ls.search = opts->search;
+	latin_solver_set_tt(&ls, opts->tt);
+    }
+    diff = latin_solver_grade(&ls, maxdiff, opts ? opts->progress : NULL,
+			      opts ? opts->score : NULL,
+			      DIFF_EASY, DIFF_HARD, DIFF_EXTREME,
+			      DIFF_EXTREME, DIFF_UNREASONABLE,
+			      numberball_solvers, NULL, NULL, NULL);
+    latin_solver_free(&ls);
 
-static int solver(digit *grid, bool *impose, bool *forbid, int o, int depth, int maxdiff)
-{	
-	int diff = latin_solver(grid, o, depth, impose, forbid, maxdiff, 
-						DIFF_EASY, DIFF_HARD, DIFF_EXTREME,
-						DIFF_EXTREME, DIFF_UNREASONABLE,
-						numberball_solvers, NULL, NULL, NULL);
-			   
     return diff;
 }
 
-static char *new_game_desc(const game_params *params, random_state *rs,
-			   char **aux, bool interactive)
+/*
+ * Run the solver with at most maxnodes guesses and maxtime seconds
+ * (either may be zero for no limit), returning diff_exhausted if that
+ * is not enough.
+ */
+static int solver_limited(digit *grid, bool *impose, bool *forbid, int o,
+			  int depth, int maxdiff, long maxnodes, double maxtime)
+{
+    struct latin_solver_budget budget;
+    struct solver_options opts;
+
+    memset(&budget, 0, sizeof(budget));
+    budget.maxnodes = maxnodes;
+    budget.maxtime = maxtime;
+    memset(&opts, 0, sizeof(opts));
+    opts.budget = &budget;
+    return solver_ex(grid, impose, forbid, o, depth, maxdiff, &opts);
+}
+
+/*
+ * Say whether a set of clues is good enough at difficulty diff, given
+ * the solution it was made from: that is, whether the solver can get
+ * to that solution without needing anything harder, and in the case
+ * of Unreasonable, whether it's the only one. grid is overwritten.
+ * tt may be NULL, or a transposition table for the order and depth.
+ */
+static bool clues_unique(digit *grid, bool *impose, bool *forbid,
+			 const digit *soln, int o, int depth, int diff,
+			 struct latin_solver_tt *tt)
+{
+    struct latin_solver ls;
+    struct latin_solver_budget budget;
+    int ret;
+
+    if (diff < DIFF_UNREASONABLE)
+	return solver_ex(grid, impose, forbid, o, depth, diff, NULL) <= diff;
+
+    memset(&budget, 0, sizeof(budget));
+    budget.maxnodes = GEN_MAX_NODES;
+    latin_solver_alloc(&ls, grid, o, depth, impose, forbid);
+    ls.budget = &budget;
+    latin_solver_set_tt(&ls, tt);
+    ret = latin_solver_unique(&ls, soln,
+			      DIFF_EASY, DIFF_HARD, DIFF_EXTREME,
+			      DIFF_EXTREME, DIFF_UNREASONABLE,
+			      numberball_solvers, NULL, NULL, NULL);
+    latin_solver_free(&ls);
+
+    return ret == 1;
+}
+
+/*
+ * Optional check, made between steps of the generator, of whether its
+ * caller still wants the puzzle.
+ */
+typedef bool (*gen_cancel_fn)(void *ctx);
+
+/*
+ * Clue removal. Rather than trying each clue on its own, the
+ * generator tries to drop a whole batch of them with one solver call,
+ * and only when that fails does it split the batch in half and try
+ * each half in turn. Taking a clue away never makes a puzzle easier
+ * or gives it fewer solutions, so this keeps exactly the clues that
+ * trying them one at a time in the same order would; and once the
+ * first half has gone, the second is known not to go as a whole. The
+ * batch size follows the recent rate at which clues have gone, aiming
+ * at batches which usually go: large while most clues are still
+ * spare, down to one at a time near the end. A failed batch costs
+ * more than the calls it would have saved, as the solver works
+ * hardest on the sparsest grids, so batches stay small.
+ */
+struct gen_removal {
+    int w, dep, diff;
+    digit *grid, *grid2;
+    bool *imp, *imp2, *forb, *forb2;
+    const digit *soln;
+    bool impose;		       /* digits become imposed, not blank */
+    struct latin_solver_tt *tt;
+    double rate;		       /* recent fraction of clues removed */
+    gen_cancel_fn cancelled;
+    void *cancelctx;
+    bool ok;			       /* false once cancelled */
+};
+
+#define GEN_BATCH_MAX 8
+#define GEN_BATCH_RATE 0.9	       /* what to expect before any tries */
+#define GEN_BATCH_ODDS 0.7	       /* how often a batch should go */
+
+static void gen_strip(struct gen_removal *g, digit *grid, bool *imp,
+		      bool *forb, int j)
+{
+    if (grid[j]) {
+	grid[j] = 0;
+	if (g->impose)
+	    imp[j] = true;
+    } else
+	forb[j] = false;
+}
+
+static void gen_rate(struct gen_removal *g, int n, bool removed)
+{
+    while (n-- > 0)
+	g->rate += ((removed ? 1.0 : 0.0) - g->rate) / 4;
+}
+
+/*
+ * Try to remove the n clues at cells, or as many of them as can go.
+ * failed says that removing all of them at once is already known not
+ * to work. Returns true if they all went.
+ */
+static bool gen_remove(struct gen_removal *g, const int *cells, int n,
+		       bool failed)
+{
+    int a = g->w * g->w, i, h;
+    bool all;
+
+    if (!failed) {
+	if (g->cancelled && g->cancelled(g->cancelctx)) {
+	    g->ok = false;
+	    return false;
+	}
+	memcpy(g->grid2, g->grid, a);
+	memcpy(g->imp2, g->imp, a);
+	memcpy(g->forb2, g->forb, a);
+	for (i = 0; i < n; i++)
+	    gen_strip(g, g->grid2, g->imp2, g->forb2, cells[i]);
+	if (clues_unique(g->grid2, g->imp2, g->forb2, g->soln, g->w, g->dep,
+			 g->diff, g->tt)) {
+	    for (i = 0; i < n; i++)
+		gen_strip(g, g->grid, g->imp, g->forb, cells[i]);
+	    gen_rate(g, n, true);
+	    return true;
+	}
+    }
+    if (n == 1) {
+	gen_rate(g, 1, false);
+	return false;
+    }
+
+    h = n / 2;
+    all = gen_remove(g, cells, h, false);
+    if (g->ok)
+	gen_remove(g, cells + h, n - h, all);
+    return false;
+}
+
+/*
+ * Remove what clues can go from the n cells in order, a batch at a
+ * time.
+ */
+static void gen_remove_all(struct gen_removal *g, const int *cells, int n)
+{
+    int i = 0, k;
+    double q;
+
+    g->rate = GEN_BATCH_RATE;
+    while (i < n && g->ok) {
+	/* The largest batch which should usually go. */
+	for (k = 1, q = g->rate;
+	     k < GEN_BATCH_MAX && k < n - i && q * g->rate >= GEN_BATCH_ODDS; k++)
+	    q *= g->rate;
+	gen_remove(g, cells + i, k, false);
+	i += k;
+    }
+}
+
+/*
+ * Generate a puzzle from scratch, filling in the clue digits, the
+ * imposed and forbidden cells, and the solution, each of w*w. If
+ * cancelled is not NULL and comes to return true, gives up and
+ * returns false. If tries is not NULL, it gets the number of candidate
+ * grids made, the last being the one used.
+ */
+static bool generate_puzzle(const game_params *params, random_state *rs,
+			    digit *outgrid, bool *outimp, bool *outforb,
+			    digit *outsoln, gen_cancel_fn cancelled,
+			    void *cancelctx, int *tries)
 {
 	int w = params->w, dep = params->dep, a = w*w;
     digit *grid, *soln, *soln2;
 	bool *imp, *imp2, *forb, *forb2;
     int *order;
-    int i, ret;
+    int i, n, ret;
     int diff = params->diff;
-    char *desc, *p;
+    struct latin_solver_tt *tt = NULL;
+    struct gen_removal rem;
+    bool ok = true;
+
+    if (tries)
+	*tries = 0;
 	
     if (diff > DIFF_HARD && w <= 5)
 	diff = DIFF_HARD;
@@ -251,86 +727,85 @@ static char *new_game_desc(const game_params *params, random_state *rs,
 	forb = snewn(a, bool);
 	forb2 = snewn(a, bool);
     order = snewn(a, int);
+    if (diff == DIFF_UNREASONABLE)
+	tt = latin_solver_tt_new(w, GEN_TT_BYTES, LATIN_TT_REPLACE_WORK);
+
+    rem.w = w;
+    rem.dep = dep;
+    rem.diff = diff;
+    rem.grid2 = soln2;
+    rem.imp = imp;
+    rem.imp2 = imp2;
+    rem.forb = forb;
+    rem.forb2 = forb2;
+    rem.soln = soln;
+    rem.tt = tt;
+    rem.cancelled = cancelled;
+    rem.cancelctx = cancelctx;
+    rem.ok = true;
 
     while (1) {
+	if (cancelled && cancelled(cancelctx)) {
+	    ok = false;
+	    break;
+	}
+	if (tries)
+	    (*tries)++;
+
 	/*
-	 * Construct a latin square to be the solution.
+	 * Construct a depth-limited latin square to be the solution.
 	 */
 	sfree(grid);
-	grid = latin_generate(w, rs);
+	grid = latin_generate_partial(w, dep, rs);
 	memset(imp, 0, a);
 	memset(imp2, 0, a);
 	memset(forb, 0, a);
 	memset(forb2, 0, a);
 	for(i = 0; i < a; i++)
-	if(grid[i] > dep)
-	{
-		grid[i] = 0;
+	if(!grid[i])
 		forb[i] = true;
-	}
 		
 	/*
 	 * Remove the grid numbers or known empty cells, 
 	 * and then find cells for which it is enough to know that it must have a value 
-	 * without knowing which value exactly, one by one,
+	 * without knowing which value exactly, a batch at a time,
 	 * for as long as the game remains soluble at the given
 	 * difficulty.
 	 */
 	memcpy(soln, grid, a);
 
+	rem.grid = grid;
+	rem.impose = false;
 	for (i = 0; i < a; i++)
 	    order[i] = i;
 	shuffle(order, a, sizeof(*order), rs);
-	for (i = 0; i < a; i++) {
-	    int j = order[i];
-
-	    memcpy(soln2, grid, a);
-		memcpy(forb2, forb, a);
-	    if(soln2[j])
-			soln2[j] = 0;
-		else
-			forb2[j] = false;
-		
-	    ret = solver(soln2, imp2, forb2, w,  dep, diff);
-	    if (ret <= diff)
-		{
-		if(grid[j])
-			grid[j] = 0;
-		else
-			forb[j] = false;
-		}
-	}
-		
+	gen_remove_all(&rem, order, a);
+	ok = rem.ok;
+
+	/*
+	 * Only the cells still holding digits are candidates now.
+	 */
+	rem.impose = true;
 	for (i = 0; i < a; i++)
 	    order[i] = i;
 	shuffle(order, a, sizeof(*order), rs);
-	for (i = 0; i < a; i++) {
-	    int j = order[i];
+	for (i = n = 0; i < a; i++)
+	    if (grid[order[i]])
+		order[n++] = order[i];
+	if (ok)
+	    gen_remove_all(&rem, order, n);
+	ok = rem.ok;
+
+	if (!ok)
+	    break;
 
-	    memcpy(soln2, grid, a);
-		memcpy(imp2, imp, a);
-	    if(soln2[j])
-		{
-			soln2[j] = 0;
-			imp2[j] = true;
-		}
-		else
-			continue;
-		
-	    ret = solver(soln2, imp2, forb2, w,  dep, diff);
-	    if (ret <= diff)
-		{
-			grid[j] = 0;
-			imp[j] = true;
-		}
-	}
-		
 	/*
 	 * See if the game can be solved at the specified difficulty
 	 * level, but not at the one below.
 	 */
 	memcpy(soln2, grid, a);
-	ret = solver(soln2, imp2, forb2, w,  dep, diff);
+	ret = solver_limited(soln2, imp, forb, w, dep, diff,
+			     GEN_MAX_NODES, 0.0);
 	if (ret != diff)
 	    continue;		       /* go round again */
 
@@ -340,17 +815,42 @@ static char *new_game_desc(const game_params *params, random_state *rs,
 	break;
     }
 
-    /*
-     * Encode the puzzle description.
-     */
+    if (ok) {
+	memcpy(outgrid, grid, a);
+	memcpy(outimp, imp, a);
+	memcpy(outforb, forb, a);
+	memcpy(outsoln, soln, a);
+    }
+
+    sfree(grid);
+    sfree(soln);
+    sfree(soln2);
+	sfree(imp);
+	sfree(imp2);
+	sfree(forb);
+	sfree(forb2);
+    sfree(order);
+    latin_solver_tt_free(tt);
+
+    return ok;
+}
+
+/*
+ * Encode a set of clues as a game description.
+ */
+static char *encode_desc(int w, const digit *grid, const bool *imp,
+			 const bool *forb)
+{
+    int a = w*w, i, run = 0;
+    char *desc, *p;
+
     desc = snewn(40*a, char);
     p = desc;
 
-	int run = 0;
 	for (i = 0; i <= a; i++) {
 	    int n = (i < a ? grid[i] : -1);
 
-	    if (!n && !imp[i] && !forb[i])
+	    if (i < a && !n && !imp[i] && !forb[i])
 		run++;
 	    else {
 		if (run) {
@@ -365,41 +865,286 @@ static char *new_game_desc(const game_params *params, random_state *rs,
 		     * bottom right, there's no point putting an
 		     * unnecessary _ before or after it.
 		     */
-		    if (i > 0 && (n > 0 || imp[i] || forb[i]))
+		    if (i > 0 && i < a && (n > 0 || imp[i] || forb[i]))
 			*p++ = '_';
 		}
 		if (n > 0)
 		    p += sprintf(p, "%d", n);
-		else if(imp[i] && i<a)
+		else if(i < a && imp[i])
 			p += sprintf(p, "%c", 'O');
-		else if(forb[i] && i<a)
+		else if(i < a && forb[i])
 			p += sprintf(p, "%c", 'X');
 		
 		run = 0;
 	    }
 	}
     *p++ = '\0';
-    desc = sresize(desc, p - desc, char);
+    return sresize(desc, p - desc, char);
+}
 
-    /*
-     * Encode the solution.
-     */
-    *aux = snewn(a+2, char);
-    (*aux)[0] = 'S';
+/*
+ * Encode a solution as the aux string, in the same form as a solve
+ * move.
+ */
+static char *encode_solution(int w, const digit *soln)
+{
+    int a = w*w, i;
+    char *ret = snewn(a+2, char);
+
+    ret[0] = 'S';
     for (i = 0; i < a; i++)
-	(*aux)[i+1] = '0' + soln[i];
-    (*aux)[a+1] = '\0';
+	ret[i+1] = '0' + soln[i];
+    ret[a+1] = '\0';
+    return ret;
+}
+
+/*
+ * Isotopes. Permuting the rows, permuting the columns, transposing
+ * and relabelling the digits all turn a puzzle into another with
+ * a unique solution, solvable by exactly the same deductions. So
+ * having made one expensive base puzzle we can hand out any number
+ * of random isotopes of it for next to nothing, if the user has
+ * asked for that by setting params->reuse.
+ *
+ * The base puzzle is kept in a static cache, so this is not
+ * thread-safe.
+ */
+static struct {
+    game_params params;		       /* what the base was made for */
+    int uses;			       /* puzzles made from it so far */
+    digit *grid, *soln;		       /* NULL if the cache is empty */
+    bool *imp, *forb;
+} base_cache;
+
+/*
+ * Apply a uniformly random element of the isotopy group to a puzzle.
+ * Choosing the group element uniformly makes every distinct isotope
+ * equally likely.
+ */
+static void make_isotope(int w, int dep, random_state *rs,
+			 const digit *grid, const bool *imp, const bool *forb,
+			 const digit *soln, digit *outgrid, bool *outimp,
+			 bool *outforb, digit *outsoln)
+{
+    int *rows = snewn(w, int), *cols = snewn(w, int);
+    digit *relabel = snewn(dep+1, digit);
+    bool transpose = random_upto(rs, 2);
+    int x, y, i;
+
+    for (i = 0; i < w; i++)
+	rows[i] = cols[i] = i;
+    shuffle(rows, w, sizeof(*rows), rs);
+    shuffle(cols, w, sizeof(*cols), rs);
+    for (i = 0; i <= dep; i++)
+	relabel[i] = i;		       /* relabel[0] = 0 keeps blanks blank */
+    shuffle(relabel+1, dep, sizeof(*relabel), rs);
+
+    for (y = 0; y < w; y++)
+	for (x = 0; x < w; x++) {
+	    int src = (transpose ? cols[x]*w + rows[y] : rows[y]*w + cols[x]);
+	    int dst = y*w+x;
+	    outgrid[dst] = relabel[grid[src]];
+	    outsoln[dst] = relabel[soln[src]];
+	    outimp[dst] = imp[src];
+	    outforb[dst] = forb[src];
+	}
+
+    sfree(rows);
+    sfree(cols);
+    sfree(relabel);
+}
+
+static const char *validate_desc(const game_params *params, const char *desc);
+
+/*
+ * The body of new_game_desc, which may be cancelled as generate_puzzle
+ * can, in which case it returns NULL.
+ */
+static char *generate_desc(const game_params *params, random_state *rs,
+			   char **aux, gen_cancel_fn cancelled,
+			   void *cancelctx)
+{
+    int w = params->w, a = w*w;
+    digit *grid = snewn(a, digit), *soln = snewn(a, digit);
+    bool *imp = snewn(a, bool), *forb = snewn(a, bool);
+    char *desc = NULL;
+    bool ok;
+
+    if (params->reuse > 1) {
+	ok = true;
+	if (!base_cache.grid || base_cache.uses >= params->reuse ||
+	    base_cache.params.w != params->w ||
+	    base_cache.params.dep != params->dep ||
+	    base_cache.params.diff != params->diff) {
+	    /*
+	     * Make a new base puzzle, only replacing the old one once
+	     * we know we have it.
+	     */
+	    ok = generate_puzzle(params, rs, grid, imp, forb, soln,
+				 cancelled, cancelctx, NULL);
+	    if (ok) {
+		sfree(base_cache.grid);
+		sfree(base_cache.soln);
+		sfree(base_cache.imp);
+		sfree(base_cache.forb);
+		base_cache.params = *params;
+		base_cache.uses = 0;
+		base_cache.grid = snewn(a, digit);
+		base_cache.soln = snewn(a, digit);
+		base_cache.imp = snewn(a, bool);
+		base_cache.forb = snewn(a, bool);
+		memcpy(base_cache.grid, grid, a);
+		memcpy(base_cache.soln, soln, a);
+		memcpy(base_cache.imp, imp, a);
+		memcpy(base_cache.forb, forb, a);
+	    }
+	}
+	if (ok) {
+	    make_isotope(w, params->dep, rs, base_cache.grid, base_cache.imp,
+			 base_cache.forb, base_cache.soln,
+			 grid, imp, forb, soln);
+	    base_cache.uses++;
+	}
+    } else {
+	ok = generate_puzzle(params, rs, grid, imp, forb, soln,
+			     cancelled, cancelctx, NULL);
+    }
+
+    if (ok) {
+	desc = encode_desc(w, grid, imp, forb);
+	assert(!validate_desc(params, desc));
+	*aux = encode_solution(w, soln);
+    }
 
     sfree(grid);
     sfree(soln);
-    sfree(soln2);
-	sfree(imp);
-	sfree(imp2);
-	sfree(forb);
-	sfree(forb2);
-    sfree(order);
+    sfree(imp);
+    sfree(forb);
+
+    return desc;
+}
+
+#ifdef NUMBERBALL_PREFETCH
+
+#include <pthread.h>
+
+/*
+ * Background generation. Having handed out a puzzle, new_game_desc
+ * starts a thread on the next one for the same parameters, so that
+ * by the time the player asks for it it's usually ready. If the next
+ * request is for different parameters, the thread is told to stop at
+ * its next checkpoint and its work is thrown away.
+ *
+ * The thread can't draw on the midend's random_state, which only
+ * lasts for one call, so it gets one of its own seeded from it. The
+ * upshot is that the random seed the midend reports for a prefetched
+ * game won't regenerate it, though the game ID will.
+ *
+ * Only the thread in flight and the caller ever touch the base
+ * puzzle cache, and never at once, since the caller always waits for
+ * the thread before generating anything itself.
+ */
+struct prefetch {
+    bool cancel;		       /* under prefetch_lock */
+    bool running;		       /* thread has been started, not joined */
+    pthread_t thread;
+    game_params params;
+    random_state *rs;
+    char *desc, *aux;		       /* its result, or NULL */
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prefetch prefetch;
+
+static bool prefetch_cancelled(void *ctx)
+{
+    struct prefetch *pf = (struct prefetch *)ctx;
+    bool ret;
+
+    pthread_mutex_lock(&prefetch_lock);
+    ret = pf->cancel;
+    pthread_mutex_unlock(&prefetch_lock);
+    return ret;
+}
+
+static void *prefetch_main(void *ctx)
+{
+    struct prefetch *pf = (struct prefetch *)ctx;
+
+    pf->desc = generate_desc(&pf->params, pf->rs, &pf->aux,
+			     prefetch_cancelled, pf);
+    random_free(pf->rs);
+    return NULL;
+}
+
+/*
+ * Wait for the thread in flight, if any, to finish; or if it's working
+ * on the wrong parameters, stop it. Returns its puzzle if that's one
+ * for params.
+ */
+static char *prefetch_collect(const game_params *params, char **aux)
+{
+    bool same;
+    char *desc = NULL;
+
+    if (!prefetch.running)
+	return NULL;
+
+    same = params && prefetch.params.w == params->w &&
+	prefetch.params.dep == params->dep &&
+	prefetch.params.diff == params->diff &&
+	prefetch.params.reuse == params->reuse;
+    if (!same) {
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch.cancel = true;
+	pthread_mutex_unlock(&prefetch_lock);
+    }
+    pthread_join(prefetch.thread, NULL);
+    prefetch.running = false;
+
+    if (same && prefetch.desc) {
+	desc = prefetch.desc;
+	*aux = prefetch.aux;
+    } else if (prefetch.desc) {
+	sfree(prefetch.desc);
+	sfree(prefetch.aux);
+    }
+    prefetch.desc = prefetch.aux = NULL;
+    return desc;
+}
+
+static void prefetch_start(const game_params *params, random_state *rs)
+{
+    char seed[32];
+
+    sprintf(seed, "%08lx%08lx%08lx", random_bits(rs, 32),
+	    random_bits(rs, 32), random_bits(rs, 32));
+    prefetch.params = *params;
+    prefetch.rs = random_new(seed, strlen(seed));
+    prefetch.cancel = false;
+    prefetch.desc = prefetch.aux = NULL;
+    if (pthread_create(&prefetch.thread, NULL, prefetch_main, &prefetch))
+	random_free(prefetch.rs);      /* never mind, then */
+    else
+	prefetch.running = true;
+}
+
+#endif /* NUMBERBALL_PREFETCH */
 
+static char *new_game_desc(const game_params *params, random_state *rs,
+			   char **aux, bool interactive)
+{
+#ifdef NUMBERBALL_PREFETCH
+    char *desc = prefetch_collect(interactive ? params : NULL, aux);
+
+    if (!desc)
+	desc = generate_desc(params, rs, aux, NULL, NULL);
+    if (interactive)
+	prefetch_start(params, rs);
     return desc;
+#else
+    return generate_desc(params, rs, aux, NULL, NULL);
+#endif
 }
 
 static const char *validate_desc(const game_params *params, const char *desc)
@@ -475,6 +1220,9 @@ static game_state *new_game(midend *me, const game_params *params,
     state->clues->immutable = snewn(a, digit);
 	state->clues->impose = snewn(a, bool);
 	state->clues->forbid = snewn(a, bool);
+	state->clues->soln = snew(struct clues_soln);
+	state->clues->soln->grid = NULL;
+	state->clues->soln->ret = -1;
     state->grid = snewn(a, digit);
 	state->impose = snewn(a, bool);
 	state->forbid = snewn(a, bool);
@@ -516,6 +1264,7 @@ static game_state *new_game(midend *me, const game_params *params,
 	assert(pos == a);
     assert(!*p);
 
+    state->autocand = false;
     state->completed = false;
     state->cheated = false;
 
@@ -541,6 +1290,7 @@ static game_state *dup_game(const game_state *state)
     memcpy(ret->impose, state->impose, a);
 	memcpy(ret->forbid, state->forbid, a);
 
+    ret->autocand = state->autocand;
     ret->completed = state->completed;
     ret->cheated = state->cheated;
 
@@ -550,54 +1300,97 @@ static game_state *dup_game(const game_state *state)
 static void free_game(game_state *state)
 {
 	sfree(state->grid);
+	sfree(state->impose);
+	sfree(state->forbid);
     sfree(state->pencil);
     if (--state->clues->refcount <= 0) {
 	sfree(state->clues->immutable);
 	sfree(state->clues->impose);
 	sfree(state->clues->forbid);
+	sfree(state->clues->soln->grid);
+	sfree(state->clues->soln);
 	sfree(state->clues);
     }
     sfree(state);
 }
 
-static char *solve_game(const game_state *state, const game_state *currstate,
-                        const char *aux, const char **error)
-{
+/*
+ * Find the solution to a set of clues, running the solver only until
+ * it first reaches a verdict. Returns NULL, with *error filled in, if
+ * there is no unique solution.
+ */
+static const digit *clues_solution(const struct clues *clues,
+				   const char **error)
+{
+    struct clues_soln *cs = clues->soln;
+    int a = clues->w * clues->w, ret;
+
+    if (cs->ret < 0) {
+	if (!cs->grid)
+	    cs->grid = snewn(a, digit);
+	memcpy(cs->grid, clues->immutable, a);
+	ret = solver_limited(cs->grid, clues->impose, clues->forbid,
+			     clues->w, clues->dep, DIFFCOUNT-1,
+			     0, SOLVE_MAX_TIME);
+	/*
+	 * Running out of time says nothing about the puzzle, so that
+	 * isn't remembered: a later try may have the time to spare.
+	 */
+	if (ret == diff_exhausted) {
+	    *error = "Solver gave up: this puzzle is too hard to solve in time";
+	    return NULL;
+	}
+	cs->ret = ret;
+    }
+
+    if (cs->ret == diff_impossible) {
+	*error = "No solution exists for this puzzle";
+	return NULL;
+    } else if (cs->ret == diff_ambiguous) {
+	*error = "Multiple solutions exist for this puzzle";
+	return NULL;
+    }
+    return cs->grid;
+}
+
+static char *solve_game(const game_state *state, const game_state *currstate,
+                        const char *aux, const char **error)
+{
 	int w = state->par.w, a = w*w, dep = state->par.dep;
-    int i, ret;
-    digit *soln;
-	bool *impose, *forbid;
+    struct clues_soln *cs = state->clues->soln;
+    const digit *soln;
+    int i;
     char *out;
 
-    if (aux)
+    if (aux) {
+	/*
+	 * The generator already knows the answer; remember it in the
+	 * clues so that nothing later has to solve for it again.
+	 */
+	if (cs->ret < 0 && aux[0] == 'S' && strlen(aux) == (size_t)a + 1) {
+	    if (!cs->grid)
+		cs->grid = snewn(a, digit);
+	    for (i = 0; i < a; i++) {
+		if (aux[i+1] < '0' || aux[i+1] > '0'+dep)
+		    break;
+		cs->grid[i] = aux[i+1] - '0';
+	    }
+	    if (i == a)
+		cs->ret = DIFFCOUNT-1;
+	}
 	return dupstr(aux);
+    }
 
-    soln = snewn(a, digit);
-	impose = snewn(a, bool);
-	forbid = snewn(a, bool);
-    memcpy(soln, state->clues->immutable, a);
-    memcpy(impose, state->clues->impose, a);
-    memcpy(forbid, state->clues->forbid, a);
-
-    ret = solver(soln, impose, forbid, w, dep, DIFFCOUNT-1);
+    soln = clues_solution(state->clues, error);
+    if (!soln)
+	return NULL;
 
-    if (ret == diff_impossible) {
-	*error = "No solution exists for this puzzle";
-	out = NULL;
-    } else if (ret == diff_ambiguous) {
-	*error = "Multiple solutions exist for this puzzle";
-	out = NULL;
-    } else {
-	out = snewn(a+2, char);
-	out[0] = 'S';
-	for (i = 0; i < a; i++)
-	    out[i+1] = '0' + soln[i];
-	out[a+1] = '\0';
-    }
+    out = snewn(a+2, char);
+    out[0] = 'S';
+    for (i = 0; i < a; i++)
+	out[i+1] = '0' + soln[i];
+    out[a+1] = '\0';
 
-    sfree(soln);
-	sfree(impose);
-	sfree(forbid);
     return out;
 }
 
@@ -611,7 +1404,7 @@ static char *game_text_format(const game_state *state)
 	int x, y, pos, w = state->par.w;
 	char *ret, *p;
 	
-	ret = snewn(w*(w+1)+1, char);
+	ret = snewn(w*(2*w+1)+1, char);
 
 	p = ret;
     for (y = 0; y < w; y++) {
@@ -701,9 +1494,21 @@ struct game_drawstate {
     bool *errtmp;
 };
 
-static bool check_errors(const game_state *state, bool *errors)
+/*
+ * check_errors runs on every redraw, so like the latin solver's
+ * kernels it is instantiated with a constant width for the preset
+ * sizes.
+ */
+#if defined(__GNUC__)
+#define CHECK_KERNEL static inline __attribute__((always_inline))
+#else
+#define CHECK_KERNEL static inline
+#endif
+
+CHECK_KERNEL bool check_errors_w(const game_state *state, bool *errors,
+                                 const int w)
 {
-    int w = state->par.w, a = w*w, dep = state->par.dep;
+    int a = w*w, dep = state->par.dep;
     digit *grid = state->grid;
     int i, x, y;
     bool errs = false;
@@ -739,7 +1544,7 @@ static bool check_errors(const game_state *state, bool *errors)
 	    mask |= bit;
 	}
 
-	if (mask != (1 << (dep+1)) - (1L << 1)) {
+	if (mask != (1L << (dep+1)) - (1L << 1)) {
 	    errs = true;
 	    errmask &= ~1UL;
 	    if (errors) {
@@ -753,6 +1558,18 @@ static bool check_errors(const game_state *state, bool *errors)
     return errs;
 }
 
+static bool check_errors(const game_state *state, bool *errors)
+{
+    switch (state->par.w) {
+      case 5: return check_errors_w(state, errors, 5);
+      case 6: return check_errors_w(state, errors, 6);
+      case 7: return check_errors_w(state, errors, 7);
+      case 8: return check_errors_w(state, errors, 8);
+      case 9: return check_errors_w(state, errors, 9);
+      default: return check_errors_w(state, errors, state->par.w);
+    }
+}
+
 static char *interpret_move(const game_state *state, game_ui *ui,
                             const game_drawstate *ds,
                             int x, int y, int button)
@@ -850,9 +1667,65 @@ static char *interpret_move(const game_state *state, game_ui *ui,
     if (button == 'M' || button == 'm')
         return dupstr("M");
 
+    if (button == 'A' || button == 'a')
+        return dupstr("A");
+
     return NULL;
 }
 
+/*
+ * Auto-candidates. When the player turns this on, the pencil marks in
+ * each open cell are kept to the digits not yet in its row or column,
+ * as the solver's elimination starts from. A move only changes one
+ * cell, so only that cell's row and column need looking at again:
+ * the digit it gained is struck from their marks, and the digit it
+ * lost goes back wherever nothing else now rules it out. Marks the
+ * player has taken out by hand stay out unless that happens.
+ */
+static long cand_mask(const game_state *state, int x, int y)
+{
+    int w = state->par.w, dep = state->par.dep, pos = y*w+x, i;
+    long mask;
+
+    if (state->grid[pos] || state->forbid[pos] || state->clues->forbid[pos])
+	return 0;
+    mask = (1L << (dep+1)) - (1L << 1);
+    for (i = 0; i < w; i++)
+	mask &= ~((1L << state->grid[y*w+i]) | (1L << state->grid[i*w+x]));
+    return mask;
+}
+
+static void cand_refresh(game_state *state, int x, int y, int old, int n)
+{
+    int w = state->par.w, pos = y*w+x;
+
+    if (state->grid[pos] || state->forbid[pos] || state->clues->forbid[pos])
+	return;
+    if (n)
+	state->pencil[pos] &= ~(1L << n);
+    if (old && (cand_mask(state, x, y) & (1L << old)))
+	state->pencil[pos] |= 1L << old;
+}
+
+/*
+ * Bring the marks up to date after a move on (x,y), which held old
+ * before it.
+ */
+static void cand_update(game_state *state, int x, int y, int old)
+{
+    int w = state->par.w, n = state->grid[y*w+x], i;
+
+    state->pencil[y*w+x] = cand_mask(state, x, y);
+    if (n == old)
+	return;
+    for (i = 0; i < w; i++) {
+	if (i != x)
+	    cand_refresh(state, i, y, old, n);
+	if (i != y)
+	    cand_refresh(state, x, i, old, n);
+    }
+}
+
 static game_state *execute_move(const game_state *from, const char *move)
 {
     int w = from->par.w, a = w*w, dep = from->par.dep;
@@ -890,6 +1763,8 @@ static game_state *execute_move(const game_state *from, const char *move)
 			if(n == 0)
 				ret->impose[y*w+x] = false;
             ret->pencil[y*w+x] = 0;
+	    if (ret->autocand)
+		cand_update(ret, x, y, from->grid[y*w+x]);
 
             if (!ret->completed && !check_errors(ret, NULL))
                 ret->completed = true;
@@ -900,13 +1775,25 @@ static game_state *execute_move(const game_state *from, const char *move)
 	 * Fill in absolutely all pencil marks everywhere. (I
 	 * wouldn't use this for actual play, but it's a handy
 	 * starting point when following through a set of
-	 * diagnostics output by the standalone solver.)
+	 * diagnostics output by the standalone solver.) With
+	 * auto-candidates on, fill in just the candidates.
 	 */
 	for (i = 0; i < a; i++) {
-	    if (!ret->grid[i] && !ret->clues->forbid[i])
-		ret->pencil[i] = (1L << (w+1)) - (1L << 1);
+	    if (ret->autocand)
+		ret->pencil[i] = cand_mask(ret, i % w, i / w);
+	    else if (!ret->grid[i] && !ret->clues->forbid[i])
+		ret->pencil[i] = (1L << (dep+1)) - (1L << 1);
 	}
 	return ret;
+    } else if (move[0] == 'A' && !move[1]) {
+	/*
+	 * Toggle auto-candidates, starting it from the full set.
+	 */
+	ret->autocand = !ret->autocand;
+	if (ret->autocand)
+	    for (i = 0; i < a; i++)
+		ret->pencil[i] = cand_mask(ret, i % w, i / w);
+	return ret;
     } else if((move[0] == 'X' || move[0] == 'O') && 
 			  sscanf(move+1, "%d,%d", &x, &y) == 2 &&
 			  x >= 0 && x < w && y >= 0 && y < w) {
@@ -916,11 +1803,15 @@ static game_state *execute_move(const game_state *from, const char *move)
 			ret->pencil[y*w+x] = 0;
 			ret->impose[y*w+x] = false;
 			ret->forbid[y*w+x] = !ret->forbid[y*w+x];
+			if(ret->autocand)
+				cand_update(ret, x, y, from->grid[y*w+x]);
 		}
 		else if(move[0] == 'O')
 		{
 			ret->forbid[y*w+x] = false;
 			ret->impose[y*w+x] = !ret->impose[y*w+x];
+			if(ret->autocand && from->forbid[y*w+x])
+				cand_update(ret, x, y, 0);
 		}
 		return ret;
 	}
@@ -1416,17 +2307,89 @@ const struct game thegame = {
 
 #ifdef STANDALONE_SOLVER
 
-#include <stdarg.h>
+/*
+ * Trace sink which hands each event to both the pretty-printer and
+ * the binary writer, for when -v and -t are both given.
+ */
+struct trace_both {
+    struct latin_trace_printer *printer;
+    struct latin_trace_buffer *buffer;
+};
+
+static void trace_both(void *vctx, const struct latin_solver_event *ev)
+{
+    struct trace_both *ctx = (struct trace_both *)vctx;
+    latin_trace_print(ctx->printer, ev);
+    latin_trace_write(ctx->buffer, ev);
+}
+
+/*
+ * Pretty-print a binary trace file written by -t.
+ */
+static int print_trace_file(const char *quis, const char *filename)
+{
+    struct latin_trace_buffer buf;
+    struct latin_trace_printer printer;
+    struct latin_solver_event ev;
+    FILE *fp;
+    int pos = 0, c;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: %s: unable to open\n", quis, filename);
+        return 1;
+    }
+    latin_trace_buffer_init(&buf);
+    while ((c = fgetc(fp)) != EOF) {
+        if (buf.len >= buf.size) {
+            buf.size = buf.size * 3 / 2 + 4096;
+            buf.data = sresize(buf.data, buf.size, unsigned char);
+        }
+        buf.data[buf.len++] = c;
+    }
+    fclose(fp);
+
+    printer.fp = stdout;
+    printer.verbose = 1;
+    printer.pending = 0;
+    while (pos < buf.len) {
+        if (!latin_trace_read(&buf, &pos, &ev)) {
+            fprintf(stderr, "%s: %s: corrupt trace\n", quis, filename);
+            latin_trace_buffer_free(&buf);
+            return 1;
+        }
+        latin_trace_print(&printer, &ev);
+    }
+    latin_trace_buffer_free(&buf);
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
     game_params *p;
     game_state *s;
     char *id = NULL, *desc;
-    const char *err;
-    bool grade = false;
-    int ret, diff;
+    const char *err, *tracefile = NULL;
+    bool grade = false, show_stats = false, count = false;
+    int ret, nthreads = 1;
+    int progress[DIFFCOUNT];
+    double score;
     bool really_show_working = false;
+    struct latin_solver_stats stats;
+    struct solver_options opts;
+    struct latin_solver_budget budget;
+    struct latin_trace_printer printer;
+    struct latin_trace_buffer buffer;
+    struct trace_both both;
+    struct latin_solver_tt *tt = NULL;
+    size_t ttbytes = 0;
+    struct latin_solver_search search;
+    int branch = LATIN_BRANCH_FIRST;
+    long restart_unit = 0;
+    random_state *rs = NULL;
+    const char *quis = argv[0];
+
+    memset(&budget, 0, sizeof(budget));
 
     while (--argc > 0) {
         char *p = *++argv;
@@ -1434,8 +2397,66 @@ int main(int argc, char **argv)
             really_show_working = true;
         } else if (!strcmp(p, "-g")) {
             grade = true;
+        } else if (!strcmp(p, "-s")) {
+            show_stats = true;
+        } else if (!strcmp(p, "-c")) {
+            count = true;
+        } else if (!strcmp(p, "-j") && argc > 1) {
+            nthreads = atoi(*++argv);
+            argc--;
+            if (nthreads < 1) {
+                fprintf(stderr, "%s: -j expects a positive thread count\n",
+                        quis);
+                return 1;
+            }
+#ifndef LATIN_THREADS
+            if (nthreads > 1) {
+                fprintf(stderr, "%s: -j %d: built without LATIN_THREADS\n",
+                        quis, nthreads);
+                return 1;
+            }
+#endif
+        } else if (!strcmp(p, "-t") && argc > 1) {
+            tracefile = *++argv;
+            argc--;
+        } else if (!strcmp(p, "-N") && argc > 1) {
+            budget.maxnodes = atol(*++argv);
+            argc--;
+        } else if (!strcmp(p, "-T") && argc > 1) {
+            budget.maxtime = atof(*++argv);
+            argc--;
+        } else if (!strcmp(p, "-H") && argc > 1) {
+            char *end;
+            double mb = strtod(*++argv, &end);
+            argc--;
+            /* The negation also catches NaN. */
+            if (end == *argv || *end || !(mb >= 0) ||
+                mb >= (double)(size_t)-1 / 1048576.0) {
+                fprintf(stderr, "%s: -H expects a number of megabytes, "
+                        "not `%s'\n", quis, *argv);
+                return 1;
+            }
+            ttbytes = (size_t)(mb * 1048576.0);
+        } else if (!strcmp(p, "-b") && argc > 1) {
+            p = *++argv;
+            argc--;
+            for (branch = 0; branch < LATIN_NBRANCH; branch++)
+                if (!strcmp(p, latin_branch_name(branch)))
+                    break;
+            if (branch == LATIN_NBRANCH) {
+                fprintf(stderr, "%s: unknown branching heuristic `%s'\n",
+                        quis, p);
+                return 1;
+            }
+        } else if (!strcmp(p, "-R") && argc > 1) {
+            restart_unit = atol(*++argv);
+            argc--;
+            if (!rs)
+                rs = random_new("numberball", 10);
+        } else if (!strcmp(p, "-r") && argc > 1) {
+            return print_trace_file(quis, *++argv);
         } else if (*p == '-') {
-            fprintf(stderr, "%s: unrecognised option `%s'\n", argv[0], p);
+            fprintf(stderr, "%s: unrecognised option `%s'\n", quis, p);
             return 1;
         } else {
             id = p;
@@ -1443,13 +2464,18 @@ int main(int argc, char **argv)
     }
 				   
     if (!id) {
-        fprintf(stderr, "usage: %s [-g | -v] <game_id>\n", argv[0]);
+        fprintf(stderr, "usage: %s [-g | -v] [-s] [-t tracefile] "
+                "[-N maxnodes] [-T maxseconds] [-H megabytes]\n"
+                "       [-b first|degree|domwdeg] [-R restartunit] "
+                "<game_id>\n"
+                "       %s -c [-j threads] <game_id>\n"
+                "       %s -r tracefile\n", quis, quis, quis);
         return 1;
     }
 
     desc = strchr(id, ':');
     if (!desc) {
-        fprintf(stderr, "%s: game id expects a colon in it\n", argv[0]);
+        fprintf(stderr, "%s: game id expects a colon in it\n", quis);
         return 1;
     }
     *desc++ = '\0';
@@ -1458,54 +2484,2340 @@ int main(int argc, char **argv)
     decode_params(p, id);
     err = validate_desc(p, desc);
     if (err) {
-        fprintf(stderr, "%s: %s\n", argv[0], err);
+        fprintf(stderr, "%s: %s\n", quis, err);
         return 1;
     }
     s = new_game(NULL, p, desc);
 
+    if (count) {
+	unsigned long long n;
+
+	/* The exact number of solutions, however many there are. */
+	if (!latin_count(s->clues->immutable, p->w, p->dep,
+			 s->clues->impose, s->clues->forbid, nthreads, &n)) {
+	    fprintf(stderr, "%s: puzzle too large to count\n", quis);
+	    return 1;
+	}
+	if (n == ULLONG_MAX)
+	    printf("Completions: at least %llu\n", n);
+	else
+	    printf("Completions: %llu\n", n);
+	return 0;
+    }
+
+    if (ttbytes)
+	tt = latin_solver_tt_new(p->w, ttbytes, LATIN_TT_REPLACE_WORK);
+
     /*
-     * When solving an Easy puzzle, we don't want to bother the
-     * user with Hard-level deductions. For this reason, we grade
-     * the puzzle internally before doing anything else.
+     * One run grades the puzzle: the solver escalates through the
+     * tiers only as each easier one gets stuck, so an Easy puzzle
+     * still gets only Easy deductions, and the working shown by -v is
+     * that of the grading run itself.
      */
-    ret = -1;			       /* placate optimiser */
-    solver_show_working = 0;
-    for (diff = 0; diff < DIFFCOUNT; diff++) {
-	memcpy(s->grid, s->clues->immutable, p->w * p->w);
-	ret = solver(s->grid, s->clues->impose, s->clues->forbid, p->w, p->dep, diff);
-	if (ret <= diff)
-	    break;
+    memset(&opts, 0, sizeof(opts));
+    memset(&stats, 0, sizeof(stats));
+    opts.stats = &stats;
+    opts.budget = &budget;
+    opts.tt = tt;
+    latin_solver_search_init(&search, p->w, branch, rs, restart_unit);
+    opts.search = &search;
+    opts.progress = progress;
+    opts.score = &score;
+
+    printer.fp = stdout;
+    printer.verbose = 1;
+    printer.pending = 0;
+    latin_trace_buffer_init(&buffer);
+    both.printer = &printer;
+    both.buffer = &buffer;
+    if (really_show_working && tracefile) {
+        opts.trace = trace_both;
+        opts.tracectx = &both;
+    } else if (really_show_working) {
+        opts.trace = latin_trace_print;
+        opts.tracectx = &printer;
+    } else if (tracefile) {
+        opts.trace = latin_trace_write;
+        opts.tracectx = &buffer;
     }
 
-    if (really_show_working) {
-        /*
-         * Now run the solver again at the last difficulty level we
-         * tried, but this time with diagnostics enabled.
-         */
-        solver_show_working = really_show_working;
-        memcpy(s->grid, s->clues->immutable, p->w * p->w);
-        ret = solver(s->grid, s->clues->impose, s->clues->forbid, p->w, p->dep,
-                     diff < DIFFCOUNT ? diff : DIFFCOUNT-1);
+    memcpy(s->grid, s->clues->immutable, p->w * p->w);
+    ret = solver_ex(s->grid, s->clues->impose, s->clues->forbid,
+                    p->w, p->dep, DIFF_UNREASONABLE, &opts);
+
+    if (tracefile) {
+        FILE *fp = fopen(tracefile, "wb");
+        bool ok = fp && fwrite(buffer.data, 1, buffer.len, fp) ==
+            (size_t)buffer.len;
+        if (fp && fclose(fp))
+            ok = false;
+        if (!ok) {
+            fprintf(stderr, "%s: %s: unable to write trace\n",
+                    quis, tracefile);
+            return 1;
+        }
     }
+    latin_trace_buffer_free(&buffer);
 
-    if (diff == DIFFCOUNT) {
+    if (ret == diff_exhausted) {
+	printf("Solver gave up after %ld guesses\n", budget.nodes);
+    } else if (ret == diff_ambiguous) {
 	if (grade)
 	    printf("Difficulty rating: ambiguous\n");
 	else
 	    printf("Unable to find a unique solution\n");
+    } else if (ret == diff_impossible) {
+	if (grade)
+	    printf("Difficulty rating: impossible (no solution exists)\n");
+	else
+	    printf("Puzzle is inconsistent\n");
     } else {
 	if (grade) {
-	    if (ret == diff_impossible)
-		printf("Difficulty rating: impossible (no solution exists)\n");
-	    else
-		printf("Difficulty rating: %s\n", numberball_diffnames[ret]);
-	} else {
-	    if (ret != diff)
-		printf("Puzzle is inconsistent\n");
-	    else
-		fputs(game_text_format(s), stdout);
-	}
+	    printf("Difficulty rating: %s\n", numberball_diffnames[ret]);
+	    printf("Difficulty score: %.1f\n", score);
+	} else
+	    fputs(game_text_format(s), stdout);
+    }
+
+    if (show_stats) {
+	int i;
+
+	/* These are from the grading run. */
+	printf("%-28s %8s %10s %12s\n", "Technique", "Steps",
+	       "Placements", "Eliminations");
+	for (i = 0; i < LATIN_NTECH; i++)
+	    printf("%-28s %8ld %10ld %12ld\n", latin_technique_name(i),
+		   stats.steps[i], stats.placements[i], stats.eliminations[i]);
+	printf("Recursion: %ld nodes, maximum depth %d\n",
+	       stats.nodes, stats.maxdepth);
+	if (restart_unit)
+	    printf("Restarts: %ld\n", search.restarts);
+	if (tt)
+	    printf("Transposition table hits: %ld\n", stats.tthits);
+	printf("Grid passes: %ld\n", stats.rescans);
+	for (i = 0; i < DIFFCOUNT; i++)
+	    printf("Time in %s tier: %.6fs\n", numberball_diffnames[i],
+		   stats.tiertime[i]);
+	for (i = 0; i < DIFFCOUNT; i++)
+	    if (progress[i] >= 0)
+		printf("Cells decided on reaching %s tier: %d of %d\n",
+		       numberball_diffnames[i], progress[i], p->w * p->w);
+	for (i = DIFF_EASY + 1; i < DIFFCOUNT; i++)
+	    if (stats.stalls[i])
+		printf("Turned to %s tier: %ld times, %.1f candidates "
+		       "open on average\n", numberball_diffnames[i],
+		       stats.stalls[i],
+		       (double)stats.frontier[i] / stats.stalls[i]);
+	printf("Difficulty score: %.1f\n", score);
+    }
+
+    latin_solver_search_free(&search);
+    if (rs)
+        random_free(rs);
+    latin_solver_tt_free(tt);
+    return 0;
+}
+
+#endif
+
+#if defined(STANDALONE_DEDUP) || defined(STANDALONE_SERVER)
+
+#include <stdint.h>
+
+/*
+ * Canonical forms of clue sets.
+ *
+ * Two puzzles are the same for our purposes if one can be turned into
+ * the other by permuting rows, permuting columns, transposing and
+ * relabelling the numbers 1..dep, since none of those changes how the
+ * puzzle plays (make_isotope uses exactly these). We take as canonical
+ * the lexicographically least row-major string of cell symbols over
+ * that whole group, where '.' < 'O' < 'X' < numbers, and the numbers
+ * are labelled in the order they first appear - which is the least
+ * relabelling of any given arrangement.
+ *
+ * The search fixes rows one at a time. After each row the columns fall
+ * into blocks which no row so far can tell apart, so each new row is
+ * at its least by sorting within each block; only rows which tie for
+ * the least string are tried, and a branch is dropped as soon as its
+ * prefix compares worse than the best found. The remaining freedom is
+ * which of the numbers appearing for the first time in a block gets
+ * which label, and we branch on that. Identical rows are
+ * interchangeable, so only the first unused one of them is tried.
+ */
+
+#define CANON_FRESH 255		/* sorts after every real symbol */
+
+struct canon_ctx {
+    int w, dep;
+    const unsigned char *sym;	/* w*w cells: 0 '.', 1 'O', 2 'X', 2+n */
+    bool transpose;
+    int *dup;			/* w: earlier identical row, or -1 */
+    bool *used;			/* w: rows already placed */
+
+    /* State at each depth of the search, w+1 copies of each. */
+    int *order;			/* w: column order */
+    unsigned char *start;	/* w: true where a block of columns starts */
+    unsigned char *map;		/* dep+1: label given to n, or 0 */
+    int *nextlabel;		/* 1: next label to hand out */
+    unsigned char *rows;	/* w*w: each row's least string */
+    int *cols;			/* w*w: a column order giving it */
+
+    unsigned char *best;	/* w*w: least string found so far */
+    int have;			/* rows of best which are filled in */
+    long nodes;
+};
+
+#define CSYM(ctx, r, c) ((ctx)->transpose ? \
+                         (ctx)->sym[(c)*(ctx)->w+(r)] : \
+                         (ctx)->sym[(r)*(ctx)->w+(c)])
+
+/*
+ * Work out the least string row r can give at depth d, and a column
+ * order which gives it. Numbers seen for the first time come last in
+ * their blocks and take the next free labels in turn.
+ */
+static void canon_row(struct canon_ctx *ctx, int d, int r,
+                      unsigned char *out, int *cols)
+{
+    int w = ctx->w, i, j, s, e;
+    const int *order = ctx->order + d*w;
+    const unsigned char *start = ctx->start + d*w;
+    const unsigned char *map = ctx->map + d*(ctx->dep+1);
+    int fresh = ctx->nextlabel[d];
+
+    for (s = 0; s < w; s = e) {
+        for (e = s+1; e < w && !start[e]; e++);
+        for (i = s; i < e; i++) {
+            int c = order[i], v = CSYM(ctx, r, c);
+            if (v > 2)
+                v = map[v-2] ? 2 + map[v-2] : CANON_FRESH;
+            for (j = i; j > s && out[j-1] > v; j--) {
+                out[j] = out[j-1];
+                cols[j] = cols[j-1];
+            }
+            out[j] = v;
+            cols[j] = c;
+        }
+        for (i = s; i < e; i++)
+            if (out[i] == CANON_FRESH)
+                out[i] = 2 + fresh++;
+    }
+}
+
+static void canon_search(struct canon_ctx *ctx, int d);
+
+/*
+ * Row r has been chosen at depth d. Try each order of the columns
+ * holding new numbers in every block from position i on (each order
+ * labels those numbers differently), then search on from depth d+1.
+ */
+static void canon_branch(struct canon_ctx *ctx, int d, int r, int i)
+{
+    int w = ctx->w, dep = ctx->dep;
+    const unsigned char *out = ctx->rows + d*w*w + r*w;
+    int *cols = ctx->cols + d*w*w + r*w;
+    const unsigned char *start = ctx->start + d*w;
+    int first = ctx->nextlabel[d], j, k, e, t;
+
+    while (i < w && out[i] - 2 < first)
+        i++;
+
+    if (i == w) {
+        int *norder = ctx->order + (d+1)*w;
+        unsigned char *nstart = ctx->start + (d+1)*w;
+        unsigned char *nmap = ctx->map + (d+1)*(dep+1);
+        int next = first;
+
+        memcpy(norder, cols, w * sizeof(int));
+        memcpy(nmap, ctx->map + d*(dep+1), dep+1);
+        for (j = 0; j < w; j++) {
+            nstart[j] = (j == 0 || start[j] || out[j] != out[j-1]);
+            if (out[j] - 2 >= first) {
+                nmap[CSYM(ctx, r, cols[j]) - 2] = out[j] - 2;
+                next++;
+            }
+        }
+        ctx->nextlabel[d+1] = next;
+        canon_search(ctx, d+1);
+        return;
+    }
+
+    /* The new numbers run from i to the end of i's block. */
+    for (e = i+1; e < w && !start[e]; e++);
+    if (e == i+1) {
+        canon_branch(ctx, d, r, e);
+        return;
+    }
+
+    /* Put each in turn first, and order the rest recursively. Since
+     * the labels go by position, branching on position i+1 onwards
+     * happens in the recursive call, which skips nothing new: all of
+     * i+1..e-1 are still new numbers. */
+    for (k = i; k < e; k++) {
+        t = cols[i]; cols[i] = cols[k]; cols[k] = t;
+        canon_branch(ctx, d, r, i+1);
+        t = cols[i]; cols[i] = cols[k]; cols[k] = t;
+    }
+}
+
+static void canon_search(struct canon_ctx *ctx, int d)
+{
+    int w = ctx->w, r, cmp;
+    unsigned char *rows = ctx->rows + d*w*w, *least = NULL;
+
+    ctx->nodes++;
+    if (d == w)
+        return;
+
+    for (r = 0; r < w; r++) {
+        if (ctx->used[r] || (ctx->dup[r] >= 0 && !ctx->used[ctx->dup[r]]))
+            continue;
+        canon_row(ctx, d, r, rows + r*w, ctx->cols + d*w*w + r*w);
+        if (!least || memcmp(rows + r*w, least, w) < 0)
+            least = rows + r*w;
+    }
+
+    /*
+     * Every row before d matches best, so compare this one with best's
+     * row d. If it's better, everything in best from here on is stale.
+     */
+    if (d < ctx->have) {
+        cmp = memcmp(least, ctx->best + d*w, w);
+        if (cmp > 0)
+            return;
+        if (cmp < 0)
+            ctx->have = d;
+    }
+    if (d == ctx->have) {
+        memcpy(ctx->best + d*w, least, w);
+        ctx->have = d+1;
+    }
+
+    for (r = 0; r < w; r++) {
+        if (ctx->used[r] || (ctx->dup[r] >= 0 && !ctx->used[ctx->dup[r]]))
+            continue;
+        if (memcmp(rows + r*w, ctx->best + d*w, w))
+            continue;
+        ctx->used[r] = true;
+        canon_branch(ctx, d, r, 0);
+        ctx->used[r] = false;
+    }
+}
+
+/*
+ * Cell symbols of a clue set, as canon_ctx.sym wants them.
+ */
+static void clue_symbols(int w, const digit *grid, const bool *imp,
+                         const bool *forb, unsigned char *sym)
+{
+    int i;
+
+    for (i = 0; i < w*w; i++)
+        sym[i] = grid[i] ? 2 + grid[i] : forb[i] ? 2 : imp[i] ? 1 : 0;
+}
+
+/*
+ * True if the clues repeat a number in a row or column. No such puzzle
+ * can be solved, and canonical_clues relies on it not happening.
+ */
+static bool check_errors_clues(int w, const unsigned char *sym)
+{
+    int x, y, i;
+
+    for (y = 0; y < w; y++)
+        for (x = 0; x < w; x++)
+            for (i = 0; i < x; i++) {
+                if (sym[y*w+x] > 2 && sym[y*w+i] == sym[y*w+x])
+                    return true;   /* repeat in row y */
+                if (sym[x*w+y] > 2 && sym[i*w+y] == sym[x*w+y])
+                    return true;   /* repeat in column y */
+            }
+    return false;
+}
+
+/*
+ * Write the canonical form of a clue set's symbols into out (w*w
+ * bytes, in the same encoding), returning the number of search nodes
+ * it took. The clues must pass check_errors_clues.
+ */
+static long canonical_clues(int w, int dep, const unsigned char *sym,
+                            unsigned char *out)
+{
+    struct canon_ctx ctx;
+    int r, r2, c, t;
+
+    ctx.w = w;
+    ctx.dep = dep;
+    ctx.sym = sym;
+    ctx.dup = snewn(w, int);
+    ctx.used = snewn(w, bool);
+    ctx.order = snewn((w+1)*w, int);
+    ctx.start = snewn((w+1)*w, unsigned char);
+    ctx.map = snewn((w+1)*(dep+1), unsigned char);
+    ctx.nextlabel = snewn(w+1, int);
+    ctx.rows = snewn((w+1)*w*w, unsigned char);
+    ctx.cols = snewn((w+1)*w*w, int);
+    ctx.best = out;
+    ctx.have = 0;
+    ctx.nodes = 0;
+
+    for (t = 0; t < 2; t++) {
+        ctx.transpose = t;
+        for (r = 0; r < w; r++) {
+            ctx.used[r] = false;
+            ctx.dup[r] = -1;
+            for (r2 = 0; r2 < r && ctx.dup[r] < 0; r2++) {
+                for (c = 0; c < w; c++)
+                    if (CSYM(&ctx, r, c) != CSYM(&ctx, r2, c))
+                        break;
+                if (c == w)
+                    ctx.dup[r] = r2;
+            }
+            ctx.order[r] = r;
+            ctx.start[r] = (r == 0);
+        }
+        memset(ctx.map, 0, dep+1);
+        ctx.nextlabel[0] = 1;
+        canon_search(&ctx, 0);
+    }
+    assert(ctx.have == w);
+
+    sfree(ctx.dup);
+    sfree(ctx.used);
+    sfree(ctx.order);
+    sfree(ctx.start);
+    sfree(ctx.map);
+    sfree(ctx.nextlabel);
+    sfree(ctx.rows);
+    sfree(ctx.cols);
+    return ctx.nodes;
+}
+
+/* 64-bit FNV-1a, for hashing canonical forms and invariants. */
+#define FNV_BASIS 0xcbf29ce484222325ULL
+static uint64_t fnv_add(uint64_t h, unsigned v)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        h ^= (v >> (8*i)) & 0xFF;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Hash of a canonical form: equal for puzzles which are the same up to
+ * the symmetries above, and (with overwhelming likelihood) different
+ * otherwise.
+ */
+static uint64_t clues_hash(int w, int dep, const unsigned char *canon)
+{
+    uint64_t h = fnv_add(fnv_add(FNV_BASIS, w), dep);
+    int i;
+
+    for (i = 0; i < w*w; i++)
+        h = fnv_add(h, canon[i]);
+    return h;
+}
+
+#endif
+
+#ifdef STANDALONE_DEDUP
+
+#include <time.h>
+
+static int compare_ints(const void *av, const void *bv)
+{
+    int a = *(const int *)av, b = *(const int *)bv;
+    return a < b ? -1 : a > b ? +1 : 0;
+}
+
+/*
+ * A hash of some cheap properties which the symmetries can't change:
+ * the sorted clue counts of the rows and of the columns (taken in
+ * whichever order is smaller, to ignore transposition) and the sorted
+ * number of times each number is given. Puzzles with different
+ * invariants can't be the same, so only those which collide here need
+ * canonicalising.
+ */
+static uint64_t clues_invariant(int w, int dep, const unsigned char *sym)
+{
+    int *rows = snewn(w, int), *cols = snewn(w, int);
+    int *freq = snewn(dep, int), *first, *second;
+    uint64_t h = fnv_add(fnv_add(FNV_BASIS, w), dep);
+    int x, y, i;
+
+    memset(rows, 0, w * sizeof(int));
+    memset(cols, 0, w * sizeof(int));
+    memset(freq, 0, dep * sizeof(int));
+    for (y = 0; y < w; y++)
+        for (x = 0; x < w; x++) {
+            int v = sym[y*w+x];
+            /* Counts of O, X and numbers, packed base 64. */
+            int code = v == 0 ? 0 : v == 1 ? 1 : v == 2 ? 64 : 64*64;
+            rows[y] += code;
+            cols[x] += code;
+            if (v > 2)
+                freq[v-3]++;
+        }
+    qsort(rows, w, sizeof(int), compare_ints);
+    qsort(cols, w, sizeof(int), compare_ints);
+    qsort(freq, dep, sizeof(int), compare_ints);
+
+    first = rows;
+    second = cols;
+    for (i = 0; i < w; i++)
+        if (rows[i] != cols[i]) {
+            if (rows[i] > cols[i]) {
+                first = cols;
+                second = rows;
+            }
+            break;
+        }
+    for (i = 0; i < w; i++)
+        h = fnv_add(h, first[i]);
+    for (i = 0; i < w; i++)
+        h = fnv_add(h, second[i]);
+    for (i = 0; i < dep; i++)
+        h = fnv_add(h, freq[i]);
+
+    sfree(rows);
+    sfree(cols);
+    sfree(freq);
+    return h;
+}
+
+/*
+ * Parse a game ID into its size and cell symbols. Returns an error
+ * message, or NULL with *sym allocated.
+ */
+static const char *dedup_parse(const char *id, int *w, int *dep,
+                               unsigned char **sym)
+{
+    game_params *p;
+    game_state *s;
+    const char *desc = strchr(id, ':'), *err;
+    char *params;
+
+    if (!desc)
+        return "game id expects a colon in it";
+    params = snewn(desc - id + 1, char);
+    memcpy(params, id, desc - id);
+    params[desc - id] = '\0';
+    desc++;
+
+    p = default_params();
+    decode_params(p, params);
+    sfree(params);
+    err = validate_params(p, true);
+    if (!err)
+        err = validate_desc(p, desc);
+    if (err) {
+        free_params(p);
+        return err;
+    }
+
+    s = new_game(NULL, p, desc);
+    *w = p->w;
+    *dep = p->dep;
+    *sym = snewn(p->w * p->w, unsigned char);
+    clue_symbols(p->w, s->clues->immutable, s->clues->impose,
+                 s->clues->forbid, *sym);
+    free_game(s);
+    free_params(p);
+
+    if (check_errors_clues(*w, *sym)) {
+        sfree(*sym);
+        return "clues repeat a number in a row or column";
     }
+    return NULL;
+}
+
+struct dedup_entry {
+    char *id;
+    int index;
+    int dupof;			/* index of an earlier copy, or -1 */
+    uint64_t inv, hash;
+    int w, dep;
+    unsigned char *canon;	/* canonical form, once hashed */
+};
+
+static int compare_by_inv(const void *av, const void *bv)
+{
+    const struct dedup_entry *a = *(const struct dedup_entry *const *)av;
+    const struct dedup_entry *b = *(const struct dedup_entry *const *)bv;
+    if (a->inv != b->inv)
+        return a->inv < b->inv ? -1 : +1;
+    return a->index < b->index ? -1 : a->index > b->index ? +1 : 0;
+}
+
+static int compare_by_hash(const void *av, const void *bv)
+{
+    const struct dedup_entry *a = *(const struct dedup_entry *const *)av;
+    const struct dedup_entry *b = *(const struct dedup_entry *const *)bv;
+    if (a->hash != b->hash)
+        return a->hash < b->hash ? -1 : +1;
+    return a->index < b->index ? -1 : a->index > b->index ? +1 : 0;
+}
+
+/*
+ * Fill in an entry's canonical form and hash, returning the search
+ * nodes used.
+ */
+static long dedup_hash(struct dedup_entry *e)
+{
+    unsigned char *sym;
+    long nodes;
+
+    dedup_parse(e->id, &e->w, &e->dep, &sym);
+    e->canon = snewn(e->w * e->w, unsigned char);
+    nodes = canonical_clues(e->w, e->dep, sym, e->canon);
+    e->hash = clues_hash(e->w, e->dep, e->canon);
+    sfree(sym);
+    return nodes;
+}
+
+/*
+ * True if two hashed entries are the same puzzle. Equal hashes almost
+ * always mean that, but a collision mustn't lose a puzzle.
+ */
+static bool dedup_same(const struct dedup_entry *a,
+                       const struct dedup_entry *b)
+{
+    return a->hash == b->hash && a->w == b->w && a->dep == b->dep &&
+        !memcmp(a->canon, b->canon, a->w * a->w);
+}
+
+/*
+ * Self-check, run by -t. On random clue sets (puzzles or not), every
+ * isotope must have the same canonical form, invariant and hash as
+ * the original, and a canonical form must be its own canonical form;
+ * while clearing a clue must change the canonical form. Returns the
+ * number of failures, having reported them.
+ */
+static int dedup_selftest(void)
+{
+    random_state *rs = random_new("dedup", 5);
+    int fails = 0, sets = 0, w, dep, t, i, k;
+
+    for (w = 4; w <= 9; w++)
+        for (dep = 1; dep <= (w+1)/2; dep++)
+            for (t = 0; t < 10; t++) {
+                int a = w*w, pclue = t * 10;
+                digit *soln = latin_generate_partial(w, dep, rs);
+                digit *grid = snewn(a, digit), *igrid = snewn(a, digit);
+                digit *isoln = snewn(a, digit);
+                bool *imp = snewn(a, bool), *forb = snewn(a, bool);
+                bool *iimp = snewn(a, bool), *iforb = snewn(a, bool);
+                unsigned char *sym = snewn(a, unsigned char);
+                unsigned char *canon = snewn(a, unsigned char);
+                unsigned char *other = snewn(a, unsigned char);
+                const char *err = NULL;
+
+                for (i = 0; i < a; i++) {
+                    int r = random_upto(rs, 100);
+                    grid[i] = r < pclue ? soln[i] : 0;
+                    imp[i] = !grid[i] && soln[i] && r < 2*pclue;
+                    forb[i] = !soln[i] && r < 2*pclue;
+                }
+                clue_symbols(w, grid, imp, forb, sym);
+                canonical_clues(w, dep, sym, canon);
+
+                canonical_clues(w, dep, canon, other);
+                if (memcmp(canon, other, a))
+                    err = "canonical form is not its own canonical form";
+
+                for (k = 0; k < 5 && !err; k++) {
+                    make_isotope(w, dep, rs, grid, imp, forb, soln,
+                                 igrid, iimp, iforb, isoln);
+                    clue_symbols(w, igrid, iimp, iforb, sym);
+                    canonical_clues(w, dep, sym, other);
+                    if (memcmp(canon, other, a))
+                        err = "isotope has a different canonical form";
+                    else if (clues_invariant(w, dep, sym) !=
+                             clues_invariant(w, dep, canon))
+                        err = "isotope has a different invariant";
+                    else if (clues_hash(w, dep, other) !=
+                             clues_hash(w, dep, canon))
+                        err = "isotope has a different hash";
+                }
+
+                for (i = 0; i < a && !err; i++)
+                    if (grid[i]) {
+                        grid[i] = 0;
+                        clue_symbols(w, grid, imp, forb, sym);
+                        canonical_clues(w, dep, sym, other);
+                        if (!memcmp(canon, other, a))
+                            err = "clearing a clue kept the canonical form";
+                        break;
+                    }
+
+                if (err) {
+                    printf("%dx%d, %d%% clues: %s\n", w, dep, pclue, err);
+                    fails++;
+                }
+                sets++;
+
+                sfree(soln);
+                sfree(grid);
+                sfree(igrid);
+                sfree(isoln);
+                sfree(imp);
+                sfree(forb);
+                sfree(iimp);
+                sfree(iforb);
+                sfree(sym);
+                sfree(canon);
+                sfree(other);
+            }
+
+    printf("canonical forms: %s (%d clue sets)\n", fails ? "FAILED" : "ok",
+           sets);
+    random_free(rs);
+    return fails;
+}
+
+int main(int argc, char **argv)
+{
+    struct dedup_entry *entries = NULL, **sorted;
+    const char *quis = argv[0];
+    int n = 0, size = 0, lineno = 0, distinct, hashed = 0, i, j, k;
+    bool show_dups = false, show_hashes = false, verbose = false;
+    long nodes = 0;
+    clock_t start = clock();
+    char *line;
+
+    while (--argc > 0) {
+        char *p = *++argv;
+        if (!strcmp(p, "-d")) {
+            show_dups = true;
+        } else if (!strcmp(p, "-c")) {
+            show_hashes = true;
+        } else if (!strcmp(p, "-v")) {
+            verbose = true;
+        } else if (!strcmp(p, "-t")) {
+            return dedup_selftest() ? 1 : 0;
+        } else {
+            fprintf(stderr, "usage: %s [-d | -c] [-v] < game_ids\n"
+                    "       %s -t\n"
+                    "  prints each distinct puzzle once, in input order\n"
+                    "  -d  print each repeat and its first occurrence\n"
+                    "  -c  print every puzzle with its canonical hash\n"
+                    "  -v  report statistics on stderr\n"
+                    "  -t  check canonical forms on random clue sets\n",
+                    quis, quis);
+            return 1;
+        }
+    }
+
+    while ((line = fgetline(stdin)) != NULL) {
+        unsigned char *sym;
+        const char *err;
+        int w, dep;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!*line) {
+            sfree(line);
+            continue;
+        }
+        err = dedup_parse(line, &w, &dep, &sym);
+        if (err) {
+            fprintf(stderr, "line %d: %s\n", lineno, err);
+            sfree(line);
+            continue;
+        }
+        if (n >= size) {
+            size = size * 3 / 2 + 1024;
+            entries = sresize(entries, size, struct dedup_entry);
+        }
+        entries[n].id = line;
+        entries[n].index = n;
+        entries[n].dupof = -1;
+        entries[n].inv = clues_invariant(w, dep, sym);
+        entries[n].hash = 0;
+        entries[n].canon = NULL;
+        sfree(sym);
+        n++;
+    }
+
+    /*
+     * Group by invariant, and canonicalise only the groups with more
+     * than one member (or everything, if we're printing hashes).
+     */
+    sorted = snewn(n, struct dedup_entry *);
+    for (i = 0; i < n; i++)
+        sorted[i] = &entries[i];
+    qsort(sorted, n, sizeof(*sorted), compare_by_inv);
+    for (i = 0; i < n; i = j) {
+        for (j = i+1; j < n && sorted[j]->inv == sorted[i]->inv; j++);
+        if (j - i < 2 && !show_hashes)
+            continue;
+        for (k = i; k < j; k++) {
+            nodes += dedup_hash(sorted[k]);
+            hashed++;
+        }
+        qsort(sorted + i, j - i, sizeof(*sorted), compare_by_hash);
+        for (k = i+1; k < j; k++) {
+            int m;
+            /* Look back through the run of equal hashes for a match. */
+            for (m = k-1; m >= i && sorted[m]->hash == sorted[k]->hash; m--)
+                if (dedup_same(sorted[m], sorted[k])) {
+                    sorted[k]->dupof = (sorted[m]->dupof >= 0 ?
+                                        sorted[m]->dupof : sorted[m]->index);
+                    break;
+                }
+        }
+    }
+
+    distinct = 0;
+    for (i = 0; i < n; i++) {
+        struct dedup_entry *e = &entries[i];
+        if (e->dupof < 0)
+            distinct++;
+        if (show_hashes)
+            printf("%016llx %s\n", (unsigned long long)e->hash, e->id);
+        else if (show_dups) {
+            if (e->dupof >= 0)
+                printf("%s\t%s\n", e->id, entries[e->dupof].id);
+        } else if (e->dupof < 0)
+            printf("%s\n", e->id);
+    }
+
+    if (verbose)
+        fprintf(stderr, "%d puzzles, %d distinct; canonicalised %d "
+                "(%ld search nodes) in %.2fs\n", n, distinct, hashed, nodes,
+                (double)(clock() - start) / CLOCKS_PER_SEC);
+
+    for (i = 0; i < n; i++) {
+        sfree(entries[i].id);
+        sfree(entries[i].canon);
+    }
+    sfree(entries);
+    sfree(sorted);
+    return 0;
+}
+
+#endif
+
+#ifdef STANDALONE_SERVER
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/*
+ * A long-running server for generating, solving and grading puzzles,
+ * so that a web backend needn't start a process for each one. It
+ * listens on a UNIX domain socket, and each request is a line
+ *
+ *   <tag> GENERATE <params> [seed=<text>] [deadline=<ms>]
+ *   <tag> SOLVE <game id> [deadline=<ms>]
+ *   <tag> GRADE <game id> [deadline=<ms>]
+ *   <tag> CANON <game id>
+ *
+ * answered by one of
+ *
+ *   <tag> OK <game id> <solution>	 for GENERATE
+ *   <tag> OK <solution>		 for SOLVE, as solve_game gives it
+ *   <tag> OK <difficulty> <score>	 for GRADE, as the solver's -g says
+ *   <tag> OK <hash>			 for CANON, as the dedup tool's -c says
+ *   <tag> ERR <message>
+ *
+ * A client may send requests without waiting. They are shared among a
+ * pool of worker threads and each reply is sent when it's ready, so
+ * not necessarily in order; the tag, any word the client likes, says
+ * which request it answers. Once a client has SERVER_MAX_JOBS requests
+ * queued or in progress, the server reads no more from it until some
+ * of those are answered.
+ *
+ * A deadline counts from when the request was read. A request still
+ * queued when its deadline passes is answered without being started,
+ * and one in progress gives up at it. Without a deadline, solving and
+ * grading stop after SOLVE_MAX_TIME as they do in the game.
+ *
+ * Each worker keeps its random state, and a transposition table for
+ * the kind of puzzle it last solved, from one request to the next.
+ */
+
+#define SERVER_MAX_LINE 65536
+#define SERVER_MAX_WORDS 8
+#define SERVER_TT_BYTES (4 << 20)
+#define SERVER_SEND_TIMEOUT 10	       /* seconds */
+#define SERVER_MAX_JOBS 64	       /* in flight per client */
+
+struct server_conn {
+    int fd;
+    pthread_mutex_t lock;	       /* for writing */
+    bool dead;			       /* stopped taking replies */
+    int jobs;			       /* queued or running } under the */
+    bool reading;		       /* the reader has it } server lock */
+    bool paused;		       /* reader not polling, lines waiting */
+    char *buf;			       /* partial line, for the reader */
+    int len, size;
+};
+
+struct server_job {
+    struct server_conn *conn;
+    char *line;
+    double received;
+    struct server_job *next;
+};
+
+struct server {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct server_job *head, *tail;
+    int wakefd[2];		       /* workers wake the reader by this */
+    pthread_mutex_t reuse_lock;	       /* base_cache in generate_desc */
+};
+
+struct server_worker {
+    struct server *srv;
+    pthread_t thread;
+    random_state *rs;
+    struct latin_solver_tt *tt;
+    int ttw, ttdep;
+};
+
+static double server_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Let go of a client, for the reader or for one of its jobs, freeing
+ * it when nothing has it. A job ending wakes the reader if that makes
+ * room for a paused client.
+ */
+static void server_release(struct server *srv, struct server_conn *conn,
+			   bool job)
+{
+    bool wake = false, last;
+
+    pthread_mutex_lock(&srv->lock);
+    if (job)
+	wake = (conn->jobs-- == SERVER_MAX_JOBS && conn->reading);
+    else
+	conn->reading = false;
+    last = (!conn->reading && !conn->jobs);
+    pthread_mutex_unlock(&srv->lock);
+
+    if (wake)
+	while (write(srv->wakefd[1], "", 1) < 0 && errno == EINTR)
+	    ;
+    if (last) {
+	close(conn->fd);
+	pthread_mutex_destroy(&conn->lock);
+	sfree(conn->buf);
+	sfree(conn);
+    }
+}
+
+/*
+ * Send one reply line, whole. A client which has gone away just
+ * doesn't get it. Sends time out after SERVER_SEND_TIMEOUT, so that a
+ * client which stops reading its replies can't hold up the workers
+ * waiting for its lock: it is cut off instead, and the reader then
+ * sees it go.
+ */
+static void server_reply(struct server_conn *conn, const char *tag,
+			 const char *status, const char *text)
+{
+    int len = strlen(tag) + strlen(status) + strlen(text) + 3, done = 0;
+    char *line = snewn(len + 1, char);
+
+    sprintf(line, "%s %s %s\n", tag, status, text);
+    pthread_mutex_lock(&conn->lock);
+    while (!conn->dead && done < len) {
+	ssize_t ret = send(conn->fd, line + done, len - done, MSG_NOSIGNAL);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret <= 0) {
+	    conn->dead = true;
+	    shutdown(conn->fd, SHUT_RDWR);
+	    break;
+	}
+	done += ret;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    sfree(line);
+}
+
+/*
+ * Split a game id and set up a game from it, or return an error.
+ */
+static const char *server_game(char *id, game_params **pp, game_state **sp)
+{
+    char *desc = strchr(id, ':');
+    const char *err;
+
+    if (!desc)
+	return "game id expects a colon in it";
+    *desc++ = '\0';
+    *pp = default_params();
+    err = decode_params_strict(*pp, id) ? validate_params(*pp, false) :
+	"malformed game parameters";
+    if (!err)
+	err = validate_desc(*pp, desc);
+    if (err) {
+	free_params(*pp);
+	return err;
+    }
+    *sp = new_game(NULL, *pp, desc);
+    return NULL;
+}
+
+static bool server_deadline_passed(void *ctx)
+{
+    return server_now() >= *(double *)ctx;
+}
+
+static void server_generate(struct server_worker *wk, struct server_job *job,
+			    const char *tag, const char *params,
+			    const char *seed, double deadline)
+{
+    game_params *p = default_params();
+    random_state *rs = wk->rs;
+    const char *err;
+    char *desc, *aux = NULL, *pstr, *id;
+
+    err = decode_params_strict(p, params) ? validate_params(p, true) :
+	"malformed game parameters";
+    if (err) {
+	server_reply(job->conn, tag, "ERR", err);
+	free_params(p);
+	return;
+    }
+
+    if (seed)
+	rs = random_new(seed, strlen(seed));
+    if (p->reuse > 1)
+	pthread_mutex_lock(&wk->srv->reuse_lock);
+    desc = generate_desc(p, rs, &aux,
+			 deadline ? server_deadline_passed : NULL, &deadline);
+    if (p->reuse > 1)
+	pthread_mutex_unlock(&wk->srv->reuse_lock);
+    if (seed)
+	random_free(rs);
+    if (!desc) {
+	server_reply(job->conn, tag, "ERR", "deadline");
+	free_params(p);
+	return;
+    }
+
+    pstr = encode_params(p, false);
+    id = snewn(strlen(pstr) + strlen(desc) + strlen(aux) + 3, char);
+    sprintf(id, "%s:%s %s", pstr, desc, aux);
+    server_reply(job->conn, tag, "OK", id);
+
+    sfree(id);
+    sfree(pstr);
+    sfree(desc);
+    sfree(aux);
+    free_params(p);
+}
+
+static void server_solve(struct server_worker *wk, struct server_job *job,
+			 const char *tag, char *id, bool grade,
+			 double deadline)
+{
+    game_params *p;
+    game_state *s;
+    struct latin_solver_budget budget;
+    struct solver_options opts;
+    const char *err;
+    int i, a, ret;
+    double score;
+    char *out;
+
+    err = server_game(id, &p, &s);
+    if (err) {
+	server_reply(job->conn, tag, "ERR", err);
+	return;
+    }
+    a = p->w * p->w;
+
+    if (!wk->tt || wk->ttw != p->w || wk->ttdep != p->dep) {
+	latin_solver_tt_free(wk->tt);
+	wk->tt = latin_solver_tt_new(p->w, SERVER_TT_BYTES,
+				     LATIN_TT_REPLACE_WORK);
+	wk->ttw = p->w;
+	wk->ttdep = p->dep;
+    }
+
+    memset(&budget, 0, sizeof(budget));
+    budget.maxtime = deadline ? deadline - server_now() : SOLVE_MAX_TIME;
+    memset(&opts, 0, sizeof(opts));
+    opts.budget = &budget;
+    /* Table hits would make a grade's score depend on earlier requests. */
+    opts.tt = grade ? NULL : wk->tt;
+    opts.score = &score;
+
+    memcpy(s->grid, s->clues->immutable, a);
+    ret = budget.maxtime > 0 ?
+	solver_ex(s->grid, s->clues->impose, s->clues->forbid,
+		  p->w, p->dep, DIFF_UNREASONABLE, &opts) : diff_exhausted;
+
+    if (ret == diff_exhausted)
+	server_reply(job->conn, tag, "ERR", deadline ? "deadline" :
+		     "Solver gave up: this puzzle is too hard to solve in time");
+    else if (grade && ret < DIFFCOUNT) {
+	char buf[64];
+	sprintf(buf, "%s %.1f", numberball_diffnames[ret], score);
+	server_reply(job->conn, tag, "OK", buf);
+    } else if (grade)
+	server_reply(job->conn, tag, "OK",
+		     ret == diff_ambiguous ? "ambiguous" : "impossible");
+    else if (ret == diff_ambiguous)
+	server_reply(job->conn, tag, "ERR",
+		     "Multiple solutions exist for this puzzle");
+    else if (ret == diff_impossible)
+	server_reply(job->conn, tag, "ERR",
+		     "No solution exists for this puzzle");
+    else {
+	out = snewn(a+2, char);
+	out[0] = 'S';
+	for (i = 0; i < a; i++)
+	    out[i+1] = '0' + s->grid[i];
+	out[a+1] = '\0';
+	server_reply(job->conn, tag, "OK", out);
+	sfree(out);
+    }
+
+    free_game(s);
+    free_params(p);
+}
+
+/*
+ * Hash of a puzzle's canonical form, so that a backend can spot
+ * puzzles it already has under another arrangement.
+ */
+static void server_canon(struct server_job *job, const char *tag, char *id)
+{
+    game_params *p;
+    game_state *s;
+    unsigned char *sym, *canon;
+    const char *err;
+    char buf[32];
+    int w;
+
+    err = server_game(id, &p, &s);
+    if (err) {
+	server_reply(job->conn, tag, "ERR", err);
+	return;
+    }
+    w = p->w;
+    sym = snewn(w*w, unsigned char);
+    canon = snewn(w*w, unsigned char);
+
+    clue_symbols(w, s->clues->immutable, s->clues->impose,
+		 s->clues->forbid, sym);
+    if (check_errors_clues(w, sym))
+	server_reply(job->conn, tag, "ERR",
+		     "clues repeat a number in a row or column");
+    else {
+	canonical_clues(w, p->dep, sym, canon);
+	sprintf(buf, "%016llx",
+		(unsigned long long)clues_hash(w, p->dep, canon));
+	server_reply(job->conn, tag, "OK", buf);
+    }
+
+    sfree(sym);
+    sfree(canon);
+    free_game(s);
+    free_params(p);
+}
+
+static void server_handle(struct server_worker *wk, struct server_job *job)
+{
+    char *words[SERVER_MAX_WORDS], *seed = NULL, *q = job->line;
+    double deadline = 0.0;
+    int nwords = 0, i;
+
+    while (nwords < SERVER_MAX_WORDS) {
+	while (*q == ' ' || *q == '\t' || *q == '\r')
+	    *q++ = '\0';
+	if (!*q)
+	    break;
+	words[nwords++] = q;
+	while (*q && *q != ' ' && *q != '\t' && *q != '\r')
+	    q++;
+    }
+    if (nwords < 3) {
+	server_reply(job->conn, nwords ? words[0] : "-", "ERR",
+		     "expected <tag> <command> <argument>");
+	return;
+    }
+
+    for (i = 3; i < nwords; i++) {
+	if (!strncmp(words[i], "seed=", 5))
+	    seed = words[i] + 5;
+	else if (!strncmp(words[i], "deadline=", 9)) {
+	    char *end;
+	    double ms = strtod(words[i] + 9, &end);
+	    /* The negation also catches NaN. */
+	    if (end == words[i] + 9 || *end || !(ms >= 0)) {
+		server_reply(job->conn, words[0], "ERR",
+			     "deadline expects a number of milliseconds");
+		return;
+	    }
+	    deadline = job->received + ms / 1000.0;
+	} else {
+	    server_reply(job->conn, words[0], "ERR", "unrecognised option");
+	    return;
+	}
+    }
+
+    if (deadline && server_now() >= deadline)
+	server_reply(job->conn, words[0], "ERR", "deadline");
+    else if (!strcmp(words[1], "GENERATE"))
+	server_generate(wk, job, words[0], words[2], seed, deadline);
+    else if (!strcmp(words[1], "SOLVE"))
+	server_solve(wk, job, words[0], words[2], false, deadline);
+    else if (!strcmp(words[1], "GRADE"))
+	server_solve(wk, job, words[0], words[2], true, deadline);
+    else if (!strcmp(words[1], "CANON"))
+	server_canon(job, words[0], words[2]);
+    else
+	server_reply(job->conn, words[0], "ERR", "unrecognised command");
+}
+
+static void *server_worker_main(void *vwk)
+{
+    struct server_worker *wk = (struct server_worker *)vwk;
+    struct server *srv = wk->srv;
+    struct server_job *job;
+    bool dead;
+
+    while (1) {
+	pthread_mutex_lock(&srv->lock);
+	while (!srv->head)
+	    pthread_cond_wait(&srv->work, &srv->lock);
+	job = srv->head;
+	srv->head = job->next;
+	if (!srv->head)
+	    srv->tail = NULL;
+	pthread_mutex_unlock(&srv->lock);
+
+	/* No point working on a reply which can't be sent. */
+	pthread_mutex_lock(&job->conn->lock);
+	dead = job->conn->dead;
+	pthread_mutex_unlock(&job->conn->lock);
+	if (!dead)
+	    server_handle(wk, job);
+	server_release(srv, job->conn, true);
+	sfree(job->line);
+	sfree(job);
+    }
+    return NULL;
+}
+
+/*
+ * Queue one request line, returning false if that gives the client
+ * its fill of jobs.
+ */
+static bool server_queue(struct server *srv, struct server_conn *conn,
+			 const char *line, int len)
+{
+    struct server_job *job = snew(struct server_job);
+    bool room;
+
+    job->line = snewn(len + 1, char);
+    memcpy(job->line, line, len);
+    job->line[len] = '\0';
+    job->received = server_now();
+    job->conn = conn;
+    job->next = NULL;
+
+    pthread_mutex_lock(&srv->lock);
+    if (srv->tail)
+	srv->tail->next = job;
+    else
+	srv->head = job;
+    srv->tail = job;
+    room = (++conn->jobs < SERVER_MAX_JOBS);
+    pthread_cond_signal(&srv->work);
+    pthread_mutex_unlock(&srv->lock);
+    return room;
+}
+
+/*
+ * Queue each whole line a client has sent, until it has its fill of
+ * jobs; the rest wait in its buffer, and it is paused.
+ */
+static void server_take_lines(struct server *srv, struct server_conn *conn)
+{
+    int start, i;
+
+    pthread_mutex_lock(&srv->lock);
+    conn->paused = (conn->jobs >= SERVER_MAX_JOBS);
+    pthread_mutex_unlock(&srv->lock);
+
+    for (start = i = 0; !conn->paused && i < conn->len; i++)
+	if (conn->buf[i] == '\n') {
+	    if (i > start)
+		conn->paused = !server_queue(srv, conn, conn->buf + start,
+					     i - start);
+	    start = i+1;
+	}
+    memmove(conn->buf, conn->buf + start, conn->len - start);
+    conn->len -= start;
+}
+
+/*
+ * Read what a client has sent and queue what lines it can. Returns
+ * false when the client has finished sending, or sent too long a line.
+ */
+static bool server_read(struct server *srv, struct server_conn *conn)
+{
+    ssize_t ret;
+
+    if (conn->size - conn->len < 4096) {
+	conn->size = conn->len + 8192;
+	conn->buf = sresize(conn->buf, conn->size, char);
+    }
+    ret = recv(conn->fd, conn->buf + conn->len, conn->size - conn->len, 0);
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+	return true;
+    if (ret <= 0)
+	return false;
+    conn->len += ret;
+
+    server_take_lines(srv, conn);
+    return conn->paused || conn->len < SERVER_MAX_LINE;
+}
+
+int main(int argc, char **argv)
+{
+    struct server srv;
+    struct server_worker *workers;
+    struct server_conn **conns = NULL;
+    struct pollfd *pfds = NULL;
+    struct sockaddr_un addr;
+    struct stat st;
+    const char *path = NULL, *quis = argv[0];
+    int nthreads = 4, nconns = 0, connsize = 0, lfd, i;
+    time_t seed = time(NULL);
+
+    while (--argc > 0) {
+        char *p = *++argv;
+        if (!strcmp(p, "-j") && argc > 1) {
+            nthreads = atoi(*++argv);
+            argc--;
+        } else if (*p == '-') {
+            fprintf(stderr, "%s: unrecognised option `%s'\n", quis, p);
+            return 1;
+        } else {
+            path = p;
+        }
+    }
+    if (!path || nthreads < 1) {
+        fprintf(stderr, "usage: numberball-server [-j threads] "
+		"<socket path>\n");
+        return 1;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: socket path too long\n", path);
+	return 1;
+    }
+
+    /* A socket left over from an earlier run would stop the bind. */
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+	unlink(path);
+    lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(lfd, 64) < 0) {
+	fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return 1;
+    }
+    if (pipe(srv.wakefd) < 0 ||
+	fcntl(srv.wakefd[1], F_SETFL, O_NONBLOCK) < 0) {
+	fprintf(stderr, "pipe: %s\n", strerror(errno));
+	return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.work, NULL);
+    pthread_mutex_init(&srv.reuse_lock, NULL);
+    srv.head = srv.tail = NULL;
+
+    workers = snewn(nthreads, struct server_worker);
+    for (i = 0; i < nthreads; i++) {
+	struct server_worker *wk = &workers[i];
+	time_t wseed = seed + i;
+
+	wk->srv = &srv;
+	wk->rs = random_new((void *)&wseed, sizeof(wseed));
+	wk->tt = NULL;
+	wk->ttw = wk->ttdep = 0;
+	if (pthread_create(&wk->thread, NULL, server_worker_main, wk)) {
+	    fprintf(stderr, "unable to start worker threads\n");
+	    return 1;
+	}
+    }
+
+    /*
+     * The main thread does all the reading, and the workers all the
+     * writing. A paused client isn't polled (a negative fd is
+     * skipped), but has its waiting lines taken each time round, and
+     * a worker making room for one wakes the poll.
+     */
+    while (1) {
+	if (connsize < nconns + 2) {
+	    connsize = nconns + 16;
+	    conns = sresize(conns, connsize, struct server_conn *);
+	    pfds = sresize(pfds, connsize, struct pollfd);
+	}
+	pfds[0].fd = lfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = srv.wakefd[0];
+	pfds[1].events = POLLIN;
+	for (i = 0; i < nconns; i++) {
+	    if (conns[i]->paused)
+		server_take_lines(&srv, conns[i]);
+	    pfds[i+2].fd = conns[i]->paused ? -1 : conns[i]->fd;
+	    pfds[i+2].events = POLLIN;
+	}
+	if (poll(pfds, nconns + 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "poll: %s\n", strerror(errno));
+	    return 1;
+	}
+
+	if (pfds[1].revents & POLLIN) {
+	    char buf[64];
+	    if (read(srv.wakefd[0], buf, sizeof(buf)) < 0 && errno != EINTR) {
+		fprintf(stderr, "read: %s\n", strerror(errno));
+		return 1;
+	    }
+	}
+
+	for (i = nconns; i-- > 0 ;) {
+	    if (!pfds[i+2].revents)
+		continue;
+	    if (!server_read(&srv, conns[i])) {
+		shutdown(conns[i]->fd, SHUT_RD);
+		server_release(&srv, conns[i], false);
+		conns[i] = conns[--nconns];
+	    }
+	}
+
+	if (pfds[0].revents & POLLIN) {
+	    int fd = accept(lfd, NULL, NULL);
+	    if (fd >= 0) {
+		struct server_conn *conn = snew(struct server_conn);
+		struct timeval tv;
+
+		tv.tv_sec = SERVER_SEND_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		conn->fd = fd;
+		conn->dead = false;
+		conn->jobs = 0;
+		conn->reading = true;
+		conn->paused = false;
+		pthread_mutex_init(&conn->lock, NULL);
+		conn->buf = NULL;
+		conn->len = conn->size = 0;
+		conns[nconns++] = conn;
+	    }
+	}
+    }
+}
+
+#endif
+
+#ifdef STANDALONE_SURVEY
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A survey of what the generator and grader do with given parameters,
+ * for choosing presets and time budgets. For each of the presets, or
+ * each params string on the command line, it generates a number of
+ * puzzles (in parallel, each from its own seed so that the results
+ * don't depend on the thread count), or with -f grades the game ids
+ * in a file instead; and reports for each set of parameters
+ *
+ *  - how many puzzles graded at each difficulty, or as ambiguous,
+ *    impossible or too hard for the solver's time limit;
+ *  - how many candidate grids the generator went through for each
+ *    puzzle before one came out at the target difficulty;
+ *  - how often each technique was used in grading;
+ *  - the spread of the solver's difficulty score;
+ *  - the CPU time taken per puzzle to generate and to grade;
+ *
+ * as CSV (the default) or JSON, one record per set, or with -p one
+ * per puzzle.
+ */
+
+enum { SURVEY_AMBIGUOUS = DIFFCOUNT, SURVEY_IMPOSSIBLE, SURVEY_EXHAUSTED,
+       SURVEY_NGRADES };
+static const char *const survey_gradenames[SURVEY_NGRADES] = {
+#define SURVEY_TITLE(upper,title,func,lower) #title,
+    DIFFLIST(SURVEY_TITLE)
+#undef SURVEY_TITLE
+    "ambiguous", "impossible", "exhausted"
+};
+
+struct survey_puzzle {
+    int grade;			       /* index into survey_gradenames */
+    int tries;			       /* 0 if loaded, not generated */
+    double gentime, gradetime;	       /* CPU seconds */
+    double score;
+    long nodes;
+    long steps[LATIN_NTECH];
+};
+
+struct survey_set {
+    char *name;			       /* params as given, or of the ids */
+    game_params *params;
+    int n;
+    char **ids;			       /* NULL when generating */
+    struct survey_puzzle *results;
+};
+
+struct survey {
+    struct survey_set *sets;
+    int nsets;
+    const char *seed;
+    pthread_mutex_t lock;	       /* for the next two */
+    int set, index;		       /* the next puzzle to do */
+};
+
+static double survey_cputime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void survey_grade(struct survey_puzzle *r, const game_params *p,
+			 digit *grid, bool *imp, bool *forb)
+{
+    struct latin_solver_stats stats;
+    struct latin_solver_budget budget;
+    struct solver_options opts;
+    double t0 = survey_cputime();
+    int ret, i;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&budget, 0, sizeof(budget));
+    budget.maxtime = SOLVE_MAX_TIME;
+    memset(&opts, 0, sizeof(opts));
+    opts.stats = &stats;
+    opts.budget = &budget;
+    opts.score = &r->score;
+    ret = solver_ex(grid, imp, forb, p->w, p->dep, DIFF_UNREASONABLE, &opts);
+    r->gradetime = survey_cputime() - t0;
+
+    r->grade = ret == diff_ambiguous ? SURVEY_AMBIGUOUS :
+	ret == diff_impossible ? SURVEY_IMPOSSIBLE :
+	ret < DIFFCOUNT ? ret : SURVEY_EXHAUSTED;
+    r->nodes = stats.nodes;
+    for (i = 0; i < LATIN_NTECH; i++)
+	r->steps[i] = stats.steps[i];
+}
+
+static void survey_one(struct survey *sv, struct survey_set *set, int index)
+{
+    struct survey_puzzle *r = &set->results[index];
+    const game_params *p = set->params;
+
+    memset(r, 0, sizeof(*r));
+    if (set->ids) {
+	char *desc = strchr(set->ids[index], ':') + 1;
+	game_state *s = new_game(NULL, p, desc);
+	int a = p->w * p->w;
+	bool *imp = snewn(a, bool), *forb = snewn(a, bool);
+
+	memcpy(s->grid, s->clues->immutable, a);
+	memcpy(imp, s->clues->impose, a * sizeof(bool));
+	memcpy(forb, s->clues->forbid, a * sizeof(bool));
+	survey_grade(r, p, s->grid, imp, forb);
+	sfree(imp);
+	sfree(forb);
+	free_game(s);
+    } else {
+	int a = p->w * p->w;
+	digit *grid = snewn(a, digit), *soln = snewn(a, digit);
+	bool *imp = snewn(a, bool), *forb = snewn(a, bool);
+	char *seed = snewn(strlen(sv->seed) + strlen(set->name) + 32, char);
+	random_state *rs;
+	double t0;
+
+	sprintf(seed, "%s/%s/%d", sv->seed, set->name, index);
+	rs = random_new(seed, strlen(seed));
+	t0 = survey_cputime();
+	generate_puzzle(p, rs, grid, imp, forb, soln, NULL, NULL, &r->tries);
+	r->gentime = survey_cputime() - t0;
+	survey_grade(r, p, grid, imp, forb);
+
+	random_free(rs);
+	sfree(seed);
+	sfree(grid);
+	sfree(soln);
+	sfree(imp);
+	sfree(forb);
+    }
+}
+
+static void *survey_worker(void *ctx)
+{
+    struct survey *sv = (struct survey *)ctx;
+
+    while (1) {
+	struct survey_set *set;
+	int index;
+
+	pthread_mutex_lock(&sv->lock);
+	while (sv->set < sv->nsets && sv->index >= sv->sets[sv->set].n) {
+	    sv->set++;
+	    sv->index = 0;
+	}
+	if (sv->set == sv->nsets) {
+	    pthread_mutex_unlock(&sv->lock);
+	    return NULL;
+	}
+	set = &sv->sets[sv->set];
+	index = sv->index++;
+	pthread_mutex_unlock(&sv->lock);
+
+	survey_one(sv, set, index);
+    }
+}
+
+static struct survey_set *survey_add(struct survey *sv, const char *name,
+				     game_params *params)
+{
+    struct survey_set *set;
+
+    sv->sets = sresize(sv->sets, sv->nsets + 1, struct survey_set);
+    set = &sv->sets[sv->nsets++];
+    set->name = dupstr(name);
+    set->params = params;
+    set->n = 0;
+    set->ids = NULL;
+    set->results = NULL;
+    return set;
+}
+
+/*
+ * Read game ids, one per line, into a set for each params string.
+ */
+static bool survey_load(struct survey *sv, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    char *line;
+    int lineno = 0, i;
+
+    if (!fp) {
+	fprintf(stderr, "%s: unable to open\n", filename);
+	return false;
+    }
+    while ((line = fgetline(fp)) != NULL) {
+	struct survey_set *set = NULL;
+	game_params *p;
+	char *desc;
+	const char *err;
+
+	lineno++;
+	line[strcspn(line, "\r\n")] = '\0';
+	desc = strchr(line, ':');
+	if (!*line || !desc) {
+	    sfree(line);
+	    continue;
+	}
+	*desc = '\0';
+	p = default_params();
+	decode_params(p, line);
+	err = validate_params(p, false);
+	if (!err)
+	    err = validate_desc(p, desc + 1);
+	if (err) {
+	    fprintf(stderr, "%s:%d: %s\n", filename, lineno, err);
+	    free_params(p);
+	    sfree(line);
+	    continue;
+	}
+
+	for (i = 0; i < sv->nsets; i++)
+	    if (sv->sets[i].ids && !strcmp(sv->sets[i].name, line))
+		set = &sv->sets[i];
+	if (set) {
+	    free_params(p);
+	} else {
+	    set = survey_add(sv, line, p);
+	    set->ids = snewn(1, char *);
+	}
+	*desc = ':';
+
+	set->ids = sresize(set->ids, set->n + 1, char *);
+	set->ids[set->n++] = line;
+    }
+    fclose(fp);
+    return true;
+}
+
+static void survey_print_set(const struct survey_set *set, bool json,
+			     bool last)
+{
+    int grades[SURVEY_NGRADES], i, j, maxtries = 0, ntried = 0;
+    long steps[LATIN_NTECH], tries = 0, nodes = 0;
+    double gentime = 0, maxgentime = 0, gradetime = 0, maxgradetime = 0;
+    double score = 0, minscore = 0, maxscore = 0;
+    int n = set->n ? set->n : 1;
+
+    for (i = 0; i < SURVEY_NGRADES; i++)
+	grades[i] = 0;
+    for (j = 0; j < LATIN_NTECH; j++)
+	steps[j] = 0;
+    for (i = 0; i < set->n; i++) {
+	const struct survey_puzzle *r = &set->results[i];
+	grades[r->grade]++;
+	if (r->tries) {
+	    ntried++;
+	    tries += r->tries;
+	    maxtries = max(maxtries, r->tries);
+	}
+	gentime += r->gentime;
+	maxgentime = max(maxgentime, r->gentime);
+	gradetime += r->gradetime;
+	maxgradetime = max(maxgradetime, r->gradetime);
+	nodes += r->nodes;
+	score += r->score;
+	minscore = i ? min(minscore, r->score) : r->score;
+	maxscore = max(maxscore, r->score);
+	for (j = 0; j < LATIN_NTECH; j++)
+	    steps[j] += r->steps[j];
+    }
+
+    if (json) {
+	printf("  {\"params\": \"%s\", \"puzzles\": %d,\n", set->name, set->n);
+	printf("   \"grades\": {");
+	for (i = 0; i < SURVEY_NGRADES; i++)
+	    printf("%s\"%s\": %d", i ? ", " : "", survey_gradenames[i],
+		   grades[i]);
+	printf("},\n");
+	if (ntried)
+	    printf("   \"tries\": {\"mean\": %.2f, \"max\": %d},\n",
+		   (double)tries / ntried, maxtries);
+	if (!set->ids)
+	    printf("   \"generate_ms\": {\"mean\": %.3f, \"max\": %.3f},\n",
+		   1000 * gentime / n, 1000 * maxgentime);
+	printf("   \"grade_ms\": {\"mean\": %.3f, \"max\": %.3f},\n",
+	       1000 * gradetime / n, 1000 * maxgradetime);
+	printf("   \"nodes_mean\": %.2f,\n", (double)nodes / n);
+	printf("   \"score\": {\"mean\": %.1f, \"min\": %.1f, \"max\": %.1f},\n",
+	       score / n, minscore, maxscore);
+	printf("   \"techniques\": {");
+	for (j = 0; j < LATIN_NTECH; j++)
+	    printf("%s\"%s\": %ld", j ? ", " : "", latin_technique_name(j),
+		   steps[j]);
+	printf("}}%s\n", last ? "" : ",");
+    } else {
+	printf("%s,%d", set->name, set->n);
+	for (i = 0; i < SURVEY_NGRADES; i++)
+	    printf(",%d", grades[i]);
+	if (ntried)
+	    printf(",%.2f,%d", (double)tries / ntried, maxtries);
+	else
+	    printf(",,");
+	if (!set->ids)
+	    printf(",%.3f,%.3f", 1000 * gentime / n, 1000 * maxgentime);
+	else
+	    printf(",,");
+	printf(",%.3f,%.3f,%.2f,%.1f,%.1f,%.1f", 1000 * gradetime / n,
+	       1000 * maxgradetime, (double)nodes / n, score / n, minscore,
+	       maxscore);
+	for (j = 0; j < LATIN_NTECH; j++)
+	    printf(",%ld", steps[j]);
+	printf("\n");
+    }
+}
+
+static void survey_print_puzzles(const struct survey_set *set, bool json,
+				 bool last)
+{
+    int i, j;
+
+    for (i = 0; i < set->n; i++) {
+	const struct survey_puzzle *r = &set->results[i];
+
+	if (json) {
+	    printf("  {\"params\": \"%s\", \"index\": %d, \"grade\": \"%s\", "
+		   "\"tries\": %d, \"generate_ms\": %.3f, "
+		   "\"grade_ms\": %.3f, \"nodes\": %ld, \"score\": %.1f, "
+		   "\"techniques\": {",
+		   set->name, i, survey_gradenames[r->grade], r->tries,
+		   1000 * r->gentime, 1000 * r->gradetime, r->nodes, r->score);
+	    for (j = 0; j < LATIN_NTECH; j++)
+		printf("%s\"%s\": %ld", j ? ", " : "",
+		       latin_technique_name(j), r->steps[j]);
+	    printf("}}%s\n", last && i == set->n-1 ? "" : ",");
+	} else {
+	    printf("%s,%d,%s,%d,%.3f,%.3f,%ld,%.1f", set->name, i,
+		   survey_gradenames[r->grade], r->tries, 1000 * r->gentime,
+		   1000 * r->gradetime, r->nodes, r->score);
+	    for (j = 0; j < LATIN_NTECH; j++)
+		printf(",%ld", r->steps[j]);
+	    printf("\n");
+	}
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct survey sv;
+    pthread_t *threads;
+    const char *quis = argv[0];
+    bool json = false, per_puzzle = false, loaded = false;
+    int n = 20, nthreads = 4, i, j;
+    char seedbuf[32];
+
+    memset(&sv, 0, sizeof(sv));
+    sprintf(seedbuf, "%ld", (long)time(NULL));
+    sv.seed = seedbuf;
+
+    while (--argc > 0) {
+        char *p = *++argv;
+        if (!strcmp(p, "-n") && argc > 1) {
+            n = atoi(*++argv);
+            argc--;
+        } else if (!strcmp(p, "-j") && argc > 1) {
+            nthreads = atoi(*++argv);
+            argc--;
+        } else if (!strcmp(p, "--seed") && argc > 1) {
+            sv.seed = *++argv;
+            argc--;
+        } else if (!strcmp(p, "-o") && argc > 1) {
+            p = *++argv;
+            argc--;
+            if (!strcmp(p, "json"))
+                json = true;
+            else if (strcmp(p, "csv")) {
+                fprintf(stderr, "%s: output format must be csv or json\n",
+                        quis);
+                return 1;
+            }
+        } else if (!strcmp(p, "-p")) {
+            per_puzzle = true;
+        } else if (!strcmp(p, "-f") && argc > 1) {
+            if (!survey_load(&sv, *++argv))
+                return 1;
+            argc--;
+            loaded = true;
+        } else if (*p == '-') {
+            fprintf(stderr, "%s: unrecognised option `%s'\n", quis, p);
+            fprintf(stderr, "usage: %s [-n puzzles] [-j threads] "
+                    "[--seed seed] [-o csv|json] [-p]\n"
+                    "       [-f gameidfile | params ...]\n", quis);
+            return 1;
+        } else {
+            game_params *params = default_params();
+            const char *err;
+
+            decode_params(params, p);
+            err = validate_params(params, true);
+            if (err) {
+                fprintf(stderr, "%s: %s: %s\n", quis, p, err);
+                free_params(params);
+                return 1;
+            }
+            survey_add(&sv, p, params);
+        }
+    }
+
+    /* By default, every preset. */
+    if (!sv.nsets && !loaded)
+	for (i = 0; i < lenof(numberball_presets); i++) {
+	    game_params *params = dup_params(&numberball_presets[i]);
+	    char *name = encode_params(params, true);
+	    survey_add(&sv, name, params);
+	    sfree(name);
+	}
+
+    for (i = 0; i < sv.nsets; i++) {
+	if (!sv.sets[i].ids)
+	    sv.sets[i].n = n;
+	sv.sets[i].results = snewn(sv.sets[i].n ? sv.sets[i].n : 1,
+				   struct survey_puzzle);
+    }
+
+    if (nthreads < 1)
+	nthreads = 1;
+    pthread_mutex_init(&sv.lock, NULL);
+    threads = snewn(nthreads, pthread_t);
+    for (i = 0; i < nthreads; i++)
+	if (pthread_create(&threads[i], NULL, survey_worker, &sv)) {
+	    fprintf(stderr, "%s: unable to start threads\n", quis);
+	    return 1;
+	}
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    sfree(threads);
+
+    if (json)
+	printf("[\n");
+    else if (per_puzzle) {
+	printf("params,index,grade,tries,generate_ms,grade_ms,nodes,score");
+	for (j = 0; j < LATIN_NTECH; j++)
+	    printf(",%s", latin_technique_name(j));
+	printf("\n");
+    } else {
+	printf("params,puzzles");
+	for (i = 0; i < SURVEY_NGRADES; i++)
+	    printf(",%s", survey_gradenames[i]);
+	printf(",tries_mean,tries_max,generate_ms_mean,generate_ms_max,"
+	       "grade_ms_mean,grade_ms_max,nodes_mean,score_mean,score_min,"
+	       "score_max");
+	for (j = 0; j < LATIN_NTECH; j++)
+	    printf(",%s", latin_technique_name(j));
+	printf("\n");
+    }
+    for (i = 0; i < sv.nsets; i++) {
+	if (per_puzzle)
+	    survey_print_puzzles(&sv.sets[i], json, i == sv.nsets-1);
+	else
+	    survey_print_set(&sv.sets[i], json, i == sv.nsets-1);
+    }
+    if (json)
+	printf("]\n");
+
+    return 0;
+}
+
+#endif
+
+#ifdef STANDALONE_BENCH
+
+#include <time.h>
+
+/*
+ * Benchmark of the recursive tier's branching heuristics. For each of
+ * the presets, or each params string on the command line, it
+ * generates a corpus of puzzles (or with -f reads game ids instead),
+ * then solves every puzzle with each strategy in turn - or with -u
+ * checks it for uniqueness as the generator does, which is where
+ * most guessing happens - and reports per strategy how many guesses
+ * and how much time that took: mean, median, 99th percentile and
+ * worst case, since what restarts are for is the tail.
+ *
+ * With -B it instead compares grading each set one puzzle at a time
+ * against grading it with the batch solver.
+ */
+
+struct bench_strategy {
+    const char *name;
+    int branch;
+    bool restarts;
+};
+static const struct bench_strategy bench_strategies[] = {
+    {"first", LATIN_BRANCH_FIRST, false},
+    {"degree", LATIN_BRANCH_DEGREE, false},
+    {"domwdeg", LATIN_BRANCH_DOMWDEG, false},
+    {"first+luby", LATIN_BRANCH_FIRST, true},
+    {"domwdeg+luby", LATIN_BRANCH_DOMWDEG, true},
+};
+#define BENCH_RESTART_UNIT 32
+
+struct bench_puzzle {
+    digit *clues, *soln;
+    bool *imp, *forb;
+};
+
+struct bench_set {
+    char *name;
+    game_params *params;
+    struct bench_puzzle *puzzles;
+    int n, size;
+};
+
+static double bench_cputime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct bench_puzzle *bench_add(struct bench_set *set)
+{
+    struct bench_puzzle *bp;
+    int a = set->params->w * set->params->w;
+
+    if (set->n >= set->size) {
+	set->size = set->size * 3 / 2 + 8;
+	set->puzzles = sresize(set->puzzles, set->size, struct bench_puzzle);
+    }
+    bp = &set->puzzles[set->n++];
+    bp->clues = snewn(a, digit);
+    bp->soln = snewn(a, digit);
+    bp->imp = snewn(a, bool);
+    bp->forb = snewn(a, bool);
+    return bp;
+}
+
+static int bench_cmp_long(const void *av, const void *bv)
+{
+    long a = *(const long *)av, b = *(const long *)bv;
+    return a < b ? -1 : a > b ? +1 : 0;
+}
+
+static int bench_cmp_double(const void *av, const void *bv)
+{
+    double a = *(const double *)av, b = *(const double *)bv;
+    return a < b ? -1 : a > b ? +1 : 0;
+}
+
+/*
+ * Solve (or check the uniqueness of) one puzzle with one strategy,
+ * returning the guesses made and setting *time and *result.
+ */
+static long bench_one(const game_params *p, const struct bench_puzzle *bp,
+		      const struct bench_strategy *st, bool unique,
+		      int index, double *time, int *result, long *restarts)
+{
+    int w = p->w, a = w*w;
+    digit *grid = snewn(a, digit);
+    bool *imp = snewn(a, bool), *forb = snewn(a, bool);
+    struct latin_solver ls;
+    struct latin_solver_stats stats;
+    struct latin_solver_budget budget;
+    struct latin_solver_search search;
+    random_state *rs = NULL;
+    char seed[32];
+    double t0;
+
+    memcpy(grid, bp->clues, a);
+    memcpy(imp, bp->imp, a * sizeof(bool));
+    memcpy(forb, bp->forb, a * sizeof(bool));
+    memset(&stats, 0, sizeof(stats));
+    memset(&budget, 0, sizeof(budget));
+    budget.maxtime = SOLVE_MAX_TIME;
+    if (st->restarts) {
+	sprintf(seed, "bench/%d", index);
+	rs = random_new(seed, strlen(seed));
+    }
+    latin_solver_search_init(&search, w, st->branch, rs,
+			     BENCH_RESTART_UNIT);
+
+    t0 = bench_cputime();
+    latin_solver_alloc(&ls, grid, w, p->dep, imp, forb);
+    ls.stats = &stats;
+    ls.budget = &budget;
+    ls.search = &search;
+    if (unique)
+	*result = latin_solver_unique(&ls, bp->soln,
+				      DIFF_EASY, DIFF_HARD, DIFF_EXTREME,
+				      DIFF_EXTREME, DIFF_UNREASONABLE,
+				      numberball_solvers, NULL, NULL, NULL);
+    else
+	*result = latin_solver_main(&ls, DIFF_UNREASONABLE,
+				    DIFF_EASY, DIFF_HARD, DIFF_EXTREME,
+				    DIFF_EXTREME, DIFF_UNREASONABLE,
+				    numberball_solvers, NULL, NULL, NULL);
+    latin_solver_free(&ls);
+    *time = bench_cputime() - t0;
+    *restarts = search.restarts;
+
+    latin_solver_search_free(&search);
+    if (rs)
+	random_free(rs);
+    sfree(grid);
+    sfree(imp);
+    sfree(forb);
+    return stats.nodes;
+}
+
+static void bench_set_run(const struct bench_set *set, bool unique)
+{
+    int n = set->n, i, k;
+    long *nodes = snewn(n ? n : 1, long);
+    double *times = snewn(n ? n : 1, double);
+    int *results = snewn(n ? n : 1, int);
+
+    for (k = 0; k < lenof(bench_strategies); k++) {
+	const struct bench_strategy *st = &bench_strategies[k];
+	long totnodes = 0, restarts = 0, r;
+	double tottime = 0;
+	int exhausted = 0, disagree = 0;
+
+	for (i = 0; i < n; i++) {
+	    int result;
+	    nodes[i] = bench_one(set->params, &set->puzzles[i], st, unique,
+				 i, &times[i], &result, &r);
+	    restarts += r;
+	    totnodes += nodes[i];
+	    tottime += times[i];
+	    if (result == (unique ? -1 : diff_exhausted))
+		exhausted++;
+	    else if (k == 0)
+		results[i] = result;
+	    else if (result != results[i])
+		disagree++;
+	}
+	qsort(nodes, n, sizeof(*nodes), bench_cmp_long);
+	qsort(times, n, sizeof(*times), bench_cmp_double);
+
+	printf("%-10s %-13s %5d %9.1f %7ld %7ld %8ld %9.3f %8.3f %8.3f %9.3f"
+	       " %8.2f %5d\n", set->name, st->name, n,
+	       n ? (double)totnodes / n : 0.0,
+	       n ? nodes[n/2] : 0, n ? nodes[(n-1) * 99 / 100] : 0,
+	       n ? nodes[n-1] : 0,
+	       n ? 1000 * tottime / n : 0.0, n ? 1000 * times[n/2] : 0.0,
+	       n ? 1000 * times[(n-1) * 99 / 100] : 0.0,
+	       n ? 1000 * times[n-1] : 0.0,
+	       n ? (double)restarts / n : 0.0, exhausted);
+	/* Every strategy must reach the same verdicts. */
+	if (disagree)
+	    printf("%-10s %-13s: %d results differ from %s\n", set->name,
+		   st->name, disagree, bench_strategies[0].name);
+    }
+
+    sfree(nodes);
+    sfree(times);
+    sfree(results);
+}
+
+/*
+ * With -B: grade the whole set one puzzle at a time and then with
+ * latin_solver_batch, and report the time per puzzle of each, and
+ * how many puzzles the batch finished without the ordinary solver.
+ */
+static void bench_set_batch(const struct bench_set *set)
+{
+    int n = set->n, w = set->params->w, a = w*w, i, easy = 0, disagree = 0;
+    digit *grids = snewn(n ? n*a : 1, digit);
+    bool *imps = snewn(n ? n*a : 1, bool), *forbs = snewn(n ? n*a : 1, bool);
+    int *scalar = snewn(n ? n : 1, int), *batch = snewn(n ? n : 1, int);
+    struct latin_solver_budget budget;
+    double t0, tscalar, tbatch;
+
+    for (i = 0; i < n; i++) {
+	memcpy(grids + i*a, set->puzzles[i].clues, a);
+	memcpy(imps + i*a, set->puzzles[i].imp, a * sizeof(bool));
+	memcpy(forbs + i*a, set->puzzles[i].forb, a * sizeof(bool));
+    }
+
+    t0 = bench_cputime();
+    for (i = 0; i < n; i++) {
+	digit *grid = snewn(a, digit);
+	memcpy(grid, grids + i*a, a);
+	scalar[i] = solver_limited(grid, imps + i*a, forbs + i*a, w,
+				   set->params->dep, DIFF_UNREASONABLE,
+				   0, SOLVE_MAX_TIME);
+	sfree(grid);
+    }
+    tscalar = bench_cputime() - t0;
+
+    memset(&budget, 0, sizeof(budget));
+    budget.maxtime = SOLVE_MAX_TIME;
+    t0 = bench_cputime();
+    latin_solver_batch(n, grids, w, set->params->dep, imps, forbs, batch,
+		       &budget, DIFF_UNREASONABLE,
+		       DIFF_EASY, DIFF_HARD, DIFF_EXTREME,
+		       DIFF_EXTREME, DIFF_UNREASONABLE,
+		       numberball_solvers, NULL, NULL, NULL);
+    tbatch = bench_cputime() - t0;
+
+    for (i = 0; i < n; i++) {
+	if (batch[i] != scalar[i])
+	    disagree++;
+	if (batch[i] == DIFF_EASY || batch[i] == diff_impossible)
+	    easy++;
+    }
+    printf("%-10s %5d %10.4f %10.4f %8.2f %8d\n", set->name, n,
+	   n ? 1000 * tscalar / n : 0.0, n ? 1000 * tbatch / n : 0.0,
+	   tbatch > 0 ? tscalar / tbatch : 0.0, easy);
+    /* The batch must grade exactly as the ordinary solver does. */
+    if (disagree)
+	printf("%-10s: %d batch results differ from scalar\n",
+	       set->name, disagree);
+
+    sfree(grids);
+    sfree(imps);
+    sfree(forbs);
+    sfree(scalar);
+    sfree(batch);
+}
+
+static struct bench_set *bench_find(struct bench_set **sets, int *nsets,
+				    const char *name, game_params *params)
+{
+    int i;
+
+    for (i = 0; i < *nsets; i++)
+	if (!strcmp((*sets)[i].name, name)) {
+	    free_params(params);
+	    return &(*sets)[i];
+	}
+    *sets = sresize(*sets, *nsets + 1, struct bench_set);
+    (*sets)[*nsets].name = dupstr(name);
+    (*sets)[*nsets].params = params;
+    (*sets)[*nsets].puzzles = NULL;
+    (*sets)[*nsets].n = (*sets)[*nsets].size = 0;
+    return &(*sets)[(*nsets)++];
+}
+
+/* Read game ids, one per line, solving each to get its solution. */
+static bool bench_load(struct bench_set **sets, int *nsets,
+		       const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    char *line;
+
+    if (!fp) {
+	fprintf(stderr, "%s: unable to open\n", filename);
+	return false;
+    }
+    while ((line = fgetline(fp)) != NULL) {
+	game_params *p;
+	game_state *s;
+	struct bench_set *set;
+	struct bench_puzzle *bp;
+	char *desc;
+	int a;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	desc = strchr(line, ':');
+	if (!desc) {
+	    sfree(line);
+	    continue;
+	}
+	*desc++ = '\0';
+	p = default_params();
+	decode_params(p, line);
+	if (validate_params(p, false) || validate_desc(p, desc)) {
+	    free_params(p);
+	    sfree(line);
+	    continue;
+	}
+	s = new_game(NULL, p, desc);
+	a = p->w * p->w;
+	/* Only unique puzzles have a solution to check against. */
+	memcpy(s->grid, s->clues->immutable, a);
+	memcpy(s->impose, s->clues->impose, a * sizeof(bool));
+	memcpy(s->forbid, s->clues->forbid, a * sizeof(bool));
+	if (solver_limited(s->grid, s->impose, s->forbid, p->w, p->dep,
+			   DIFF_UNREASONABLE, 0, SOLVE_MAX_TIME) < DIFFCOUNT) {
+	    set = bench_find(sets, nsets, line, dup_params(p));
+	    bp = bench_add(set);
+	    memcpy(bp->clues, s->clues->immutable, a);
+	    memcpy(bp->imp, s->clues->impose, a * sizeof(bool));
+	    memcpy(bp->forb, s->clues->forbid, a * sizeof(bool));
+	    memcpy(bp->soln, s->grid, a);
+	}
+	free_game(s);
+	free_params(p);
+	sfree(line);
+    }
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_set *sets = NULL;
+    const char *quis = argv[0], *seed = "bench";
+    bool unique = false, loaded = false, batch = false;
+    int nsets = 0, n = 20, i, j;
+    char **names = NULL;
+    int nnames = 0;
+
+    while (--argc > 0) {
+        char *p = *++argv;
+        if (!strcmp(p, "-n") && argc > 1) {
+            n = atoi(*++argv);
+            argc--;
+        } else if (!strcmp(p, "--seed") && argc > 1) {
+            seed = *++argv;
+            argc--;
+        } else if (!strcmp(p, "-u")) {
+            unique = true;
+        } else if (!strcmp(p, "-B")) {
+            batch = true;
+        } else if (!strcmp(p, "-f") && argc > 1) {
+            if (!bench_load(&sets, &nsets, *++argv))
+                return 1;
+            argc--;
+            loaded = true;
+        } else if (*p == '-') {
+            fprintf(stderr, "%s: unrecognised option `%s'\n", quis, p);
+            fprintf(stderr, "usage: %s [-u | -B] [-n puzzles] [--seed seed] "
+                    "[-f gameidfile | params ...]\n", quis);
+            return 1;
+        } else {
+            names = sresize(names, nnames + 1, char *);
+            names[nnames++] = p;
+        }
+    }
+
+    /* By default, every preset. */
+    if (!nnames && !loaded)
+	for (i = 0; i < lenof(numberball_presets); i++) {
+	    names = sresize(names, nnames + 1, char *);
+	    names[nnames++] = encode_params(&numberball_presets[i], true);
+	}
+
+    for (i = 0; i < nnames; i++) {
+	game_params *params = default_params();
+	struct bench_set *set;
+	const char *err;
+
+	decode_params(params, names[i]);
+	err = validate_params(params, true);
+	if (err) {
+	    fprintf(stderr, "%s: %s: %s\n", quis, names[i], err);
+	    return 1;
+	}
+	set = bench_find(&sets, &nsets, names[i], params);
+	params = set->params;
+	for (j = 0; j < n; j++) {
+	    struct bench_puzzle *bp = bench_add(set);
+	    char *s = snewn(strlen(seed) + strlen(names[i]) + 32, char);
+	    random_state *rs;
+
+	    sprintf(s, "%s/%s/%d", seed, names[i], j);
+	    rs = random_new(s, strlen(s));
+	    generate_puzzle(params, rs, bp->clues, bp->imp, bp->forb,
+			    bp->soln, NULL, NULL, NULL);
+	    random_free(rs);
+	    sfree(s);
+	}
+    }
+
+    if (batch) {
+	printf("%-10s %5s %10s %10s %8s %8s\n", "params", "n",
+	       "scalar ms", "batch ms", "speedup", "simple");
+	for (i = 0; i < nsets; i++)
+	    bench_set_batch(&sets[i]);
+	return 0;
+    }
+
+    printf("%-10s %-13s %5s %9s %7s %7s %8s %9s %8s %8s %9s %8s %5s\n",
+	   "params", "strategy", "n", "nodes", "median", "p99", "max",
+	   "ms", "median", "p99", "max", "restarts", "gaveup");
+    for (i = 0; i < nsets; i++)
+	bench_set_run(&sets[i], unique);
 
     return 0;
 }